@@ -0,0 +1,884 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#include "BgzfPipeline.h"
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#include <iostream>
+using namespace std;
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+static const unsigned char BGZF_EMPTY_BLOCK[28]={31,139,8,4,0,0,0,0,0,255,6,0,'B','C',2,0,27,0,3,0,0,0,0,0,0,0,0,0};
+
+static inline uint32_t readUInt32LE(const unsigned char* p){
+	return (uint32_t)p[0]|((uint32_t)p[1]<<8)|((uint32_t)p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static inline void writeUInt32LE(unsigned char* p,uint32_t value){
+	p[0]=value&0xff;
+	p[1]=(value>>8)&0xff;
+	p[2]=(value>>16)&0xff;
+	p[3]=(value>>24)&0xff;
+}
+
+static inline uint32_t blockCrc32(const unsigned char* data,int len){
+#ifdef HAVE_LIBDEFLATE
+	return libdeflate_crc32(0,data,len);
+#else
+	return crc32(crc32(0L,Z_NULL,0),data,len);
+#endif
+}
+
+/*
+ the inflate or deflate state of one thread: a zlib stream, or with HAVE_LIBDEFLATE, a
+ libdeflate (de)compressor. Stored blocks (level 0) are always left to zlib
+ */
+class BgzfCodec{
+public:
+	BgzfCodec(bool compress,int compressLevel);
+	~BgzfCodec();
+
+	//inflate one whole bgzf block. Return false if it is corrupted
+	bool inflateBlock(BgzfBlock* block);
+
+	//deflate the uncompressed data of a block into a whole bgzf block
+	bool deflateBlock(BgzfBlock* block);
+
+	bool compress;
+	z_stream zs;
+	bool zsReady;
+#ifdef HAVE_LIBDEFLATE
+	struct libdeflate_compressor* compressor;
+	struct libdeflate_decompressor* decompressor;
+#endif
+
+protected:
+	void finishBlock(BgzfBlock* block,int compressedDataLength);
+};
+
+BgzfCodec::BgzfCodec(bool _compress,int compressLevel):compress(_compress),zsReady(false){
+	memset(&zs,0,sizeof(z_stream));
+
+#ifdef HAVE_LIBDEFLATE
+	compressor=NULL;
+	decompressor=NULL;
+
+	if(!compress){
+		decompressor=libdeflate_alloc_decompressor();
+		return;
+	}
+
+	if(compressLevel!=0){
+		compressor=libdeflate_alloc_compressor(compressLevel<0?6:compressLevel);
+		return;
+	}
+#endif
+
+	if(compress){
+		zsReady=(deflateInit2(&zs,compressLevel,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY)==Z_OK);
+	}else{
+		zsReady=(inflateInit2(&zs,-15)==Z_OK);
+	}
+}
+
+BgzfCodec::~BgzfCodec(){
+	if(zsReady){
+		if(compress){
+			deflateEnd(&zs);
+		}else{
+			inflateEnd(&zs);
+		}
+	}
+
+#ifdef HAVE_LIBDEFLATE
+	if(compressor){
+		libdeflate_free_compressor(compressor);
+	}
+
+	if(decompressor){
+		libdeflate_free_decompressor(decompressor);
+	}
+#endif
+}
+
+bool BgzfCodec::inflateBlock(BgzfBlock* block){
+	const unsigned char* p=block->compressed;
+	int xlen=p[10]|(p[11]<<8);
+	int dataOffset=12+xlen;
+	int dataLength=block->compressedLength-dataOffset-BGZF_FOOTER_SIZE;
+	uint32_t crc=readUInt32LE(p+block->compressedLength-8);
+	uint32_t isize=readUInt32LE(p+block->compressedLength-4);
+
+	if(dataLength<0 || isize>BGZF_MAX_BLOCK_SIZE){
+		return false;
+	}
+
+#ifdef HAVE_LIBDEFLATE
+	size_t inflatedLength;
+	if(!decompressor || libdeflate_deflate_decompress(decompressor,p+dataOffset,dataLength,block->uncompressed,BGZF_MAX_BLOCK_SIZE,&inflatedLength)!=LIBDEFLATE_SUCCESS){
+		return false;
+	}
+
+	block->uncompressedLength=inflatedLength;
+#else
+	if(!zsReady || inflateReset(&zs)!=Z_OK){
+		return false;
+	}
+
+	zs.next_in=(Bytef*)p+dataOffset;
+	zs.avail_in=dataLength;
+	zs.next_out=block->uncompressed;
+	zs.avail_out=BGZF_MAX_BLOCK_SIZE;
+
+	int ret=inflate(&zs,Z_FINISH);
+	if(ret!=Z_STREAM_END){
+		return false;
+	}
+
+	block->uncompressedLength=BGZF_MAX_BLOCK_SIZE-zs.avail_out;
+#endif
+
+	return (uint32_t)block->uncompressedLength==isize && blockCrc32(block->uncompressed,block->uncompressedLength)==crc;
+}
+
+bool BgzfCodec::deflateBlock(BgzfBlock* block){
+	unsigned char* out=block->compressed+BGZF_HEADER_SIZE;
+	int room=BGZF_MAX_BLOCK_SIZE-BGZF_HEADER_SIZE-BGZF_FOOTER_SIZE;
+
+	//neither can run out of room with BGZF_BLOCK_DATA_SIZE input: even stored blocks fit
+#ifdef HAVE_LIBDEFLATE
+	if(compressor){
+		size_t compressedDataLength=libdeflate_deflate_compress(compressor,block->uncompressed,block->uncompressedLength,out,room);
+		if(compressedDataLength==0){
+			return false;
+		}
+
+		finishBlock(block,compressedDataLength);
+		return true;
+	}
+#endif
+
+	if(!zsReady || deflateReset(&zs)!=Z_OK){
+		return false;
+	}
+
+	zs.next_in=block->uncompressed;
+	zs.avail_in=block->uncompressedLength;
+	zs.next_out=out;
+	zs.avail_out=room;
+
+	if(deflate(&zs,Z_FINISH)!=Z_STREAM_END){
+		return false;
+	}
+
+	finishBlock(block,room-zs.avail_out);
+	return true;
+}
+
+//the bgzf header and footer around compressedDataLength bytes of deflated data
+void BgzfCodec::finishBlock(BgzfBlock* block,int compressedDataLength){
+	unsigned char* p=block->compressed;
+
+	block->compressedLength=BGZF_HEADER_SIZE+compressedDataLength+BGZF_FOOTER_SIZE;
+
+	memcpy(p,BGZF_EMPTY_BLOCK,BGZF_HEADER_SIZE);
+	p[16]=(block->compressedLength-1)&0xff;
+	p[17]=((block->compressedLength-1)>>8)&0xff;
+
+	unsigned char* footer=p+block->compressedLength-BGZF_FOOTER_SIZE;
+	writeUInt32LE(footer,blockCrc32(block->uncompressed,block->uncompressedLength));
+	writeUInt32LE(footer+4,block->uncompressedLength);
+}
+
+static inline bool runCodec(BgzfCodec& codec,BgzfBlock* block){
+	return codec.compress?codec.deflateBlock(block):codec.inflateBlock(block);
+}
+
+static void* bgzfWorker(void* data){
+	BgzfWorkerPool* pool=(BgzfWorkerPool*)data;
+
+	BgzfCodec codec(pool->compress,pool->compressLevel);
+
+	while(true){
+		pthread_mutex_lock(&pool->lock);
+		while(pool->jobs.empty() && !pool->shutdown){
+			pthread_cond_wait(&pool->jobReady,&pool->lock);
+		}
+
+		if(pool->jobs.empty()){
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		BgzfBlock* block=pool->jobs.front();
+		pool->jobs.pop_front();
+		pthread_mutex_unlock(&pool->lock);
+
+		bool success=runCodec(codec,block);
+
+		pthread_mutex_lock(&pool->lock);
+		block->failed=!success;
+		block->done=true;
+		pthread_cond_broadcast(&pool->jobDone);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+BgzfWorkerPool::BgzfWorkerPool(int numThreads,bool _compress,int _compressLevel):compress(_compress),compressLevel(_compressLevel),shutdown(false),inlineCodec(NULL){
+	pthread_mutex_init(&lock,NULL);
+	pthread_cond_init(&jobReady,NULL);
+	pthread_cond_init(&jobDone,NULL);
+
+	if(numThreads<1){
+		inlineCodec=new BgzfCodec(compress,compressLevel);
+		return;
+	}
+
+	threads.resize(numThreads);
+	for(int t=0;t<numThreads;t++){
+		pthread_create(&threads[t],NULL,bgzfWorker,this);
+	}
+}
+
+BgzfWorkerPool::~BgzfWorkerPool(){
+	pthread_mutex_lock(&lock);
+	shutdown=true;
+	pthread_cond_broadcast(&jobReady);
+	pthread_mutex_unlock(&lock);
+
+	for(unsigned int t=0;t<threads.size();t++){
+		pthread_join(threads[t],NULL);
+	}
+
+	if(inlineCodec){
+		delete inlineCodec;
+	}
+
+	pthread_cond_destroy(&jobDone);
+	pthread_cond_destroy(&jobReady);
+	pthread_mutex_destroy(&lock);
+}
+
+void BgzfWorkerPool::submit(BgzfBlock* block){
+	if(threads.empty()){
+		block->failed=!runCodec(*inlineCodec,block);
+		block->done=true;
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	block->done=false;
+	block->failed=false;
+	jobs.push_back(block);
+	pthread_cond_signal(&jobReady);
+	pthread_mutex_unlock(&lock);
+}
+
+void BgzfWorkerPool::waitDone(BgzfBlock* block){
+	if(threads.empty()){
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	while(!block->done){
+		pthread_cond_wait(&jobDone,&lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+BgzfMTReader::BgzfMTReader(int fd,int numThreads):pool(numThreads,false,0),current(NULL),currentOffset(0),eof(false),eofMarker(false),error(false),compressedTotal(0){
+	fin=fdopen(fd,"rb");
+	if(!fin){
+		error=true;
+	}
+	//without threads there is nothing to keep busy; one block ahead is enough
+	maxInFlight=numThreads<1?1:4*numThreads+4;
+}
+
+BgzfMTReader::~BgzfMTReader(){
+	//let the workers finish with the blocks still queued before freeing them
+	for(deque<BgzfBlock*>::iterator i=inFlight.begin();i!=inFlight.end();i++){
+		pool.waitDone(*i);
+		delete *i;
+	}
+
+	if(current){
+		delete current;
+	}
+
+	for(vector<BgzfBlock*>::iterator i=freeBlocks.begin();i!=freeBlocks.end();i++){
+		delete *i;
+	}
+
+	if(fin){
+		fclose(fin);
+	}
+}
+
+bool BgzfMTReader::readRawBlock(BgzfBlock* block){
+	unsigned char* p=block->compressed;
+
+	size_t count=fread(p,1,12,fin);
+	if(count==0 && feof(fin)){
+		eof=true;
+		if(!eofMarker){
+			cerr<<"bgzf EOF marker is absent: the input is probably truncated"<<endl;
+		}
+		return false;
+	}
+
+	if(count!=12 || p[0]!=31 || p[1]!=139 || p[2]!=8 || !(p[3]&4)){
+		cerr<<"input is not in bgzf format"<<endl;
+		error=true;
+		return false;
+	}
+
+	int xlen=p[10]|(p[11]<<8);
+	if(12+xlen>BGZF_MAX_BLOCK_SIZE || fread(p+12,1,xlen,fin)!=(size_t)xlen){
+		error=true;
+		return false;
+	}
+
+	//the BC subfield holds the block size
+	int blockSize=-1;
+	for(int x=12;x+4<=12+xlen;){
+		int slen=p[x+2]|(p[x+3]<<8);
+		if(p[x]=='B' && p[x+1]=='C' && slen==2){
+			blockSize=(p[x+4]|(p[x+5]<<8))+1;
+			break;
+		}
+		x+=4+slen;
+	}
+
+	int remaining=blockSize-12-xlen;
+	if(blockSize<0 || remaining<BGZF_FOOTER_SIZE || blockSize>BGZF_MAX_BLOCK_SIZE || fread(p+12+xlen,1,remaining,fin)!=(size_t)remaining){
+		cerr<<"truncated or corrupted bgzf block"<<endl;
+		error=true;
+		return false;
+	}
+
+	block->compressedLength=blockSize;
+	compressedTotal+=blockSize;
+	eofMarker=(blockSize==(int)sizeof(BGZF_EMPTY_BLOCK) && memcmp(p,BGZF_EMPTY_BLOCK,sizeof(BGZF_EMPTY_BLOCK))==0);
+
+	return true;
+}
+
+void BgzfMTReader::fillInFlight(){
+	while(!eof && !error && inFlight.size()<maxInFlight){
+		BgzfBlock* block;
+		if(freeBlocks.empty()){
+			block=new BgzfBlock;
+		}else{
+			block=freeBlocks.back();
+			freeBlocks.pop_back();
+		}
+
+		if(!readRawBlock(block)){
+			freeBlocks.push_back(block);
+			break;
+		}
+
+		inFlight.push_back(block);
+		pool.submit(block);
+	}
+}
+
+bool BgzfMTReader::nextBlock(){
+	if(current){
+		freeBlocks.push_back(current);
+		current=NULL;
+	}
+
+	currentOffset=0;
+
+	while(true){
+		fillInFlight();
+
+		if(inFlight.empty()){
+			return false;
+		}
+
+		BgzfBlock* block=inFlight.front();
+		inFlight.pop_front();
+		pool.waitDone(block);
+
+		if(block->failed){
+			cerr<<"cannot inflate bgzf block"<<endl;
+			error=true;
+			freeBlocks.push_back(block);
+			return false;
+		}
+
+		if(block->uncompressedLength>0){
+			current=block;
+			return true;
+		}
+
+		//empty blocks (e.g., the EOF marker) carry no data
+		freeBlocks.push_back(block);
+	}
+}
+
+int BgzfMTReader::read(void* data,int len){
+	int copied=0;
+	unsigned char* dst=(unsigned char*)data;
+
+	while(copied<len){
+		if(!current || currentOffset>=current->uncompressedLength){
+			if(!nextBlock()){
+				break;
+			}
+		}
+
+		int available=current->uncompressedLength-currentOffset;
+		int toCopy=(len-copied<available)?(len-copied):available;
+		memcpy(dst+copied,current->uncompressed+currentOffset,toCopy);
+		copied+=toCopy;
+		currentOffset+=toCopy;
+	}
+
+	return error?-1:copied;
+}
+
+const unsigned char* BgzfMTReader::readView(int len,vector<unsigned char>& straddle){
+	if(!current || currentOffset>=current->uncompressedLength){
+		if(!nextBlock()){
+			return NULL;
+		}
+	}
+
+	if(current->uncompressedLength-currentOffset>=len){
+		const unsigned char* data=current->uncompressed+currentOffset;
+		currentOffset+=len;
+		return data;
+	}
+
+	if(straddle.size()<(size_t)len){
+		straddle.resize(len);
+	}
+
+	return read(&straddle[0],len)==len?&straddle[0]:NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+BgzfMTWriter::BgzfMTWriter(int fd,int numThreads,int compressLevel):pool(numThreads,true,compressLevel<0?Z_DEFAULT_COMPRESSION:compressLevel),current(NULL),error(false),closed(false),compressedTotal(0){
+	fout=fdopen(fd,"wb");
+	if(!fout){
+		error=true;
+	}
+	maxInFlight=numThreads<1?1:4*numThreads+4;
+}
+
+BgzfMTWriter::~BgzfMTWriter(){
+	if(!closed){
+		close();
+	}
+
+	for(vector<BgzfBlock*>::iterator i=freeBlocks.begin();i!=freeBlocks.end();i++){
+		delete *i;
+	}
+}
+
+//wait for the oldest block and write it out
+void BgzfMTWriter::writeHead(){
+	BgzfBlock* block=inFlight.front();
+	inFlight.pop_front();
+	pool.waitDone(block);
+
+	if(block->failed){
+		cerr<<"cannot deflate bgzf block"<<endl;
+		error=true;
+	}else if(!error && fwrite(block->compressed,1,block->compressedLength,fout)!=(size_t)block->compressedLength){
+		cerr<<"cannot write bgzf block"<<endl;
+		error=true;
+	}
+
+	compressedTotal+=block->compressedLength;
+	freeBlocks.push_back(block);
+}
+
+void BgzfMTWriter::submitCurrent(){
+	if(!current){
+		return;
+	}
+
+	if(current->uncompressedLength==0){
+		freeBlocks.push_back(current);
+		current=NULL;
+		return;
+	}
+
+	while(inFlight.size()>=maxInFlight){
+		writeHead();
+	}
+
+	inFlight.push_back(current);
+	pool.submit(current);
+	current=NULL;
+}
+
+int BgzfMTWriter::write(const void* data,int len){
+	const unsigned char* src=(const unsigned char*)data;
+	int written=0;
+
+	while(written<len){
+		if(!current){
+			if(freeBlocks.empty()){
+				current=new BgzfBlock;
+			}else{
+				current=freeBlocks.back();
+				freeBlocks.pop_back();
+			}
+			current->uncompressedLength=0;
+		}
+
+		int room=BGZF_BLOCK_DATA_SIZE-current->uncompressedLength;
+		int toCopy=(len-written<room)?(len-written):room;
+		memcpy(current->uncompressed+current->uncompressedLength,src+written,toCopy);
+		current->uncompressedLength+=toCopy;
+		written+=toCopy;
+
+		if(current->uncompressedLength==BGZF_BLOCK_DATA_SIZE){
+			submitCurrent();
+		}
+	}
+
+	return error?-1:len;
+}
+
+int BgzfMTWriter::close(){
+	if(closed){
+		return error?-1:0;
+	}
+
+	closed=true;
+
+	submitCurrent();
+	while(!inFlight.empty()){
+		writeHead();
+	}
+
+	if(fout){
+		if(!error && fwrite(BGZF_EMPTY_BLOCK,1,sizeof(BGZF_EMPTY_BLOCK),fout)!=sizeof(BGZF_EMPTY_BLOCK)){
+			error=true;
+		}
+		compressedTotal+=sizeof(BGZF_EMPTY_BLOCK);
+
+		if(fclose(fout)!=0){
+			error=true;
+		}
+		fout=NULL;
+	}
+
+	return error?-1:0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+BamStreamReader::BamStreamReader(int fd,int numThreads):bgzf(fd,numThreads),header(NULL){
+}
+
+BamStreamReader::~BamStreamReader(){
+	if(header){
+		bam_header_destroy(header);
+	}
+}
+
+bool BamStreamReader::readHeader(){
+	char magic[4];
+	int32_t l_text;
+
+	if(bgzf.read(magic,4)!=4 || strncmp(magic,"BAM\1",4)!=0){
+		cerr<<"input is not a bam file"<<endl;
+		return false;
+	}
+
+	if(bgzf.read(&l_text,4)!=4 || l_text<0){
+		return false;
+	}
+
+	header=bam_header_init();
+	header->l_text=l_text;
+	header->text=(char*)calloc(l_text+1,1);
+	if(bgzf.read(header->text,l_text)!=l_text){
+		return false;
+	}
+
+	if(bgzf.read(&header->n_targets,4)!=4 || header->n_targets<0){
+		return false;
+	}
+
+	header->target_name=(char**)calloc(header->n_targets,sizeof(char*));
+	header->target_len=(uint32_t*)calloc(header->n_targets,sizeof(uint32_t));
+
+	for(int tid=0;tid<header->n_targets;tid++){
+		int32_t l_name;
+		if(bgzf.read(&l_name,4)!=4 || l_name<=0){
+			return false;
+		}
+
+		header->target_name[tid]=(char*)calloc(l_name,1);
+		if(bgzf.read(header->target_name[tid],l_name)!=l_name || bgzf.read(&header->target_len[tid],4)!=4){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int BamStreamReader::read(BamRecordView& view){
+	int32_t block_len;
+
+	int ret=bgzf.read(&block_len,4);
+	if(ret==0){
+		return -1;
+	}
+
+	if(ret!=4 || block_len<32){
+		return -2;
+	}
+
+	view.data=bgzf.readView(block_len,straddle);
+	view.length=block_len;
+
+	if(!view.data){
+		return -3;
+	}
+
+	return 4+block_len;
+}
+
+int BamStreamReader::read(bam1_t* bamInfo){
+	BamRecordView view;
+	int ret=read(view);
+	if(ret>=0){
+		view.copyTo(bamInfo);
+	}
+	return ret;
+}
+
+//the 32 bytes of fixed fields, as bam_write1 writes them
+static inline void packBamCore(const bam1_core_t* c,uint32_t x[8]){
+	x[0]=c->tid;
+	x[1]=c->pos;
+	x[2]=(uint32_t)c->bin<<16|c->qual<<8|c->l_qname;
+	x[3]=(uint32_t)c->flag<<16|c->n_cigar;
+	x[4]=c->l_qseq;
+	x[5]=c->mtid;
+	x[6]=c->mpos;
+	x[7]=c->isize;
+}
+
+void BamRecordView::copyFrom(const bam1_t* bamInfo,vector<unsigned char>& buffer){
+	uint32_t x[8];
+	packBamCore(&bamInfo->core,x);
+
+	length=bamInfo->data_len+32;
+	if(buffer.size()<(size_t)length){
+		buffer.resize(length+(length>>1));
+	}
+
+	memcpy(&buffer[0],x,32);
+	memcpy(&buffer[32],bamInfo->data,bamInfo->data_len);
+	data=&buffer[0];
+}
+
+//same layout as bam_read1
+void BamRecordView::copyTo(bam1_t* bamInfo) const{
+	uint32_t x[8];
+	memcpy(x,data,32);
+
+	bam1_core_t* c=&bamInfo->core;
+	c->tid=x[0];
+	c->pos=x[1];
+	c->bin=x[2]>>16;
+	c->qual=x[2]>>8&0xff;
+	c->l_qname=x[2]&0xff;
+	c->flag=x[3]>>16;
+	c->n_cigar=x[3]&0xffff;
+	c->l_qseq=x[4];
+	c->mtid=x[5];
+	c->mpos=x[6];
+	c->isize=x[7];
+
+	bamInfo->data_len=length-32;
+	if(bamInfo->m_data<bamInfo->data_len){
+		bamInfo->m_data=bamInfo->data_len+(bamInfo->data_len>>1)+32;
+		bamInfo->data=(uint8_t*)realloc(bamInfo->data,bamInfo->m_data);
+	}
+
+	memcpy(bamInfo->data,data+32,bamInfo->data_len);
+
+	bamInfo->l_aux=bamInfo->data_len-c->n_cigar*4-c->l_qname-c->l_qseq-(c->l_qseq+1)/2;
+}
+
+//bytes of one value of an aux type, 0 if unknown
+static inline int auxValueSize(unsigned char type){
+	switch(type){
+		case 'A':case 'c':case 'C':
+			return 1;
+		case 's':case 'S':
+			return 2;
+		case 'i':case 'I':case 'f':
+			return 4;
+		case 'd':
+			return 8;
+		default:
+			return 0;
+	}
+}
+
+int BamRecordView::numHits(int def) const{
+	const unsigned char* p=aux();
+	const unsigned char* end=data+length;
+	if(!p){
+		return def;
+	}
+
+	while(p+3<=end){
+		unsigned char type=p[2];
+
+		if(p[0]=='N' && p[1]=='H'){
+			const unsigned char* value=p+3;
+			if(value+auxValueSize(type)>end){
+				return def;
+			}
+
+			switch(type){
+				case 'c':
+					return (int8_t)value[0];
+				case 'C':
+					return value[0];
+				case 's':{
+					int16_t v;
+					memcpy(&v,value,2);
+					return v;
+				}
+				case 'S':{
+					uint16_t v;
+					memcpy(&v,value,2);
+					return v;
+				}
+				case 'i':case 'I':{
+					int32_t v;
+					memcpy(&v,value,4);
+					return v;
+				}
+				default:
+					return def;
+			}
+		}
+
+		p+=3;
+
+		if(type=='Z' || type=='H'){
+			while(p<end && *p){
+				p++;
+			}
+			p++;
+		}else if(type=='B'){
+			if(p+5>end){
+				break;
+			}
+			int32_t count;
+			memcpy(&count,p+1,4);
+			int size=auxValueSize(p[0]);
+			//a count from a corrupt record must not move p back or past the end
+			if(size==0 || count<0 || (long long)count*size>end-(p+5)){
+				break;
+			}
+			p+=5+(long long)count*size;
+		}else{
+			int size=auxValueSize(type);
+			if(size==0){
+				break;
+			}
+			p+=size;
+		}
+	}
+
+	return def;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+BamStreamWriter::BamStreamWriter(int fd,int numThreads,int compressLevel):bgzf(fd,numThreads,compressLevel){
+}
+
+BamStreamWriter::~BamStreamWriter(){
+	close();
+}
+
+void BamStreamWriter::writeHeader(const bam_header_t* header){
+	int32_t l_text=header->l_text;
+
+	bgzf.write("BAM\1",4);
+	bgzf.write(&l_text,4);
+	if(l_text>0){
+		bgzf.write(header->text,l_text);
+	}
+
+	bgzf.write(&header->n_targets,4);
+	for(int tid=0;tid<header->n_targets;tid++){
+		int32_t l_name=strlen(header->target_name[tid])+1;
+		bgzf.write(&l_name,4);
+		bgzf.write(header->target_name[tid],l_name);
+		bgzf.write(&header->target_len[tid],4);
+	}
+}
+
+//same layout as bam_write1
+int BamStreamWriter::write(const bam1_t* bamInfo){
+	uint32_t x[8];
+	int32_t block_len=bamInfo->data_len+32;
+
+	packBamCore(&bamInfo->core,x);
+
+	if(bgzf.write(&block_len,4)<0 || bgzf.write(x,32)<0 || bgzf.write(bamInfo->data,bamInfo->data_len)<0){
+		return -1;
+	}
+
+	return 4+block_len;
+}
+
+int BamStreamWriter::write(const BamRecordView& view){
+	int32_t block_len=view.length;
+	if(bgzf.write(&block_len,4)<0 || bgzf.write(view.data,view.length)<0){
+		return -1;
+	}
+
+	return 4+block_len;
+}
+
+int BamStreamWriter::close(){
+	return bgzf.close();
+}
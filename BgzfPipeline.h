@@ -0,0 +1,287 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _BGZF_PIPELINE_H
+#define _BGZF_PIPELINE_H
+
+/*
+ pipelined BGZF reading and writing on a pool of worker threads.
+
+ Every BGZF block is an independent deflate stream, so the reader hands whole
+ compressed blocks to the workers to inflate ahead of the consumer, and the writer
+ hands full uncompressed blocks to the workers to deflate behind the producer.
+ Blocks are always consumed or written in file order.
+
+ With no worker threads, blocks are inflated or deflated on the calling thread as
+ they are submitted.
+
+ Blocks are deflated at compressLevel: -1 for the zlib default, 0 for stored blocks (an
+ uncompressed bam, as samtools view -u) or 1 (fastest) to 9. Built with HAVE_LIBDEFLATE,
+ libdeflate inflates and deflates the blocks instead of zlib, except for the stored blocks.
+
+ BamStreamReader and BamStreamWriter parse and format bam headers and records on
+ top of them. Like the rest of the code, they assume a little-endian host.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <deque>
+#include <vector>
+#include <sam.h>
+
+using namespace std;
+
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+#define BGZF_BLOCK_DATA_SIZE 0xff00 //uncompressed bytes per written block, as bgzf.c
+
+class BgzfBlock{
+public:
+	unsigned char compressed[BGZF_MAX_BLOCK_SIZE];
+	unsigned char uncompressed[BGZF_MAX_BLOCK_SIZE];
+	int compressedLength;
+	int uncompressedLength;
+	bool done;
+	bool failed;
+
+	BgzfBlock():compressedLength(0),uncompressedLength(0),done(false),failed(false){}
+};
+
+class BgzfCodec;
+
+/*
+ worker threads inflating (reader) or deflating (writer) the blocks queued to them.
+ The owner keeps the blocks in file order and waits on each one to be done
+ */
+class BgzfWorkerPool{
+public:
+	//numThreads<1: no threads, submit does the work itself
+	BgzfWorkerPool(int numThreads,bool compress,int compressLevel);
+	~BgzfWorkerPool();
+
+	void submit(BgzfBlock* block);
+	void waitDone(BgzfBlock* block);
+
+	bool compress;
+	int compressLevel;
+
+	pthread_mutex_t lock;
+	pthread_cond_t jobReady;
+	pthread_cond_t jobDone;
+	deque<BgzfBlock*> jobs;
+	bool shutdown;
+	vector<pthread_t> threads;
+
+	BgzfCodec* inlineCodec; //without threads
+};
+
+class BgzfMTReader{
+public:
+	//takes over fd
+	BgzfMTReader(int fd,int numThreads);
+	~BgzfMTReader();
+
+	//return number of bytes read, which is less than len only at the end of file, or -1 on error
+	int read(void* data,int len);
+
+	//the next len bytes: in place in the current block if they lie within it, else copied
+	//into straddle. Valid until the next read. NULL at the end of file or on error
+	const unsigned char* readView(int len,vector<unsigned char>& straddle);
+
+	//at the end of the input, also true if it did not end with the EOF marker block (truncated)
+	inline bool failed() const{
+		return error || (eof && !eofMarker);
+	}
+
+	//compressed bytes consumed so far
+	inline long long compressedBytes() const{
+		return compressedTotal;
+	}
+
+	FILE* fin;
+	BgzfWorkerPool pool;
+	deque<BgzfBlock*> inFlight; //file order
+	vector<BgzfBlock*> freeBlocks;
+	unsigned int maxInFlight;
+	BgzfBlock* current;
+	int currentOffset;
+	bool eof;
+	bool eofMarker; //the last block read was the empty EOF marker block
+	bool error;
+	long long compressedTotal;
+
+protected:
+	bool readRawBlock(BgzfBlock* block);
+	void fillInFlight();
+	bool nextBlock();
+};
+
+class BgzfMTWriter{
+public:
+	//takes over fd
+	BgzfMTWriter(int fd,int numThreads,int compressLevel);
+	~BgzfMTWriter();
+
+	//return len, or -1 on error
+	int write(const void* data,int len);
+
+	//flush, write the EOF marker block and close. Return 0 on success
+	int close();
+
+	inline long long compressedBytes() const{
+		return compressedTotal;
+	}
+
+	FILE* fout;
+	BgzfWorkerPool pool;
+	deque<BgzfBlock*> inFlight; //file order
+	vector<BgzfBlock*> freeBlocks;
+	unsigned int maxInFlight;
+	BgzfBlock* current;
+	bool error;
+	bool closed;
+	long long compressedTotal;
+
+protected:
+	void submitCurrent();
+	void writeHead();
+};
+
+/*
+ a bam record where it lies in the decompressed input: the 32 bytes of fixed fields
+ followed by read name, cigar, sequence, qualities and aux, as bam_read1 reads them
+ into a bam1_t. Fields are read straight from there, without copying the record
+ */
+class BamRecordView{
+public:
+	const unsigned char* data;
+	int length; //block_len: the fixed fields and the rest
+
+	BamRecordView():data(NULL),length(0){}
+	BamRecordView(const unsigned char* _data,int _length):data(_data),length(_length){}
+
+	inline int32_t int32At(int offset) const{
+		int32_t value;
+		memcpy(&value,data+offset,4);
+		return value;
+	}
+
+	inline uint16_t uint16At(int offset) const{
+		uint16_t value;
+		memcpy(&value,data+offset,2);
+		return value;
+	}
+
+	inline int32_t tid() const{
+		return int32At(0);
+	}
+
+	inline int32_t pos() const{
+		return int32At(4);
+	}
+
+	inline int32_t mtid() const{
+		return int32At(20);
+	}
+
+	inline int32_t mpos() const{
+		return int32At(24);
+	}
+
+	//with the terminating NUL
+	inline int l_qname() const{
+		return data[8];
+	}
+
+	inline int n_cigar() const{
+		return uint16At(12);
+	}
+
+	inline uint16_t flag() const{
+		return uint16At(14);
+	}
+
+	inline int32_t l_qseq() const{
+		return int32At(16);
+	}
+
+	inline const char* qname() const{
+		return (const char*)data+32;
+	}
+
+	//NULL if the fixed fields of a corrupt record put it outside the record
+	inline const unsigned char* aux() const{
+		int32_t l_qseq=this->l_qseq();
+		if(l_qseq<0){
+			return NULL;
+		}
+
+		long long offset=32LL+l_qname()+n_cigar()*4LL+l_qseq+(l_qseq+1LL)/2;
+		return offset<=length?data+offset:NULL;
+	}
+
+	//value of the integer aux field NH, or def if there is none
+	int numHits(int def) const;
+
+	//decode into a bam1_t, e.g., to modify it
+	void copyTo(bam1_t* bamInfo) const;
+
+	//lay bamInfo out in buffer as a record of a bam file (e.g., one parsed from SAM) and view it there
+	void copyFrom(const bam1_t* bamInfo,vector<unsigned char>& buffer);
+};
+
+class BamStreamReader{
+public:
+	BamStreamReader(int fd,int numThreads);
+	~BamStreamReader();
+
+	//return false if the input is not a bam
+	bool readHeader();
+
+	//as samread: >=0 on success, <0 at end of file or on error
+	int read(bam1_t* bamInfo);
+
+	//the next record as a view, valid until the next read. Returns as read
+	int read(BamRecordView& view);
+
+	BgzfMTReader bgzf;
+	bam_header_t* header;
+	vector<unsigned char> straddle; //records crossing a block boundary are put together here
+};
+
+class BamStreamWriter{
+public:
+	BamStreamWriter(int fd,int numThreads,int compressLevel);
+	~BamStreamWriter();
+
+	void writeHeader(const bam_header_t* header);
+	int write(const bam1_t* bamInfo);
+
+	//the record as it was read, unchanged
+	int write(const BamRecordView& view);
+
+	int close();
+
+	BgzfMTWriter bgzf;
+};
+
+#endif /*_BGZF_PIPELINE_H*/
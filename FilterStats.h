@@ -0,0 +1,265 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _FILTER_STATS_H
+#define _FILTER_STATS_H
+
+/*
+ progress and run statistics of filterMaxHits.
+
+ Each pass over the input ticks once per record. Every 65536 records the clock is
+ looked at, and when the progress interval has gone by a line of tab-separated
+ key=value fields starting with #progress is printed to stderr:
+
+ #progress pass=first elapsed_s=.. records=.. records_per_s=.. bytes_in=.. input_bytes=.. done=.. eta_s=.. bytes_out=.. table_entries=.. table_bytes=.. rss_kb=..
+
+ done and eta_s are for the current pass, from the compressed bytes consumed so far.
+ At the end, the duration of every pass, records and bytes in and out, the largest read
+ table, peak memory and the histogram of hits per read can be written as JSON.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "RunTiming.h"
+
+using namespace std;
+
+#define HITS_HISTOGRAM_BINS 64 //1..63 hits, then 64 or more
+#define PROGRESS_CHECK_MASK 0xffff
+
+//resident set size now, from /proc/self/statm; peak if that is not available
+inline long currentRSSKb(){
+	FILE* fin=fopen("/proc/self/statm","r");
+	long size,resident;
+	if(fin){
+		bool ok=(fscanf(fin,"%ld %ld",&size,&resident)==2);
+		fclose(fin);
+		if(ok){
+			return resident*(sysconf(_SC_PAGESIZE)/1024);
+		}
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF,&usage);
+	return usage.ru_maxrss;
+}
+
+//number of reads by their number of alignments (the larger of the two segments)
+class HitsHistogram{
+public:
+	vector<uint64_t> numReads; //numReads[h] for h<HITS_HISTOGRAM_BINS, the last bin holds the rest
+
+	HitsHistogram():numReads(HITS_HISTOGRAM_BINS+1,0){}
+
+	inline void add(unsigned int hits){
+		numReads[hits<HITS_HISTOGRAM_BINS?hits:HITS_HISTOGRAM_BINS]++;
+	}
+
+	inline HitsHistogram& operator += (const HitsHistogram& right){
+		for(unsigned int i=0;i<numReads.size();i++){
+			numReads[i]+=right.numReads[i];
+		}
+		return *this;
+	}
+};
+
+class PassStats{
+public:
+	string name;
+	double wall;
+	double cpu;
+	uint64_t records;
+	long long bytesIn; //compressed
+	long long bytesOut;
+
+	PassStats(const string& _name):name(_name),wall(0.0),cpu(0.0),records(0),bytesIn(0),bytesOut(0){}
+};
+
+class FilterStats{
+public:
+	string jsonFile; //"" for none
+	double progressInterval; //seconds, 0 for no progress lines
+	string mode;
+	long long inputSize; //bytes, 0 if unknown
+	vector<PassStats> passes;
+	uint64_t recordsIn;
+	uint64_t recordsOut;
+	size_t peakTableEntries;
+	size_t peakTableBytes;
+	bool hasHistogram;
+	HitsHistogram hits;
+	vector<pair<string,uint64_t> > counters; //mode specific
+
+	FilterStats():progressInterval(0.0),inputSize(0),recordsIn(0),recordsOut(0),peakTableEntries(0),peakTableBytes(0),hasHistogram(false),passWallStart(0.0),passCpuStart(0.0),nextProgress(0.0){}
+
+	inline bool enabled() const{
+		return jsonFile!="" || progressInterval>0;
+	}
+
+	void beginPass(const string& name){
+		passes.push_back(PassStats(name));
+		passWallStart=wallClockSeconds();
+		passCpuStart=cpuSeconds(CPU_TIME_PROCESS);
+		nextProgress=passWallStart+progressInterval;
+	}
+
+	//the pass read one more record. True when a progress line is due
+	inline bool tick(){
+		PassStats& pass=passes.back();
+		pass.records++;
+		return (pass.records&PROGRESS_CHECK_MASK)==0 && progressInterval>0 && wallClockSeconds()>=nextProgress;
+	}
+
+	void progress(long long bytesIn,long long bytesOut,size_t tableEntries,size_t tableBytes){
+		noteTable(tableEntries,tableBytes);
+
+		const PassStats& pass=passes.back();
+		double now=wallClockSeconds();
+		double elapsed=now-passWallStart;
+		nextProgress=now+progressInterval;
+
+		fprintf(stderr,"#progress\tpass=%s\telapsed_s=%.1f\trecords=%llu\trecords_per_s=%.0f\tbytes_in=%lld\tinput_bytes=%lld",pass.name.c_str(),elapsed,(unsigned long long)pass.records,elapsed>0?pass.records/elapsed:0.0,bytesIn,inputSize);
+
+		if(inputSize>0 && bytesIn>0){
+			double done=double(bytesIn)/inputSize;
+			fprintf(stderr,"\tdone=%.4f\teta_s=%.0f",done,elapsed*(1.0-done)/done);
+		}else{
+			fprintf(stderr,"\tdone=NA\teta_s=NA");
+		}
+
+		fprintf(stderr,"\tbytes_out=%lld\ttable_entries=%llu\ttable_bytes=%llu\trss_kb=%ld\n",bytesOut,(unsigned long long)tableEntries,(unsigned long long)tableBytes,currentRSSKb());
+	}
+
+	inline void noteTable(size_t tableEntries,size_t tableBytes){
+		if(tableEntries>peakTableEntries){
+			peakTableEntries=tableEntries;
+		}
+
+		if(tableBytes>peakTableBytes){
+			peakTableBytes=tableBytes;
+		}
+	}
+
+	void endPass(long long bytesIn,long long bytesOut){
+		PassStats& pass=passes.back();
+		pass.wall=wallClockSeconds()-passWallStart;
+		pass.cpu=cpuSeconds(CPU_TIME_PROCESS)-passCpuStart;
+		pass.bytesIn=bytesIn;
+		pass.bytesOut=bytesOut;
+	}
+
+	inline void addCounter(const string& name,uint64_t value){
+		counters.push_back(pair<string,uint64_t>(name,value));
+	}
+
+	//return false if the file cannot be written
+	bool writeJson(const string& infile,const string& outfile,unsigned int maxHits){
+		if(jsonFile==""){
+			return true;
+		}
+
+		ofstream fout(jsonFile.c_str());
+		if(!fout.good()){
+			return false;
+		}
+
+		double wall=0.0;
+		double cpu=0.0;
+		long long bytesOut=0;
+		for(vector<PassStats>::iterator i=passes.begin();i!=passes.end();i++){
+			wall+=i->wall;
+			cpu+=i->cpu;
+			bytesOut+=i->bytesOut;
+		}
+
+		struct rusage usage;
+		getrusage(RUSAGE_SELF,&usage);
+
+		fout.precision(6);
+		fout<<fixed;
+		fout<<"{"<<endl;
+		fout<<"  \"program\": \"filterMaxHits\","<<endl;
+		fout<<"  \"mode\": "<<jsonString(mode)<<","<<endl;
+		fout<<"  \"in\": "<<jsonString(infile)<<","<<endl;
+		fout<<"  \"out\": "<<jsonString(outfile)<<","<<endl;
+		fout<<"  \"maxHits\": "<<maxHits<<","<<endl;
+		fout<<"  \"wall_s\": "<<wall<<","<<endl;
+		fout<<"  \"cpu_s\": "<<cpu<<","<<endl;
+		fout<<"  \"recordsIn\": "<<recordsIn<<","<<endl;
+		fout<<"  \"recordsOut\": "<<recordsOut<<","<<endl;
+		fout<<"  \"percentKept\": "<<(recordsIn>0?100.0*recordsOut/recordsIn:0.0)<<","<<endl;
+		fout<<"  \"recordsPerSecond\": "<<(wall>0?recordsIn/wall:0.0)<<","<<endl;
+		fout<<"  \"inputBytes\": "<<inputSize<<","<<endl;
+		fout<<"  \"bytesOut\": "<<bytesOut<<","<<endl;
+		fout<<"  \"peakTableEntries\": "<<peakTableEntries<<","<<endl;
+		fout<<"  \"peakTableBytes\": "<<peakTableBytes<<","<<endl;
+		fout<<"  \"peakRSS_kb\": "<<usage.ru_maxrss<<","<<endl;
+
+		fout<<"  \"passes\": [";
+		for(unsigned int i=0;i<passes.size();i++){
+			const PassStats& pass=passes[i];
+			fout<<(i>0?",":"")<<endl;
+			fout<<"    {\"name\": "<<jsonString(pass.name)<<", \"wall_s\": "<<pass.wall<<", \"cpu_s\": "<<pass.cpu<<", \"records\": "<<pass.records<<", \"recordsPerSecond\": "<<(pass.wall>0?pass.records/pass.wall:0.0)<<", \"bytesIn\": "<<pass.bytesIn<<", \"bytesOut\": "<<pass.bytesOut<<"}";
+		}
+		fout<<endl<<"  ],"<<endl;
+
+		fout<<"  \"counters\": {";
+		for(unsigned int i=0;i<counters.size();i++){
+			fout<<(i>0?", ":"")<<jsonString(counters[i].first)<<": "<<counters[i].second;
+		}
+		fout<<"},"<<endl;
+
+		//reads by number of hits, empty bins left out
+		fout<<"  \"hitsHistogram\": ";
+		if(hasHistogram){
+			fout<<"{";
+			bool first=true;
+			for(unsigned int h=0;h<hits.numReads.size();h++){
+				if(hits.numReads[h]==0){
+					continue;
+				}
+				fout<<(first?"":", ")<<"\""<<h<<(h==HITS_HISTOGRAM_BINS?"+":"")<<"\": "<<hits.numReads[h];
+				first=false;
+			}
+			fout<<"}"<<endl;
+		}else{
+			fout<<"null"<<endl;
+		}
+
+		fout<<"}"<<endl;
+		fout.close();
+
+		return !fout.fail();
+	}
+
+protected:
+	double passWallStart;
+	double passCpuStart;
+	double nextProgress;
+};
+
+#endif /*_FILTER_STATS_H*/
@@ -0,0 +1,197 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+
+#include "FingerprintSpill.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <iostream>
+using namespace std;
+
+bool parseMemorySize(const string& value,size_t& bytes){
+	char* end;
+	double size=strtod(value.c_str(),&end);
+	if(end==value.c_str() || size<=0){
+		return false;
+	}
+	
+	switch(toupper(*end)){
+		case 'T':
+			size*=1024;
+		case 'G':
+			size*=1024;
+		case 'M':
+			size*=1024;
+		case 'K':
+			size*=1024;
+			end++;
+			break;
+		default:
+			break;
+	}
+	
+	if(toupper(*end)=='B'){
+		end++;
+	}
+	
+	if(*end!='\0'){
+		return false;
+	}
+	
+	bytes=(size_t)size;
+	return true;
+}
+
+FingerprintSpillFiles::FingerprintSpillFiles(const string& _tmpDir,size_t _entrySize,size_t _memoryBudget):tmpDir(_tmpDir),entrySize(_entrySize),memoryBudget(_memoryBudget),numSplits(0),writeError(false){
+
+}
+
+FingerprintSpillFiles::~FingerprintSpillFiles(){
+	for(unsigned int i=0;i<buckets.size();i++){
+		if(buckets[i]){
+			fclose(buckets[i]);
+		}
+	}
+
+	for(unsigned int i=0;i<bucketFiles.size();i++){
+		unlink(bucketFiles[i].c_str());
+	}
+
+	if(dir!=""){
+		rmdir(dir.c_str());
+	}
+}
+
+static string bucketFileName(const string& prefix,unsigned int bucket){
+	char suffix[16];
+	sprintf(suffix,".%x",bucket);
+	return prefix+suffix;
+}
+
+bool FingerprintSpillFiles::open(const string& prefix){
+	string dirTemplate=tmpDir+"/"+prefix+".XXXXXX";
+	vector<char> dirBuffer(dirTemplate.begin(),dirTemplate.end());
+	dirBuffer.push_back('\0');
+	if(!mkdtemp(&dirBuffer[0])){
+		cerr<<"cannot create temporary directory under "<<tmpDir<<endl;
+		writeError=true;
+		return false;
+	}
+	dir=&dirBuffer[0];
+
+	unsigned int numBuckets=1<<SPILL_BUCKET_BITS;
+
+	//write buffers take at most a quarter of the budget
+	size_t bufferSize=memoryBudget/4/numBuckets;
+	if(bufferSize>(1<<16)){
+		bufferSize=1<<16;
+	}else if(bufferSize<4096){
+		bufferSize=4096;
+	}
+
+	for(unsigned int i=0;i<numBuckets;i++){
+		bucketFiles.push_back(bucketFileName(dir+"/bucket",i));
+		FILE* fout=fopen(bucketFiles.back().c_str(),"wb");
+		if(!fout){
+			cerr<<"cannot open spill file "<<bucketFiles.back()<<endl;
+			writeError=true;
+			return false;
+		}
+		setvbuf(fout,NULL,_IOFBF,bufferSize);
+		buckets.push_back(fout);
+	}
+
+	return true;
+}
+
+bool FingerprintSpillFiles::closeBuckets(){
+	for(unsigned int i=0;i<buckets.size();i++){
+		if(buckets[i] && fclose(buckets[i])!=0){
+			writeError=true;
+		}
+		buckets[i]=NULL;
+	}
+
+	if(writeError){
+		cerr<<"error writing spill files in "<<dir<<endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool FingerprintSpillFiles::splitBucket(const string& path,int shift,vector<string>& partFiles){
+	unsigned int numParts=1<<SPILL_SPLIT_BITS;
+	vector<FILE*> parts;
+	bool ok=true;
+
+	for(unsigned int i=0;i<numParts;i++){
+		partFiles.push_back(bucketFileName(path,i));
+		parts.push_back(fopen(partFiles.back().c_str(),"wb"));
+		if(!parts.back()){
+			cerr<<"cannot open spill file "<<partFiles.back()<<endl;
+			ok=false;
+		}
+	}
+
+	FILE* fin=ok?fopen(path.c_str(),"rb"):NULL;
+	if(ok && !fin){
+		cerr<<"cannot open spill file "<<path<<endl;
+		ok=false;
+	}
+
+	if(ok){
+		vector<char> entries(SPILL_IO_ENTRIES*entrySize);
+		size_t n;
+		while(ok && (n=fread(&entries[0],entrySize,SPILL_IO_ENTRIES,fin))>0){
+			for(size_t i=0;i<n;i++){
+				const char* entry=&entries[i*entrySize];
+				ReadNameFingerprint fp;
+				memcpy(&fp,entry,sizeof(ReadNameFingerprint));
+				unsigned int part=(fp.lo>>shift)&(numParts-1);
+				if(fwrite(entry,entrySize,1,parts[part])!=1){
+					cerr<<"error writing spill file "<<partFiles[part]<<endl;
+					ok=false;
+					break;
+				}
+			}
+		}
+
+		if(ferror(fin)){
+			cerr<<"error reading spill file "<<path<<endl;
+			ok=false;
+		}
+	}
+
+	if(fin){
+		fclose(fin);
+	}
+
+	for(unsigned int i=0;i<numParts;i++){
+		if(parts[i] && fclose(parts[i])!=0){
+			cerr<<"error writing spill file "<<partFiles[i]<<endl;
+			ok=false;
+		}
+	}
+
+	unlink(path.c_str());
+	return ok;
+}
@@ -0,0 +1,164 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _FINGERPRINT_SPILL_H
+#define _FINGERPRINT_SPILL_H
+
+/*
+ on-disk buckets of fixed size entries that start with a read name fingerprint.
+
+ Every entry goes to one of 256 bucket files chosen by the top 8 bits of fp.lo, so that all
+ entries of a name land in the same bucket and each bucket can be processed on its own,
+ within a memory budget. A bucket its processor finds too large for the budget is split 16
+ ways on the next 4 bits, as long as bits remain, and its parts are processed in turn. The
+ files live in a fresh directory that is removed with them.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "ReadNameTable.h"
+
+using namespace std;
+
+//first level buckets on the top 8 bits of fp.lo; oversized buckets split 16 ways on the next 4
+#define SPILL_BUCKET_BITS 8
+#define SPILL_SPLIT_BITS 4
+#define SPILL_IO_ENTRIES 4096
+
+//what a processor returns for a bucket
+#define SPILL_BUCKET_DONE 0
+#define SPILL_BUCKET_TOO_LARGE 1 //split it and process the parts instead
+#define SPILL_BUCKET_FAILED 2
+
+//e.g., 8G, 512M, 100000K or plain bytes
+bool parseMemorySize(const string& value,size_t& bytes);
+
+class FingerprintSpillFiles{
+public:
+	//files are created in a fresh directory under tmpDir; memoryBudget in bytes
+	FingerprintSpillFiles(const string& tmpDir,size_t entrySize,size_t memoryBudget);
+	~FingerprintSpillFiles();
+
+	//create the directory (prefix.XXXXXX under tmpDir) and the bucket files. Return false on failure
+	bool open(const string& prefix);
+
+	inline bool isOpen() const{
+		return !buckets.empty();
+	}
+
+	//append one entry of entrySize bytes. Return false once writing failed
+	inline bool write(const ReadNameFingerprint& fp,const void* entry){
+		if(!writeError && fwrite(entry,entrySize,1,buckets[fp.lo>>(64-SPILL_BUCKET_BITS)])!=1){
+			writeError=true;
+		}
+		return !writeError;
+	}
+
+	//all entries written: close the bucket files. Return false if any write failed
+	bool closeBuckets();
+
+	string tmpDir;
+	string dir;
+	size_t entrySize;
+	size_t memoryBudget;
+	unsigned int numSplits; //buckets that had to be split to fit the budget
+	vector<FILE*> buckets;
+	vector<string> bucketFiles;
+	bool writeError;
+
+protected:
+	//move the entries of path into 16 parts on the bits below shift, and remove it. Return false on failure
+	bool splitBucket(const string& path,int shift,vector<string>& partFiles);
+};
+
+template<class E>
+class FingerprintSpill:public FingerprintSpillFiles{
+public:
+	FingerprintSpill(const string& tmpDir,size_t memoryBudget):FingerprintSpillFiles(tmpDir,sizeof(E),memoryBudget){}
+
+	inline bool add(const ReadNameFingerprint& fp,const E& entry){
+		return write(fp,&entry);
+	}
+
+	/*
+	 close the buckets and hand each to processor.processBucket(path,canSplit), which returns
+	 SPILL_BUCKET_*. A processed bucket is removed. Return false on failure
+	 */
+	template<class P>
+	bool processBuckets(P& processor){
+		if(!closeBuckets()){
+			return false;
+		}
+
+		vector<string> files;
+		files.swap(bucketFiles);
+
+		bool ok=true;
+		for(unsigned int i=0;i<files.size();i++){
+			if(ok){
+				ok=processBucket(files[i],64-SPILL_BUCKET_BITS-SPILL_SPLIT_BITS,processor);
+			}
+
+			if(!ok){
+				unlink(files[i].c_str());
+			}
+		}
+
+		return ok;
+	}
+
+protected:
+	//shift<0 means the bucket cannot be split any further
+	template<class P>
+	bool processBucket(const string& path,int shift,P& processor){
+		int status=processor.processBucket(path,shift>=0);
+
+		if(status==SPILL_BUCKET_DONE){
+			unlink(path.c_str());
+			return true;
+		}
+
+		if(status!=SPILL_BUCKET_TOO_LARGE){
+			return false;
+		}
+
+		numSplits++;
+
+		vector<string> partFiles;
+		bool ok=splitBucket(path,shift,partFiles);
+
+		for(unsigned int i=0;i<partFiles.size();i++){
+			if(ok){
+				ok=processBucket(partFiles[i],shift-SPILL_SPLIT_BITS,processor);
+			}
+
+			if(!ok){
+				unlink(partFiles[i].c_str());
+			}
+		}
+
+		return ok;
+	}
+};
+
+#endif /*_FINGERPRINT_SPILL_H*/
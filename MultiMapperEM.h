@@ -0,0 +1,236 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _MULTI_MAPPER_EM_H
+#define _MULTI_MAPPER_EM_H
+
+/*
+ expectation-maximization allocation of multi-mapped reads to genes.
+
+ While counting, each contribution a read with NH>1 would make to a gene (one per
+ overlapping alignment and block, or one per gene for fragments) is recorded as a
+ MultiMapperHit instead, also for reads over --max-hits. Afterwards the hits are sorted by read and collapsed into
+ equivalence classes: the NH of the reads, the genes they reach with the number of
+ contributions to each, and the number of reads sharing exactly these. Reads of one
+ class are indistinguishable to EM, so memory after the collapse grows with the number
+ of classes, not reads; until then, MultiMapperSpill.h keeps the hits within a memory
+ budget. Classes keep NH rather than 1/NH weights so that --max-hits and NH division can
+ still be applied to them later (see the equivalence class file).
+
+ The allocation starts from NH division, which is what a uniform prior gives. Each
+ iteration reassigns the total weight of every class over its genes in proportion to
+ weight x abundance, where the abundance of a gene is its count (unique reads plus its
+ current share of multi-mapped reads) per probed base.
+ */
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "ReadNameTable.h"
+
+using namespace std;
+
+class MultiMapperHit{
+public:
+	ReadNameFingerprint read; //first, as FingerprintSpill.h needs
+	int gene;
+	uint32_t numHits;
+	uint16_t bam; //the same name in two bams is two reads
+
+	MultiMapperHit(const ReadNameFingerprint& _read,int _gene,unsigned int _bam,unsigned int _numHits):read(_read),gene(_gene),numHits(_numHits),bam(_bam){}
+
+	inline bool operator < (const MultiMapperHit& right) const{
+		if(bam!=right.bam){
+			return bam<right.bam;
+		}
+
+		if(read!=right.read){
+			return read<right.read;
+		}
+
+		return gene<right.gene;
+	}
+};
+
+class EquivalenceClassTable{
+public:
+	typedef pair<unsigned int,vector<pair<int,unsigned int> > > ClassKey; //NH, targets
+
+	vector<unsigned int> offsets; //genes of class c are genes[offsets[c]] .. genes[offsets[c+1]-1]
+	vector<int> genes;
+	vector<unsigned int> multiplicities; //contributions of one read of the class to the gene
+	vector<unsigned int> numHits; //NH of the reads of the class
+	vector<uint64_t> numReads;
+	map<ClassKey,unsigned int> classIdx; //while building
+
+	EquivalenceClassTable():offsets(1,0){}
+
+	inline unsigned int size() const{
+		return numReads.size();
+	}
+
+	//within --max-hits (0 for no limit)
+	inline bool kept(unsigned int c,int maxHits) const{
+		return maxHits<=0 || numHits[c]<=(unsigned int)maxHits;
+	}
+
+	//what one read of class c adds to genes[k]
+	inline double weight(unsigned int c,unsigned int k,bool divHits) const{
+		return divHits?double(multiplicities[k])/numHits[c]:multiplicities[k];
+	}
+
+	//append a class; targets are (gene, multiplicity) sorted by gene
+	void addClass(unsigned int classNumHits,uint64_t classNumReads,const vector<pair<int,unsigned int> >& targets){
+		for(vector<pair<int,unsigned int> >::const_iterator i=targets.begin();i!=targets.end();i++){
+			genes.push_back(i->first);
+			multiplicities.push_back(i->second);
+		}
+		offsets.push_back(genes.size());
+		numHits.push_back(classNumHits);
+		numReads.push_back(classNumReads);
+	}
+
+	//collapse hits (which are sorted and then released) into classes, adding to the classes of
+	//earlier calls, e.g., one call per spill bucket. All hits of a read have to come in one call
+	void build(vector<MultiMapperHit>& hits){
+		sort(hits.begin(),hits.end());
+
+		ClassKey key;
+
+		for(size_t i=0;i<hits.size();){
+			key.first=0;
+			key.second.clear();
+
+			size_t j=i;
+			for(;j<hits.size() && hits[j].bam==hits[i].bam && hits[j].read==hits[i].read;j++){
+				//mates normally agree on NH. If not, the larger one decides --max-hits
+				key.first=max<unsigned int>(key.first,hits[j].numHits);
+				if(!key.second.empty() && key.second.back().first==hits[j].gene){
+					key.second.back().second++;
+				}else{
+					key.second.push_back(pair<int,unsigned int>(hits[j].gene,1));
+				}
+			}
+			i=j;
+
+			map<ClassKey,unsigned int>::iterator ci=classIdx.find(key);
+			if(ci!=classIdx.end()){
+				numReads[ci->second]++;
+				continue;
+			}
+
+			classIdx.insert(map<ClassKey,unsigned int>::value_type(key,size()));
+			addClass(key.first,1,key.second);
+		}
+
+		vector<MultiMapperHit>().swap(hits);
+	}
+
+	//all hits are in: release the lookup of the classes
+	void finishBuild(){
+		map<ClassKey,unsigned int>().swap(classIdx);
+	}
+
+	//the count each gene gets from the classes within maxHits, divided by NH or not
+	void addCounts(vector<double>& counts,int maxHits,bool divHits) const{
+		for(unsigned int c=0;c<size();c++){
+			if(!kept(c,maxHits)){
+				continue;
+			}
+
+			for(unsigned int k=offsets[c];k<offsets[c+1];k++){
+				counts[genes[k]]+=numReads[c]*weight(c,k,divHits);
+			}
+		}
+	}
+};
+
+/*
+ fixedCounts: count of each gene from uniquely mapped reads; probedLengths: its probed bases.
+ shares (resized to the number of genes) receives the count of each gene from the classes
+ within maxHits. Stops when no share changes by more than tolerance times max(1, count of
+ the gene), or after maxIterations. Returns the number of iterations run
+ */
+inline int allocateMultiMappersByEM(const EquivalenceClassTable& classes,int maxHits,const vector<double>& fixedCounts,const vector<int>& probedLengths,double tolerance,int maxIterations,vector<double>& shares,bool& converged){
+	unsigned int numGenes=fixedCounts.size();
+
+	shares.assign(numGenes,0.0);
+	classes.addCounts(shares,maxHits,true);
+
+	vector<double> abundances(numGenes,0.0);
+	vector<double> nextShares(numGenes,0.0);
+
+	converged=false;
+
+	int iteration=0;
+	while(iteration<maxIterations){
+		iteration++;
+
+		for(unsigned int g=0;g<numGenes;g++){
+			abundances[g]=probedLengths[g]>0?(fixedCounts[g]+shares[g])/probedLengths[g]:0.0;
+		}
+
+		nextShares.assign(numGenes,0.0);
+
+		for(unsigned int c=0;c<classes.size();c++){
+			if(!classes.kept(c,maxHits)){
+				continue;
+			}
+
+			double total=0.0;
+			double expected=0.0;
+			for(unsigned int k=classes.offsets[c];k<classes.offsets[c+1];k++){
+				double weight=classes.weight(c,k,true);
+				total+=weight;
+				expected+=weight*abundances[classes.genes[k]];
+			}
+
+			//a class whose genes have no abundance left keeps its NH division
+			for(unsigned int k=classes.offsets[c];k<classes.offsets[c+1];k++){
+				double weight=classes.weight(c,k,true);
+				if(expected>0.0){
+					weight=total*weight*abundances[classes.genes[k]]/expected;
+				}
+				nextShares[classes.genes[k]]+=classes.numReads[c]*weight;
+			}
+		}
+
+		double maxChange=0.0;
+		for(unsigned int g=0;g<numGenes;g++){
+			double change=fabs(nextShares[g]-shares[g])/max(1.0,fixedCounts[g]+nextShares[g]);
+			if(change>maxChange){
+				maxChange=change;
+			}
+		}
+
+		shares.swap(nextShares);
+
+		if(maxChange<=tolerance){
+			converged=true;
+			break;
+		}
+	}
+
+	return iteration;
+}
+
+#endif /*_MULTI_MAPPER_EM_H*/
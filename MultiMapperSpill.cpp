@@ -0,0 +1,139 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+
+#include "MultiMapperSpill.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <iostream>
+#include <algorithm>
+using namespace std;
+
+MultiMapperHitStore::MultiMapperHitStore(const string& tmpDir,size_t memoryBudget):FingerprintSpill<MultiMapperHit>(tmpDir,memoryBudget),numHits(0),peakBytes(0),spilled(false),classes(NULL){
+	pthread_mutex_init(&lock,NULL);
+}
+
+MultiMapperHitStore::~MultiMapperHitStore(){
+	pthread_mutex_destroy(&lock);
+}
+
+bool MultiMapperHitStore::add(vector<MultiMapperHit>& workerHits){
+	pthread_mutex_lock(&lock);
+
+	numHits+=workerHits.size();
+
+	if(!spilled && (hits.size()+workerHits.size())*sizeof(MultiMapperHit)>memoryBudget){
+		spill();
+	}
+
+	if(spilled){
+		writeToBuckets(workerHits);
+	}else{
+		if(hits.size()+workerHits.size()>hits.capacity()){
+			//grow within the budget rather than doubling past it
+			size_t capacity=max(hits.capacity()*2,hits.size()+workerHits.size());
+			hits.reserve(min(capacity,memoryBudget/sizeof(MultiMapperHit)));
+		}
+		hits.insert(hits.end(),workerHits.begin(),workerHits.end());
+		notePeak(hits.capacity()*sizeof(MultiMapperHit));
+	}
+
+	bool ok=!writeError;
+	pthread_mutex_unlock(&lock);
+
+	workerHits.clear();
+	return ok;
+}
+
+bool MultiMapperHitStore::collapse(EquivalenceClassTable& _classes){
+	if(!spilled){
+		_classes.build(hits);
+		_classes.finishBuild();
+		return true;
+	}
+
+	if(writeError){
+		cerr<<"error writing the multi-mapped read spill files in "<<dir<<endl;
+		return false;
+	}
+
+	classes=&_classes;
+	bool ok=processBuckets(*this);
+	classes=NULL;
+
+	_classes.finishBuild();
+	return ok;
+}
+
+int MultiMapperHitStore::processBucket(const string& path,bool canSplit){
+	FILE* fin=fopen(path.c_str(),"rb");
+	if(!fin){
+		cerr<<"cannot open spill file "<<path<<endl;
+		return SPILL_BUCKET_FAILED;
+	}
+
+	fseek(fin,0,SEEK_END);
+	size_t bucketHits=ftell(fin)/sizeof(MultiMapperHit);
+	rewind(fin);
+
+	if(canSplit && bucketHits*sizeof(MultiMapperHit)>memoryBudget){
+		fclose(fin);
+		return SPILL_BUCKET_TOO_LARGE;
+	}
+
+	vector<MultiMapperHit> bucket(bucketHits,MultiMapperHit(ReadNameFingerprint(),0,0,0));
+	bool readError=(bucketHits>0 && fread(&bucket[0],sizeof(MultiMapperHit),bucketHits,fin)!=bucketHits);
+	fclose(fin);
+
+	if(readError){
+		cerr<<"error reading spill file "<<path<<endl;
+		return SPILL_BUCKET_FAILED;
+	}
+
+	notePeak(bucket.capacity()*sizeof(MultiMapperHit));
+	classes->build(bucket);
+	return SPILL_BUCKET_DONE;
+}
+
+void MultiMapperHitStore::spill(){
+	spilled=true;
+
+	if(!open("geneRPKM")){
+		return;
+	}
+
+	cerr<<"multi-mapped reads exceed "<<(memoryBudget>>20)<<"M in memory (--max-mem). Spilling to "<<dir<<endl;
+
+	writeToBuckets(hits);
+	vector<MultiMapperHit>().swap(hits);
+}
+
+void MultiMapperHitStore::writeToBuckets(const vector<MultiMapperHit>& someHits){
+	if(writeError){
+		return;
+	}
+
+	for(vector<MultiMapperHit>::const_iterator i=someHits.begin();i!=someHits.end();i++){
+		if(!FingerprintSpill<MultiMapperHit>::add(i->read,*i)){
+			cerr<<"error writing the multi-mapped read spill files in "<<dir<<endl;
+			return;
+		}
+	}
+}
@@ -0,0 +1,106 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _MULTI_MAPPER_SPILL_H
+#define _MULTI_MAPPER_SPILL_H
+
+/*
+ bounded-memory collection of the hits of multi-mapped reads for the equivalence classes.
+
+ Counting threads buffer their hits in a MultiMapperHitBuffer and hand them to the shared
+ MultiMapperHitStore a chunk at a time. The store keeps them in memory up to its budget
+ (--max-mem). Beyond it, every hit goes to the fingerprint bucket files of
+ FingerprintSpill.h, so that all hits of a read land in the same bucket, and the classes
+ are built one bucket at a time. Memory then stays within the budget plus the thread
+ buffers while counting, and the budget plus the classes while collapsing.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "FingerprintSpill.h"
+#include "MultiMapperEM.h"
+
+using namespace std;
+
+#define MULTI_MAPPER_MEMORY_BUDGET (size_t(1)<<30) //default --max-mem: bytes of hits kept in memory
+#define MULTI_MAPPER_BUFFER_HITS 65536 //hits of a counting thread handed over at once
+
+class MultiMapperHitStore:public FingerprintSpill<MultiMapperHit>{
+public:
+	//spill files are created in a fresh directory under tmpDir; memoryBudget in bytes
+	MultiMapperHitStore(const string& tmpDir,size_t memoryBudget);
+	~MultiMapperHitStore();
+
+	//take over the hits of a counting thread (cleared). Thread safe. Return false once writing to the buckets failed
+	bool add(vector<MultiMapperHit>& workerHits);
+
+	//all hits added: collapse them into classes. Return false on failure
+	bool collapse(EquivalenceClassTable& classes);
+
+	//build the classes of the reads in one bucket. Returns SPILL_BUCKET_*
+	int processBucket(const string& path,bool canSplit);
+
+	uint64_t numHits;
+	size_t peakBytes; //of hits held in memory at once, by the store or by a bucket being collapsed
+	bool spilled;
+
+	vector<MultiMapperHit> hits; //until the store spills
+	EquivalenceClassTable* classes; //while collapsing
+	pthread_mutex_t lock;
+
+protected:
+	inline void notePeak(size_t bytes){
+		if(bytes>peakBytes){
+			peakBytes=bytes;
+		}
+	}
+
+	//open the buckets and move the hits in memory there
+	void spill();
+
+	void writeToBuckets(const vector<MultiMapperHit>& someHits);
+};
+
+//the hits of one counting thread on their way to the store
+class MultiMapperHitBuffer{
+public:
+	MultiMapperHitStore* store;
+	vector<MultiMapperHit> hits;
+
+	MultiMapperHitBuffer(MultiMapperHitStore* _store):store(_store){}
+
+	inline void add(const MultiMapperHit& hit){
+		hits.push_back(hit);
+		if(hits.size()>=MULTI_MAPPER_BUFFER_HITS){
+			flush();
+		}
+	}
+
+	//write failures are reported by the store when it collapses
+	inline void flush(){
+		if(!hits.empty()){
+			store->add(hits);
+		}
+	}
+};
+
+#endif /*_MULTI_MAPPER_SPILL_H*/
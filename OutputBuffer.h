@@ -0,0 +1,192 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _OUTPUT_BUFFER_H
+#define _OUTPUT_BUFFER_H
+
+/*
+ buffered text output on a file descriptor.
+
+ Fields are formatted straight into one large buffer which is written out only when
+ it fills up (or on flush/close). Numbers are formatted the way ostream's defaults
+ do (integers in decimal, floating point as %g with 6 significant digits), so output
+ is byte-identical to the equivalent chain of operator<<.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class OutputBuffer{
+public:
+	int fd;
+	bool ownFd;
+	bool error;
+	vector<char> buffer;
+	size_t used;
+
+	//write to an already open fd (e.g., STDOUT_FILENO), which is not closed
+	OutputBuffer(int _fd=-1,size_t bufferSize=1<<20):fd(_fd),ownFd(false),error(false),buffer(bufferSize),used(0){}
+
+	~OutputBuffer(){
+		close();
+	}
+
+	//return false if the file cannot be open for writing
+	bool open(const string& filename){
+		close();
+		fd=::open(filename.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0666);
+		ownFd=true;
+		error=(fd<0);
+		return !error;
+	}
+
+	//return 0 on success
+	int close(){
+		flush();
+		if(fd>=0 && ownFd){
+			if(::close(fd)!=0){
+				error=true;
+			}
+		}
+		fd=-1;
+		ownFd=false;
+		return error?-1:0;
+	}
+
+	void flush(){
+		//after an error (e.g., a timed out socket) the rest is dropped rather than retried
+		size_t written=0;
+		while(written<used && fd>=0 && !error){
+			ssize_t n=::write(fd,&buffer[written],used-written);
+			if(n<0){
+				if(errno==EINTR){
+					continue;
+				}
+				error=true;
+				break;
+			}
+			written+=n;
+		}
+		used=0;
+	}
+
+	//make room for at least len bytes and return where to write them
+	inline char* reserve(size_t len){
+		if(used+len>buffer.size()){
+			flush();
+			if(len>buffer.size()){
+				buffer.resize(len);
+			}
+		}
+		return &buffer[used];
+	}
+
+	inline OutputBuffer& put(char c){
+		*reserve(1)=c;
+		used++;
+		return *this;
+	}
+
+	inline OutputBuffer& put(const char* data,size_t len){
+		memcpy(reserve(len),data,len);
+		used+=len;
+		return *this;
+	}
+
+	inline OutputBuffer& put(const char* str){
+		return put(str,strlen(str));
+	}
+
+	inline OutputBuffer& put(const string& str){
+		return put(str.data(),str.length());
+	}
+
+	inline OutputBuffer& putUInt(uint64_t value){
+		static const char digitPairs[]=
+			"00010203040506070809"
+			"10111213141516171819"
+			"20212223242526272829"
+			"30313233343536373839"
+			"40414243444546474849"
+			"50515253545556575859"
+			"60616263646566676869"
+			"70717273747576777879"
+			"80818283848586878889"
+			"90919293949596979899";
+
+		char digits[24];
+		char* p=digits+sizeof(digits);
+		while(value>=100){
+			const char* pair=digitPairs+(value%100)*2;
+			value/=100;
+			*--p=pair[1];
+			*--p=pair[0];
+		}
+		if(value>=10){
+			const char* pair=digitPairs+value*2;
+			*--p=pair[1];
+			*--p=pair[0];
+		}else{
+			*--p='0'+value;
+		}
+
+		return put(p,digits+sizeof(digits)-p);
+	}
+
+	inline OutputBuffer& putInt(int64_t value){
+		if(value<0){
+			put('-');
+			return putUInt(uint64_t(0)-uint64_t(value));
+		}
+		return putUInt(value);
+	}
+
+	//%g with 6 significant digits, as ostream's default floating point format
+	inline OutputBuffer& putDouble(double value){
+		//integral values of up to 6 digits print as integers under %g
+		if(value>-1e6 && value<1e6 && value==double(int64_t(value)) && !(value==0.0 && signbit(value))){
+			return putInt(int64_t(value));
+		}
+
+		char* p=reserve(32);
+		used+=snprintf(p,32,"%g",value);
+		return *this;
+	}
+
+	inline OutputBuffer& tab(){
+		return put('\t');
+	}
+
+	//end of line. Unlike endl, this does not flush
+	inline OutputBuffer& endLine(){
+		return put('\n');
+	}
+};
+
+#endif /*_OUTPUT_BUFFER_H*/
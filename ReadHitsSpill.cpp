@@ -0,0 +1,172 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#include "ReadHitsSpill.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <algorithm>
+using namespace std;
+
+ReadHitsSpill::ReadHitsSpill(const string& tmpDir,size_t _memoryBudget):FingerprintSpill<ReadHitsSpillEntry>(tmpDir,_memoryBudget),numRecords(0),numReads(0),maxHits(0),resultsFd(-1),results(NULL),resultsLength(0){
+
+}
+
+ReadHitsSpill::~ReadHitsSpill(){
+	if(results){
+		munmap(results,resultsLength);
+	}
+
+	if(resultsFd>=0){
+		close(resultsFd);
+		unlink(resultsFile.c_str());
+	}
+}
+
+bool ReadHitsSpill::open(){
+	return FingerprintSpill<ReadHitsSpillEntry>::open("filterMaxHits");
+}
+
+bool ReadHitsSpill::add(const ReadNameFingerprint& fp,bool secondSegment){
+	ReadHitsSpillEntry entry;
+	entry.fp=fp;
+	entry.recordSegment=(numRecords<<1)|(secondSegment?1:0);
+	numRecords++;
+
+	return FingerprintSpill<ReadHitsSpillEntry>::add(fp,entry);
+}
+
+bool ReadHitsSpill::resolve(unsigned int _maxHits){
+	maxHits=_maxHits;
+
+	resultsFile=dir+"/results";
+	resultsFd=::open(resultsFile.c_str(),O_RDWR|O_CREAT|O_TRUNC,0600);
+	if(resultsFd<0){
+		cerr<<"cannot open spill file "<<resultsFile<<endl;
+		return false;
+	}
+
+	resultsLength=numRecords*sizeof(uint32_t);
+	if(resultsLength>0){
+		if(ftruncate(resultsFd,resultsLength)!=0){
+			cerr<<"cannot allocate "<<resultsLength<<" bytes for "<<resultsFile<<endl;
+			return false;
+		}
+
+		void* mapped=mmap(NULL,resultsLength,PROT_READ|PROT_WRITE,MAP_SHARED,resultsFd,0);
+		if(mapped==MAP_FAILED){
+			cerr<<"cannot map "<<resultsFile<<endl;
+			return false;
+		}
+		results=(uint32_t*)mapped;
+	}
+
+	if(!processBuckets(*this)){
+		return false;
+	}
+
+	if(results){
+		//the second pass reads the verdicts in record order
+		madvise(results,resultsLength,MADV_SEQUENTIAL);
+	}
+
+	return true;
+}
+
+int ReadHitsSpill::processBucket(const string& path,bool canSplit){
+	FILE* fin=fopen(path.c_str(),"rb");
+	if(!fin){
+		cerr<<"cannot open spill file "<<path<<endl;
+		return SPILL_BUCKET_FAILED;
+	}
+
+	fseek(fin,0,SEEK_END);
+	size_t numEntries=ftell(fin)/sizeof(ReadHitsSpillEntry);
+	rewind(fin);
+
+	vector<ReadHitsSpillEntry> entries(SPILL_IO_ENTRIES);
+	bool overBudget=false;
+	bool readError=false;
+
+	{
+		size_t initialCapacity=numEntries+numEntries/4;
+		if(initialCapacity*sizeof(ReadNameFingerprint)*3>memoryBudget){
+			initialCapacity=memoryBudget/3/sizeof(ReadNameFingerprint);
+		}
+
+		FingerprintHashMap<SegmentHits> hits(false,initialCapacity);
+
+		size_t n;
+		while(!overBudget && (n=fread(&entries[0],sizeof(ReadHitsSpillEntry),SPILL_IO_ENTRIES,fin))>0){
+			for(size_t i=0;i<n;i++){
+				bool inserted;
+				SegmentHits& h=hits.findOrInsert(entries[i].fp,inserted);
+				if(entries[i].recordSegment&1){
+					h.second++;
+				}else{
+					h.first++;
+				}
+			}
+
+			if(canSplit && hits.memoryUsage()>memoryBudget){
+				overBudget=true;
+			}
+		}
+
+		if(!overBudget){
+			readError=ferror(fin);
+			rewind(fin);
+
+			while(!readError && (n=fread(&entries[0],sizeof(ReadHitsSpillEntry),SPILL_IO_ENTRIES,fin))>0){
+				for(size_t i=0;i<n;i++){
+					const SegmentHits* h=hits.find(entries[i].fp);
+					bool second=(entries[i].recordSegment&1)!=0;
+					uint32_t segmentHits=second?h->second:h->first;
+					uint32_t verdict=segmentHits>0x7fffffffU?0x7fffffffU:segmentHits;
+					if(h->first<=maxHits && h->second<=maxHits){
+						verdict|=0x80000000U;
+					}
+					results[entries[i].recordSegment>>1]=verdict;
+				}
+			}
+
+			readError=readError || ferror(fin);
+			numReads+=hits.size();
+			
+			for(size_t slot=0;slot<hits.capacity();slot++){
+				if(hits.used(slot)){
+					hitsHistogram.add(max(hits.values[slot].first,hits.values[slot].second));
+				}
+			}
+		}
+	}
+
+	fclose(fin);
+
+	if(readError){
+		cerr<<"error reading spill file "<<path<<endl;
+		return SPILL_BUCKET_FAILED;
+	}
+
+	return overBudget?SPILL_BUCKET_TOO_LARGE:SPILL_BUCKET_DONE;
+}
@@ -0,0 +1,99 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _READ_HITS_SPILL_H
+#define _READ_HITS_SPILL_H
+
+/*
+ external-memory counting of read hits for the two-pass filter.
+
+ In the first pass every alignment is appended as (name fingerprint, record index, segment)
+ to one of a set of bucket files chosen by the fingerprint. Buckets are then resolved one
+ at a time: the hits of the names in the bucket are counted in a FingerprintHashMap and
+ the verdict of each record is written to a per-record result file (mmap'd), which the
+ second pass reads back in record order. A bucket whose table would grow beyond the
+ memory budget is split on further fingerprint bits and its parts resolved in turn (see
+ FingerprintSpill.h).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ReadNameTable.h"
+#include "FingerprintSpill.h"
+#include "FilterStats.h"
+
+using namespace std;
+
+class ReadHitsSpillEntry{
+public:
+	ReadNameFingerprint fp;
+	uint64_t recordSegment; //record index<<1 | second segment
+};
+
+class SegmentHits{
+public:
+	uint32_t first;
+	uint32_t second;
+	SegmentHits():first(0),second(0){}
+};
+
+class ReadHitsSpill:public FingerprintSpill<ReadHitsSpillEntry>{
+public:
+	//files are created in a fresh directory under tmpDir; memoryBudget in bytes
+	ReadHitsSpill(const string& tmpDir,size_t memoryBudget);
+	~ReadHitsSpill();
+
+	//create the bucket files. Return false on failure
+	bool open();
+
+	//the next record of the first pass. Return false on write failure
+	bool add(const ReadNameFingerprint& fp,bool secondSegment);
+
+	//count the hits bucket by bucket and decide every record. Return false on failure
+	bool resolve(unsigned int maxHits);
+
+	//after resolve
+
+	inline bool passes(uint64_t recordIndex) const{
+		return (results[recordIndex]&0x80000000U)!=0;
+	}
+
+	//number of alignments of the record's segment (saturates at 2^31-1)
+	inline unsigned int numHits(uint64_t recordIndex) const{
+		return results[recordIndex]&0x7fffffffU;
+	}
+
+	//count the names of one bucket and write the verdicts of its records. Returns SPILL_BUCKET_*
+	int processBucket(const string& path,bool canSplit);
+
+	uint64_t numRecords;
+	uint64_t numReads; //distinct names, known after resolve
+	HitsHistogram hitsHistogram; //of the distinct names, known after resolve
+	unsigned int maxHits; //of the resolve
+
+	string resultsFile;
+	int resultsFd;
+	uint32_t* results;
+	size_t resultsLength;
+};
+
+#endif /*_READ_HITS_SPILL_H*/
@@ -0,0 +1,325 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _READ_NAME_TABLE_H
+#define _READ_NAME_TABLE_H
+
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+using namespace std;
+
+/*
+ 128-bit fingerprint of a read name (two independently seeded 64-bit hashes).
+ Reads are told apart by fingerprint only; with 128 bits a collision among
+ billions of names is not a practical concern. (0,0) marks an empty slot.
+ */
+class ReadNameFingerprint{
+public:
+	uint64_t hi;
+	uint64_t lo;
+
+	inline ReadNameFingerprint(uint64_t _hi=0,uint64_t _lo=0):hi(_hi),lo(_lo){}
+
+	inline bool empty() const{
+		return hi==0 && lo==0;
+	}
+
+	inline bool operator == (const ReadNameFingerprint& right) const{
+		return hi==right.hi && lo==right.lo;
+	}
+
+	inline bool operator != (const ReadNameFingerprint& right) const{
+		return hi!=right.hi || lo!=right.lo;
+	}
+
+	inline bool operator < (const ReadNameFingerprint& right) const{
+		return hi<right.hi || (hi==right.hi && lo<right.lo);
+	}
+};
+
+inline uint64_t mixHash64(uint64_t h){
+	h^=h>>33;
+	h*=0xff51afd7ed558ccdULL;
+	h^=h>>33;
+	h*=0xc4ceb9fe1a85ec53ULL;
+	h^=h>>33;
+	return h;
+}
+
+inline uint64_t hashBytes64(const char* data,int len,uint64_t seed){
+	uint64_t h=seed^(len*0x9e3779b97f4a7c15ULL);
+
+	int i=0;
+	for(;i+8<=len;i+=8){
+		uint64_t word;
+		memcpy(&word,data+i,8);
+		h=(h^mixHash64(word))*0x9e3779b97f4a7c15ULL;
+		h=(h<<31)|(h>>33);
+	}
+
+	uint64_t tail=0;
+	for(int j=0;i<len;i++,j+=8){
+		tail|=((uint64_t)(unsigned char)data[i])<<j;
+	}
+
+	return mixHash64(h^mixHash64(tail^seed));
+}
+
+inline ReadNameFingerprint fingerprintReadName(const char* name,int len){
+	ReadNameFingerprint fp(hashBytes64(name,len,0x243f6a8885a308d3ULL),hashBytes64(name,len,0x13198a2e03707344ULL));
+	if(fp.empty()){
+		fp.lo=1;
+	}
+	return fp;
+}
+
+inline ReadNameFingerprint fingerprintReadName(const char* name){
+	return fingerprintReadName(name,strlen(name));
+}
+
+/*
+ chunked arena of NUL-terminated names. Pointers stay valid until the arena is destroyed
+ */
+class ReadNameArena{
+public:
+	vector<char*> chunks;
+	size_t chunkSize;
+	size_t used;
+
+	ReadNameArena(size_t _chunkSize=1<<20):chunkSize(_chunkSize),used(_chunkSize){}
+
+	~ReadNameArena(){
+		for(vector<char*>::iterator i=chunks.begin();i!=chunks.end();i++){
+			free(*i);
+		}
+	}
+
+	const char* intern(const char* name,int len){
+		if(used+len+1>chunkSize){
+			size_t newChunkSize=(size_t(len+1)>chunkSize)?size_t(len+1):chunkSize;
+			chunks.push_back((char*)malloc(newChunkSize));
+			used=0;
+			if(newChunkSize>chunkSize){
+				//oversized name gets a chunk of its own
+				used=newChunkSize;
+				memcpy(chunks.back(),name,len);
+				chunks.back()[len]='\0';
+				return chunks.back();
+			}
+		}
+
+		char* dst=chunks.back()+used;
+		memcpy(dst,name,len);
+		dst[len]='\0';
+		used+=len+1;
+		return dst;
+	}
+};
+
+/*
+ open-addressing (linear probing) hash map from read name fingerprint to a small value.
+ Slots are a flat array; no per-entry allocation. If keepNames is set, the names are
+ interned in an arena and kept in a parallel array for reporting.
+ */
+template<class V>
+class FingerprintHashMap{
+public:
+	vector<ReadNameFingerprint> keys;
+	vector<V> values;
+	vector<const char*> names; //only with keepNames
+	ReadNameArena* arena;
+	size_t numEntries;
+
+	FingerprintHashMap(bool keepNames=false,size_t initialCapacity=1<<16):arena(NULL),numEntries(0){
+		if(keepNames){
+			arena=new ReadNameArena;
+		}
+		allocate(initialCapacity<16?16:initialCapacity);
+	}
+
+	~FingerprintHashMap(){
+		if(arena){
+			delete arena;
+		}
+	}
+
+	inline size_t size() const{
+		return numEntries;
+	}
+
+	inline size_t capacity() const{
+		return keys.size();
+	}
+
+	inline bool used(size_t slot) const{
+		return !keys[slot].empty();
+	}
+
+	inline size_t memoryUsage() const{
+		return keys.capacity()*sizeof(ReadNameFingerprint)+values.capacity()*sizeof(V)+names.capacity()*sizeof(const char*)+(arena?arena->chunks.size()*arena->chunkSize:0);
+	}
+
+	//return NULL if absent
+	inline V* find(const ReadNameFingerprint& fp){
+		size_t slot=probe(fp);
+		return keys[slot].empty()?NULL:&values[slot];
+	}
+
+	//name is only used (and may be NULL) when the map does not keep names
+	inline V& findOrInsert(const ReadNameFingerprint& fp,const char* name,int nameLen,bool& inserted){
+		if((numEntries+1)*5>capacity()*4){
+			allocate(capacity()+capacity()/2);
+		}
+
+		size_t slot=probe(fp);
+		inserted=keys[slot].empty();
+		if(inserted){
+			keys[slot]=fp;
+			values[slot]=V();
+			if(arena){
+				names[slot]=arena->intern(name,nameLen);
+			}
+			numEntries++;
+		}
+
+		return values[slot];
+	}
+
+	inline V& findOrInsert(const ReadNameFingerprint& fp,bool& inserted){
+		return findOrInsert(fp,NULL,0,inserted);
+	}
+
+	//backward-shift deletion keeps the probe sequences intact without tombstones
+	void erase(const ReadNameFingerprint& fp){
+		size_t hole=probe(fp);
+		if(keys[hole].empty()){
+			return;
+		}
+
+		size_t cap=keys.size();
+		size_t next=hole;
+		while(true){
+			if(++next==cap){
+				next=0;
+			}
+
+			if(keys[next].empty()){
+				break;
+			}
+
+			//the entry at next may fill the hole unless its home slot lies cyclically in (hole,next]
+			size_t home=slotOf(keys[next]);
+			bool movable=(hole<=next)?(home<=hole || home>next):(home<=hole && home>next);
+			if(movable){
+				keys[hole]=keys[next];
+				values[hole]=values[next];
+				if(arena){
+					names[hole]=names[next];
+				}
+				hole=next;
+			}
+		}
+
+		keys[hole]=ReadNameFingerprint();
+		numEntries--;
+	}
+
+	//keep capacity, forget entries
+	void clear(){
+		if(numEntries==0){
+			return;
+		}
+
+		for(size_t i=0;i<keys.size();i++){
+			keys[i]=ReadNameFingerprint();
+		}
+		numEntries=0;
+	}
+
+	/*
+	 forget entries, and if the map is far larger than they needed (more than 8 slots each),
+	 start again at smallCapacity. For a map cleared over and over, e.g. once per gene, so
+	 that one very large round does not make every later clear sweep its slots
+	 */
+	void clear(size_t smallCapacity){
+		if(capacity()>smallCapacity && numEntries*8<capacity()){
+			vector<ReadNameFingerprint>(smallCapacity,ReadNameFingerprint()).swap(keys);
+			vector<V>(smallCapacity).swap(values);
+			if(arena){
+				vector<const char*>(smallCapacity,(const char*)NULL).swap(names);
+			}
+			numEntries=0;
+			return;
+		}
+
+		clear();
+	}
+
+private:
+
+	inline size_t slotOf(const ReadNameFingerprint& fp) const{
+		//multiply-shift maps the hash onto any capacity, not just powers of two
+		return (size_t)(((unsigned __int128)fp.hi*keys.size())>>64);
+	}
+
+	inline size_t probe(const ReadNameFingerprint& fp) const{
+		size_t slot=slotOf(fp);
+		size_t cap=keys.size();
+		while(!keys[slot].empty() && keys[slot]!=fp){
+			if(++slot==cap){
+				slot=0;
+			}
+		}
+		return slot;
+	}
+
+	void allocate(size_t newCapacity){
+		vector<ReadNameFingerprint> oldKeys;
+		vector<V> oldValues;
+		vector<const char*> oldNames;
+		oldKeys.swap(keys);
+		oldValues.swap(values);
+		oldNames.swap(names);
+
+		keys.assign(newCapacity,ReadNameFingerprint());
+		values.resize(newCapacity);
+		if(arena){
+			names.assign(newCapacity,(const char*)NULL);
+		}
+
+		for(size_t i=0;i<oldKeys.size();i++){
+			if(oldKeys[i].empty()){
+				continue;
+			}
+
+			size_t slot=probe(oldKeys[i]);
+			keys[slot]=oldKeys[i];
+			values[slot]=oldValues[i];
+			if(arena){
+				names[slot]=oldNames[i];
+			}
+		}
+	}
+};
+
+#endif /*_READ_NAME_TABLE_H*/
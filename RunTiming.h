@@ -0,0 +1,88 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+#ifndef _RUN_TIMING_H
+#define _RUN_TIMING_H
+
+/*
+ clocks and JSON quoting shared by the run statistics of geneRPKM and filterMaxHits
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <string>
+
+using namespace std;
+
+inline double wallClockSeconds(){
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec*1e-6;
+}
+
+#define CPU_TIME_PROCESS 0
+#define CPU_TIME_THREAD 1
+
+/*
+ cpu time of the process (worker threads included) or of the calling thread. RUSAGE_THREAD
+ is Linux only; elsewhere the time of the thread comes from CLOCK_THREAD_CPUTIME_ID, or
+ without it, of the process
+ */
+inline double cpuSeconds(int who){
+	int rusageWho=RUSAGE_SELF;
+
+	if(who==CPU_TIME_THREAD){
+#if defined(RUSAGE_THREAD)
+		rusageWho=RUSAGE_THREAD;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+		struct timespec ts;
+		if(clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts)==0){
+			return ts.tv_sec+ts.tv_nsec*1e-9;
+		}
+#endif
+	}
+
+	struct rusage usage;
+	getrusage(rusageWho,&usage);
+	return usage.ru_utime.tv_sec+usage.ru_stime.tv_sec+(usage.ru_utime.tv_usec+usage.ru_stime.tv_usec)*1e-6;
+}
+
+//a JSON string literal
+inline string jsonString(const string& str){
+	string quoted="\"";
+	for(string::const_iterator i=str.begin();i!=str.end();i++){
+		if(*i=='"' || *i=='\\'){
+			quoted+='\\';
+			quoted+=*i;
+		}else if((unsigned char)(*i)<0x20){
+			char escaped[8];
+			sprintf(escaped,"\\u%04x",(unsigned char)(*i));
+			quoted+=escaped;
+		}else{
+			quoted+=*i;
+		}
+	}
+	quoted+='"';
+	return quoted;
+}
+
+#endif /*_RUN_TIMING_H*/
@@ -0,0 +1,149 @@
+#!/bin/bash
+
+# throughput benchmark of geneRPKM and filterMaxHits on synthetic data.
+#
+# usage: bench/bench.sh [makeSyntheticData options]
+# e.g.,  bench/bench.sh --genes 20000 --reads 5000000 --multi-frac 0.2 --paired
+#
+# run from the repository root after make.sh. Needs samtools ($SAMTOOLPATH/samtools or on the PATH)
+# to convert, sort and index the fixtures. Peak RSS needs GNU time (/usr/bin/time), otherwise NA.
+# Results are printed as a table and appended with the git revision to $BENCH_RESULTS
+# (default: bench/results.tsv), so runs before and after a change can be compared.
+#
+# environment: BENCH_DIR (fixtures and outputs, default: a fresh directory under ${TMPDIR:-/tmp}),
+# BENCH_THREADS (for the --threads runs, default: 4), BENCH_MAX_HITS (default: 3)
+
+BENCH_THREADS=${BENCH_THREADS:-4}
+BENCH_MAX_HITS=${BENCH_MAX_HITS:-3}
+BENCH_RESULTS=${BENCH_RESULTS:-bench/results.tsv}
+
+for binary in ./geneRPKM ./filterMaxHits ./makeSyntheticData; do
+	if [[ ! -x $binary ]]; then
+		echo "$binary not found. build with make.sh first"
+		exit 1
+	fi
+done
+
+SAMTOOLS=samtools
+if [[ $SAMTOOLPATH != "" && -x $SAMTOOLPATH/samtools ]]; then
+	SAMTOOLS=$SAMTOOLPATH/samtools
+fi
+
+if ! command -v $SAMTOOLS > /dev/null; then
+	echo "samtools not found"
+	exit 1
+fi
+
+if [[ $BENCH_DIR == "" ]]; then
+	BENCH_DIR=`mktemp -d ${TMPDIR:-/tmp}/geneRPKM_bench.XXXXXX`
+fi
+mkdir -p $BENCH_DIR
+
+HAVE_GNU_TIME=0
+if /usr/bin/time -f "%e %M" true > /dev/null 2>&1; then
+	HAVE_GNU_TIME=1
+fi
+
+REV=`git rev-parse --short HEAD 2> /dev/null`
+REV=${REV:-unknown}
+
+# timed name command...
+# runs command with stdout to $BENCH_DIR/name.out and stderr to $BENCH_DIR/name.err, sets WALL and MAXRSS
+timed(){
+	local name=$1
+	shift
+
+	if [[ $HAVE_GNU_TIME == 1 ]]; then
+		/usr/bin/time -f "%e %M" -o $BENCH_DIR/$name.time "$@" > $BENCH_DIR/$name.out 2> $BENCH_DIR/$name.err
+		local status=$?
+		read WALL MAXRSS < $BENCH_DIR/$name.time
+	else
+		local start=`date +%s.%N`
+		"$@" > $BENCH_DIR/$name.out 2> $BENCH_DIR/$name.err
+		local status=$?
+		local end=`date +%s.%N`
+		WALL=`awk -v s=$start -v e=$end 'BEGIN{printf("%.2f",e-s)}'`
+		MAXRSS=NA
+	fi
+
+	if [[ $status != 0 ]]; then
+		echo "$name failed (exit status $status), see $BENCH_DIR/$name.err"
+		exit 1
+	fi
+}
+
+ROWS=""
+
+# report tool mode
+report(){
+	local recordsPerSec=`awk -v n=$RECORDS -v t=$WALL 'BEGIN{if(t>0) printf("%.0f",n/t); else print "NA"}'`
+	local genesPerSec=NA
+	if [[ $1 == geneRPKM ]]; then
+		genesPerSec=`awk -v n=$GENES -v t=$WALL 'BEGIN{if(t>0) printf("%.0f",n/t); else print "NA"}'`
+	fi
+	ROWS="$ROWS$1\t$2\t$WALL\t$recordsPerSec\t$genesPerSec\t$MAXRSS\n"
+}
+
+echo "fixtures in $BENCH_DIR"
+
+# phases of the fixture preparation
+timed generate ./makeSyntheticData --out-prefix $BENCH_DIR/synthetic "$@"
+
+RECORDS=`awk '$1=="records"{print $2}' $BENCH_DIR/synthetic.stats`
+GENES=`awk '$1=="genes"{print $2}' $BENCH_DIR/synthetic.stats`
+
+report makeSyntheticData generate
+
+timed convert $SAMTOOLS view -bS -o $BENCH_DIR/synthetic.unsorted.bam $BENCH_DIR/synthetic.sam
+report samtools view
+
+timed sort $SAMTOOLS sort $BENCH_DIR/synthetic.unsorted.bam $BENCH_DIR/synthetic
+report samtools sort
+
+timed index $SAMTOOLS index $BENCH_DIR/synthetic.bam
+report samtools index
+
+# geneRPKM
+GENERPKM_ARGS="--bedfile $BENCH_DIR/synthetic.bed --bamfile $BENCH_DIR/synthetic.bam"
+
+timed geneRPKM.fetch ./geneRPKM $GENERPKM_ARGS
+report geneRPKM fetch
+
+timed geneRPKM.sweep ./geneRPKM $GENERPKM_ARGS --sweep
+report geneRPKM sweep
+
+timed geneRPKM.sweep_threads ./geneRPKM $GENERPKM_ARGS --sweep --threads $BENCH_THREADS
+report geneRPKM "sweep,threads=$BENCH_THREADS"
+
+timed geneRPKM.build_block_index ./geneRPKM --bedfile $BENCH_DIR/synthetic.bed --build-block-index $BENCH_DIR/synthetic.bix
+report geneRPKM build-block-index
+
+timed geneRPKM.block_index ./geneRPKM --block-index $BENCH_DIR/synthetic.bix --bamfile $BENCH_DIR/synthetic.bam --sweep
+report geneRPKM "sweep,block-index"
+
+# filterMaxHits
+timed filterMaxHits.two_pass ./filterMaxHits --max-hits $BENCH_MAX_HITS --in $BENCH_DIR/synthetic.bam --out $BENCH_DIR/filtered.two_pass.bam
+report filterMaxHits two-pass
+
+timed filterMaxHits.two_pass_threads ./filterMaxHits --max-hits $BENCH_MAX_HITS --threads $BENCH_THREADS --in $BENCH_DIR/synthetic.bam --out $BENCH_DIR/filtered.two_pass_threads.bam
+report filterMaxHits "two-pass,threads=$BENCH_THREADS"
+
+timed filterMaxHits.NH ./filterMaxHits --max-hits $BENCH_MAX_HITS --use-NH-flag --in $BENCH_DIR/synthetic.bam --out $BENCH_DIR/filtered.NH.bam
+report filterMaxHits use-NH-flag
+
+timed filterMaxHits.name_grouped ./filterMaxHits --max-hits $BENCH_MAX_HITS --name-grouped --in $BENCH_DIR/synthetic.unsorted.bam --out $BENCH_DIR/filtered.name_grouped.bam
+report filterMaxHits name-grouped
+
+HEADER="tool\tmode\twall_s\trecords_per_s\tgenes_per_s\tmaxrss_kb"
+
+echo "records=$RECORDS genes=$GENES"
+echo -e "$HEADER\n$ROWS"
+
+if [[ ! -e $BENCH_RESULTS ]]; then
+	echo -e "date\trev\trecords\tgenes\targs\t$HEADER" > $BENCH_RESULTS
+fi
+
+DATE=`date +%Y-%m-%dT%H:%M:%S`
+echo -ne "$ROWS" | awk -v prefix="$DATE\t$REV\t$RECORDS\t$GENES\t$*" 'NF>0{print prefix"\t"$0}' >> $BENCH_RESULTS
+
+echo "appended to $BENCH_RESULTS"
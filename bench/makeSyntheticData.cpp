@@ -0,0 +1,348 @@
+/***************************************************************************
+ Copyright 2011 Wu Albert Cheng <albertwcheng@gmail.com>
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ *******************************************************************************/
+
+
+/*
+ synthetic fixtures for the benchmarks: a BED12 annotation of multi-exon genes with
+ alternative isoforms, and a SAM file of (optionally paired) spliced reads sampled from
+ the isoforms, a fraction of them multi-mapped with NH/HI tags. Alignments of a read are
+ written next to each other (GO:query), so the SAM is ready for filterMaxHits as is and
+ for geneRPKM after sorting and indexing.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../AdvGetOptCpp/AdvGetOpt.h"
+using namespace std;
+
+#define TABS "\n  "
+
+void outArgsHelp(string argname,string help){
+	cerr<<argname<<TABS<<help<<endl;
+}
+
+void printUsage(string programName){
+	cerr<<"Usage: "<<programName<<" [options] --out-prefix prefix"<<endl;
+	cerr<<"writes prefix.bed, prefix.sam and prefix.stats"<<endl;
+	cerr<<"options:"<<endl;
+	outArgsHelp("--out-prefix prefix","output file prefix. Default: synthetic");
+	outArgsHelp("--genes N","number of genes. Default: 1000");
+	outArgsHelp("--isoforms N","isoforms per gene, the first one uses all exons. Default: 3");
+	outArgsHelp("--chroms N","number of chromosomes the genes are spread over. Default: 4");
+	outArgsHelp("--reads N","number of reads (pairs with --paired). Default: 100000");
+	outArgsHelp("--read-length L","Default: 50");
+	outArgsHelp("--multi-frac f","fraction of reads with more than one alignment. Default: 0.1");
+	outArgsHelp("--max-hits N","maximum number of alignments of a multi-mapped read. Default: 5");
+	outArgsHelp("--paired","write read pairs");
+	outArgsHelp("--seed N","random seed. Default: 1");
+}
+
+//xorshift64*, so that fixtures are the same on every platform
+class Random{
+public:
+	uint64_t state;
+
+	Random(uint64_t seed):state(seed?seed:0x9e3779b97f4a7c15ULL){}
+
+	inline uint64_t next(){
+		state^=state>>12;
+		state^=state<<25;
+		state^=state>>27;
+		return state*0x2545f4914f6cdd1dULL;
+	}
+
+	//uniform in [0,n)
+	inline int below(int n){
+		return next()%n;
+	}
+
+	inline double uniform(){
+		return (next()>>11)*(1.0/9007199254740992.0);
+	}
+};
+
+class Transcript{
+public:
+	vector<pair<int,int> > exons; //[start0,end1), sorted
+	int length;
+
+	Transcript():length(0){}
+};
+
+class SyntheticGene{
+public:
+	string name;
+	int chrom;
+	char strand;
+	vector<Transcript> isoforms;
+};
+
+/*
+ genomic placement of length bases starting at transcript offset: position and a cigar
+ with N across introns
+ */
+void projectOntoGenome(const Transcript& transcript,int offset,int length,int& pos0,string& cigar){
+	cigar.clear();
+	pos0=-1;
+
+	int lastEnd1=-1;
+	char buffer[32];
+
+	for(unsigned int e=0;e<transcript.exons.size() && length>0;e++){
+		int exonLength=transcript.exons[e].second-transcript.exons[e].first;
+		if(offset>=exonLength){
+			offset-=exonLength;
+			continue;
+		}
+
+		int start0=transcript.exons[e].first+offset;
+		int matched=exonLength-offset;
+		if(matched>length){
+			matched=length;
+		}
+
+		if(pos0<0){
+			pos0=start0;
+		}else{
+			sprintf(buffer,"%dN",start0-lastEnd1);
+			cigar+=buffer;
+		}
+
+		sprintf(buffer,"%dM",matched);
+		cigar+=buffer;
+
+		lastEnd1=start0+matched;
+		length-=matched;
+		offset=0;
+	}
+}
+
+class Placement{
+public:
+	int chrom;
+	int pos0;
+	string cigar;
+	int mateChrom;
+	int matePos0;
+	string mateCigar;
+	int span; //genomic span of the fragment, for TLEN
+};
+
+//a random fragment of fragmentLength (single read: readLength) from a random isoform of gene
+void placeFragment(Random& rng,const SyntheticGene& gene,int readLength,int fragmentLength,bool paired,Placement& placement){
+	const Transcript& transcript=gene.isoforms[rng.below(gene.isoforms.size())];
+
+	int length=paired?fragmentLength:readLength;
+	if(length>transcript.length){
+		length=transcript.length;
+	}
+
+	int offset=rng.below(transcript.length-length+1);
+
+	placement.chrom=gene.chrom;
+	projectOntoGenome(transcript,offset,readLength<length?readLength:length,placement.pos0,placement.cigar);
+
+	if(paired){
+		int mateLength=readLength<length?readLength:length;
+		placement.mateChrom=gene.chrom;
+		projectOntoGenome(transcript,offset+length-mateLength,mateLength,placement.matePos0,placement.mateCigar);
+
+		int fragmentEnd1;
+		string lastBaseCigar;
+		projectOntoGenome(transcript,offset+length-1,1,fragmentEnd1,lastBaseCigar);
+		placement.span=fragmentEnd1+1-placement.pos0;
+	}
+}
+
+int main(int argc,char*argv[]){
+
+	vector<string> long_options;
+	long_options.push_back("out-prefix=");
+	long_options.push_back("genes=");
+	long_options.push_back("isoforms=");
+	long_options.push_back("chroms=");
+	long_options.push_back("reads=");
+	long_options.push_back("read-length=");
+	long_options.push_back("multi-frac=");
+	long_options.push_back("max-hits=");
+	long_options.push_back("paired");
+	long_options.push_back("seed=");
+
+	map<string,string> optmap;
+
+	EasyAdvGetOptOut argsFinal=easyAdvGetOpt(argc,argv,"",&long_options);
+
+	if(argsFinal.success){
+		parseOptsIntoMap(argsFinal.opts,optmap);
+	}else{
+		printUsage(argsFinal.programName);
+		return 1;
+	}
+
+	string prefix=getOptValue(optmap,"--out-prefix","synthetic");
+	int numGenes=atoi(getOptValue(optmap,"--genes","1000").c_str());
+	int numIsoforms=atoi(getOptValue(optmap,"--isoforms","3").c_str());
+	int numChroms=atoi(getOptValue(optmap,"--chroms","4").c_str());
+	long long numReads=atoll(getOptValue(optmap,"--reads","100000").c_str());
+	int readLength=atoi(getOptValue(optmap,"--read-length","50").c_str());
+	double multiFrac=atof(getOptValue(optmap,"--multi-frac","0.1").c_str());
+	int maxHits=atoi(getOptValue(optmap,"--max-hits","5").c_str());
+	bool paired=hasOpt(optmap,"--paired");
+	Random rng(strtoull(getOptValue(optmap,"--seed","1").c_str(),NULL,10));
+
+	if(numGenes<1 || numIsoforms<1 || numChroms<1 || readLength<1 || maxHits<1){
+		cerr<<"--genes, --isoforms, --chroms, --read-length and --max-hits have to be positive. abort"<<endl;
+		return 1;
+	}
+
+	//genes, laid out along the chromosomes round robin
+	vector<SyntheticGene> genes(numGenes);
+	vector<int> chromLengths(numChroms,10000);
+
+	for(int g=0;g<numGenes;g++){
+		SyntheticGene& gene=genes[g];
+		char name[32];
+		sprintf(name,"gene%d",g+1);
+		gene.name=name;
+		gene.chrom=g%numChroms;
+		gene.strand=rng.below(2)?'+':'-';
+
+		vector<pair<int,int> > exons;
+		int cursor=chromLengths[gene.chrom];
+		int numExons=3+rng.below(6);
+		for(int e=0;e<numExons;e++){
+			int exonLength=max(80+rng.below(220),readLength);
+			exons.push_back(pair<int,int>(cursor,cursor+exonLength));
+			cursor+=exonLength+200+rng.below(2800);
+		}
+		chromLengths[gene.chrom]=cursor+5000;
+
+		for(int k=0;k<numIsoforms;k++){
+			Transcript transcript;
+			for(int e=0;e<numExons;e++){
+				//first and last exons are constitutive, inner ones are skipped by alternative isoforms
+				if(k>0 && e>0 && e+1<numExons && rng.uniform()<0.3){
+					continue;
+				}
+				transcript.exons.push_back(exons[e]);
+				transcript.length+=exons[e].second-exons[e].first;
+			}
+			gene.isoforms.push_back(transcript);
+		}
+	}
+
+	//annotation
+	string bedfilename=prefix+".bed";
+	FILE* bed=fopen(bedfilename.c_str(),"w");
+	if(!bed){
+		cerr<<"cannot open "<<bedfilename<<" for writing. abort"<<endl;
+		return 1;
+	}
+
+	for(int g=0;g<numGenes;g++){
+		for(unsigned int k=0;k<genes[g].isoforms.size();k++){
+			const Transcript& transcript=genes[g].isoforms[k];
+			int txStart0=transcript.exons.front().first;
+			int txEnd1=transcript.exons.back().second;
+			fprintf(bed,"chr%d\t%d\t%d\t%s\t0\t%c\t%d\t%d\t0,0,0\t%d\t",genes[g].chrom+1,txStart0,txEnd1,genes[g].name.c_str(),genes[g].strand,txStart0,txEnd1,(int)transcript.exons.size());
+			for(unsigned int e=0;e<transcript.exons.size();e++){
+				fprintf(bed,"%d,",transcript.exons[e].second-transcript.exons[e].first);
+			}
+			fprintf(bed,"\t");
+			for(unsigned int e=0;e<transcript.exons.size();e++){
+				fprintf(bed,"%d,",transcript.exons[e].first-txStart0);
+			}
+			fprintf(bed,"\n");
+		}
+	}
+	fclose(bed);
+
+	//reads
+	string samfilename=prefix+".sam";
+	FILE* sam=fopen(samfilename.c_str(),"w");
+	if(!sam){
+		cerr<<"cannot open "<<samfilename<<" for writing. abort"<<endl;
+		return 1;
+	}
+
+	fprintf(sam,"@HD\tVN:1.0\tSO:unsorted\tGO:query\n");
+	for(int c=0;c<numChroms;c++){
+		fprintf(sam,"@SQ\tSN:chr%d\tLN:%d\n",c+1,chromLengths[c]);
+	}
+
+	static const char bases[]="ACGT";
+	string seq(readLength,'A');
+	string qual(readLength,'I');
+	long long numRecords=0;
+	long long numMultiReads=0;
+	Placement placement;
+
+	for(long long r=0;r<numReads;r++){
+		for(int i=0;i<readLength;i++){
+			seq[i]=bases[rng.below(4)];
+		}
+
+		int numHits=1;
+		if(maxHits>1 && rng.uniform()<multiFrac){
+			numHits=2+rng.below(maxHits-1);
+			numMultiReads++;
+		}
+
+		int fragmentLength=readLength+rng.below(200);
+
+		for(int hit=0;hit<numHits;hit++){
+			placeFragment(rng,genes[rng.below(numGenes)],readLength,fragmentLength,paired,placement);
+
+			int secondary=hit>0?256:0;
+
+			if(paired){
+				fprintf(sam,"r%lld\t%d\tchr%d\t%d\t255\t%s\t=\t%d\t%d\t%s\t%s\tNH:i:%d\tHI:i:%d\n",r+1,99|secondary,placement.chrom+1,placement.pos0+1,placement.cigar.c_str(),placement.matePos0+1,placement.span,seq.c_str(),qual.c_str(),numHits,hit+1);
+				fprintf(sam,"r%lld\t%d\tchr%d\t%d\t255\t%s\t=\t%d\t%d\t%s\t%s\tNH:i:%d\tHI:i:%d\n",r+1,147|secondary,placement.mateChrom+1,placement.matePos0+1,placement.mateCigar.c_str(),placement.pos0+1,-placement.span,seq.c_str(),qual.c_str(),numHits,hit+1);
+				numRecords+=2;
+			}else{
+				int flag=(rng.below(2)?16:0)|secondary;
+				fprintf(sam,"r%lld\t%d\tchr%d\t%d\t255\t%s\t*\t0\t0\t%s\t%s\tNH:i:%d\tHI:i:%d\n",r+1,flag,placement.chrom+1,placement.pos0+1,placement.cigar.c_str(),seq.c_str(),qual.c_str(),numHits,hit+1);
+				numRecords++;
+			}
+		}
+	}
+
+	if(fclose(sam)!=0){
+		cerr<<"error writing "<<samfilename<<endl;
+		return 1;
+	}
+
+	//sizes the benchmark divides by
+	string statsfilename=prefix+".stats";
+	ofstream stats(statsfilename.c_str());
+	stats<<"genes\t"<<numGenes<<endl;
+	stats<<"transcripts\t"<<numGenes*numIsoforms<<endl;
+	stats<<"reads\t"<<numReads<<endl;
+	stats<<"multiReads\t"<<numMultiReads<<endl;
+	stats<<"records\t"<<numRecords<<endl;
+	stats.close();
+
+	cerr<<"wrote "<<bedfilename<<", "<<samfilename<<" ("<<numRecords<<" records) and "<<statsfilename<<endl;
+	return 0;
+}
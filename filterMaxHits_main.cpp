@@ -23,8 +23,17 @@
 #include <Gff.h>
 #include <BamUtil.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <SystemUtil.h>
+#include <algorithm>
+#include <queue>
 #include "AdvGetOptCpp/AdvGetOpt.h"
+#include "ReadNameTable.h"
+#include "BgzfPipeline.h"
+#include "ReadHitsSpill.h"
+#include "FilterStats.h"
+#include <sys/stat.h>
 using namespace std;
 using namespace Gff;
 
@@ -37,16 +46,204 @@ void outArgsHelp(string argname,string help){
 }
 
 
+#define MISSING_NH_ABORT 0
+#define MISSING_NH_DROP 1
+#define MISSING_NH_KEEP 2
+
+#define INCONSISTENT_NH_ABORT 0
+#define INCONSISTENT_NH_KEEP 1
 
 class OptionStruct {
 public:
-	string bamfile;
-	string outfile;
+	string bamfile; //- for stdin
+	string outfile; //- for stdout
+	bool samIn; //--sam-in
 	//bool bestQual;
 	unsigned int maxHits;
 	bool addNH;
 	bool useNHFlag;
+	int missingNHPolicy; //MISSING_NH_*
+	int inconsistentNHPolicy; //INCONSISTENT_NH_*
+	bool nameGrouped;
+	bool forceTwoPass;
+	int numThreads;
+	int compressLevel; //-1: zlib default, 0: uncompressed bam
+	size_t maxMem; //0: unbounded
+	string tmpDir;
 	string printStatFile;
+	FilterStats stats; //--stats-json, --progress
+};
+
+//- for stdin or stdout
+inline bool isStdStream(const string& filename){
+	return filename=="-";
+}
+
+//0 if the file cannot be stat'ed or is a stream
+long long fileSize(const string& filename){
+	if(isStdStream(filename)){
+		return 0;
+	}
+	
+	struct stat st;
+	if(stat(filename.c_str(),&st)!=0){
+		return 0;
+	}
+	return st.st_size;
+}
+
+/* bam input
+ 
+ the pipelined bgzf reader. Records can be read as views in place in the decompressed
+ blocks; with one thread, blocks are inflated on the calling thread.
+ 
+ SAM text is parsed by samtools and each record laid out as in a bam to be viewed
+ 
+ */
+class BamInput{
+public:
+	BamStreamReader* stream;
+	samfile_t* sam;
+	bam1_t* samRecord;
+	vector<unsigned char> samBuffer;
+	
+	BamInput():stream(NULL),sam(NULL),samRecord(NULL){}
+	
+	~BamInput(){
+		close();
+	}
+	
+	//filename - for stdin
+	bool open(const string& filename,int numThreads,bool samText){
+		if(samText){
+			sam=samopen(filename.c_str(),"r",0);
+			if(!sam){
+				return false;
+			}
+			
+			samRecord=bam_init1();
+			return true;
+		}
+		
+		int fd=isStdStream(filename)?STDIN_FILENO:(::open(filename.c_str(),O_RDONLY));
+		if(fd<0){
+			return false;
+		}
+		
+		stream=new BamStreamReader(fd,numThreads>1?numThreads:0);
+		if(!stream->readHeader()){
+			delete stream;
+			stream=NULL;
+			return false;
+		}
+		
+		return true;
+	}
+	
+	inline bam_header_t* header(){
+		return sam?sam->header:stream->header;
+	}
+	
+	inline int read(bam1_t* bamInfo){
+		return sam?samread(sam,bamInfo):stream->read(bamInfo);
+	}
+	
+	//valid until the next read
+	inline int read(BamRecordView& view){
+		if(sam){
+			int ret=samread(sam,samRecord);
+			if(ret>=0){
+				view.copyFrom(samRecord,samBuffer);
+			}
+			return ret;
+		}
+		
+		return stream->read(view);
+	}
+	
+	//whether ret, the read that ended a loop, was an error rather than the end of the input
+	inline bool failed(int ret) const{
+		return ret<-1 || (stream && stream->bgzf.failed());
+	}
+	
+	//compressed bytes consumed so far, 0 for SAM
+	inline long long bytesIn(){
+		return stream?stream->bgzf.compressedBytes():0;
+	}
+	
+	void close(){
+		if(stream){
+			delete stream;
+			stream=NULL;
+		}
+		
+		if(sam){
+			samclose(sam);
+			bam_destroy1(samRecord);
+			sam=NULL;
+			samRecord=NULL;
+		}
+	}
+};
+
+/* bam output
+ 
+ the pipelined bgzf writer at the --compress-level. With one thread, blocks are deflated
+ on the calling thread
+ 
+ */
+class BamOutput{
+public:
+	BamStreamWriter* stream;
+	
+	BamOutput():stream(NULL){}
+	
+	~BamOutput(){
+		close();
+	}
+	
+	//filename - for stdout
+	bool open(const string& filename,const bam_header_t* header,int numThreads,int compressLevel){
+		int fd=isStdStream(filename)?STDOUT_FILENO:(::open(filename.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0666));
+		if(fd<0){
+			return false;
+		}
+		
+		stream=new BamStreamWriter(fd,numThreads>1?numThreads:0,compressLevel);
+		stream->writeHeader(header);
+		return true;
+	}
+	
+	inline bool isOpen() const{
+		return stream!=NULL;
+	}
+	
+	inline int write(const bam1_t* bamInfo){
+		return stream->write(bamInfo);
+	}
+	
+	//the record as it was read
+	inline int write(const BamRecordView& view){
+		return stream->write(view);
+	}
+	
+	//compressed bytes written so far
+	inline long long bytesOut(){
+		return stream?stream->bgzf.compressedBytes():0;
+	}
+	
+	//return 0 on success
+	int close(){
+		int ret=0;
+		
+		if(stream){
+			ret=stream->close();
+			delete stream;
+			stream=NULL;
+		}
+		
+		return ret;
+	}
 };
 
 
@@ -55,13 +252,26 @@ void printUsage(string programName){
 	
 	cerr<<"Usage: "<<programName<<" [options] --in in.bam --out out.bam "<<endl;
 	cerr<<"e.g.,"<<programName<<" --max-hits 3 --in in.bam --out out.bam"<<endl;
+	cerr<<"--in - reads from stdin and --out - writes to stdout, in a single pass mode (--use-NH-flag or --name-grouped), e.g.,"<<endl;
+	cerr<<"  aligner ... | "<<programName<<" --name-grouped --sam-in --in - --out - | samtools sort ..."<<endl;
 	cerr<<"preprocessor options:"<<endl;
 	outArgsHelp("--@import-args filename","load arguments from tab delimited file");
 	cerr<<"options:"<<endl;
 	outArgsHelp("--max-hits hits","specify the maximum number of hits to retain the read");
+	outArgsHelp("--sam-in","input is SAM text rather than bam (as samtools view -S). The header needs the @SQ lines");
 	outArgsHelp("--add-NH","Add NH:i:<numHits> to the aux fields if not exists");
-	outArgsHelp("--use-NH-flag","Use NH flag to filter which is way faster if it is present also if NH flag is consistent such that Left max hits == right max hits if both >0");
+	outArgsHelp("--use-NH-flag","Use NH flag to filter in a single pass which is way faster if it is present. Each alignment is kept or dropped by its own NH, which needs the two mates of an alignment pair to agree on NH. This is checked on input sorted by coordinate or grouped by read name (as declared by the header), holding only the pairs spanning the current position or the current read");
+	outArgsHelp("--inconsistent-NH policy","with --use-NH-flag, what to do when the mates of an alignment pair have different NH: abort [default] (no output is left behind), or keep (filter each mate by its own NH, which may leave one mate of a pair in the output)");
+	outArgsHelp("--missing-NH policy","with --use-NH-flag, what to do with a mapped read without NH flag: abort [default] (no output is left behind), drop, or keep (as a unique read)");
+	outArgsHelp("--name-grouped","input has all alignments of a read next to each other (e.g., aligner output). Filter in a single pass buffering one read at a time. This is automatic if the header declares SO:queryname or GO:query");
+	outArgsHelp("--two-pass","count hits of all reads in a first pass even if the header declares the input grouped by read name");
+	outArgsHelp("--threads N","decompress input and compress output bgzf blocks on N worker threads each. Default: 1 (blocks inflated and deflated on the main thread)");
+	outArgsHelp("--compress-level N","deflate the output at level N: 0 for an uncompressed bam (as samtools view -u, e.g., when it goes straight into samtools sort), 1 for the fastest up to 9 for the smallest. Default: the zlib default (6). Built with -DHAVE_LIBDEFLATE, libdeflate does the inflating and deflating");
+	outArgsHelp("--max-mem size","bound the memory used to count hits in the two-pass mode (e.g., 8G, 512M). When the read table would outgrow it, hits are counted in hash buckets spilled to disk and resolved one bucket at a time");
+	outArgsHelp("--tmp-dir dir","directory for the --max-mem spill files. Default: $TMPDIR or /tmp");
 	outArgsHelp("--print-NH-stat-to","print NH stat to a file. either qname<tab>NH or qname<tab>firstAlgNH<tab>secondAlgNH");
+	outArgsHelp("--stats-json file","write the duration, records and bytes of each pass, records in and out, percent kept, the largest read table, peak memory and a histogram of hits per read to file as JSON");
+	outArgsHelp("--progress seconds","print a #progress line of tab-separated key=value fields to stderr every so many seconds: pass, records, records/s, compressed bytes in and out, fraction done and estimated seconds left of the pass, read table entries and bytes, resident memory");
 	
 }
 
@@ -78,7 +288,7 @@ class CountStruct{
 		inline CountStruct& operator += (const CountStruct& right){
 			this->firstAlignmentCount+=right.firstAlignmentCount;
 			this->secondAlignmentCount+=right.secondAlignmentCount;
-
+			return *this;
 		}
 		
 		/*inline CountStruct& withFirstFragQual(unsigned char qual){
@@ -100,6 +310,233 @@ class CountStruct{
 
 
 
+typedef FingerprintHashMap<CountStruct> ReadHitsMap;
+
+inline ReadNameFingerprint fingerprintQName(const bam1_t* bamInfo){
+	//l_qname includes the terminating NUL
+	return fingerprintReadName(bam1_qname(bamInfo),bamInfo->core.l_qname-1);
+}
+
+inline ReadNameFingerprint fingerprintQName(const BamRecordView& view){
+	return fingerprintReadName(view.qname(),view.l_qname()-1);
+}
+
+class ReadHitsMapNameLess{
+public:
+	ReadHitsMap& readHitsMap;
+	ReadHitsMapNameLess(ReadHitsMap& _readHitsMap):readHitsMap(_readHitsMap){}
+	inline bool operator () (size_t left,size_t right) const{
+		return strcmp(readHitsMap.names[left],readHitsMap.names[right])<0;
+	}
+};
+
+//add NH:i:<numHits> from the counted alignments of the read's segment
+void appendNHIfMissing(bam1_t* bamInfo,const CountStruct& counts){
+	if(BamReader::hasAuxField(bamInfo,"NH")){
+		return;
+	}
+	
+	int NH;
+	if(!BamReader::hasMultipleFragments(bamInfo) || BamReader::isFirstFragment(bamInfo)){
+		//first fragment
+		NH=counts.firstAlignmentCount;
+	}
+	else{
+		NH=counts.secondAlignmentCount;
+	}
+	
+	BamReader::BamAuxStruct bas;
+	bas.type=BAMAUX_INTVALUE;
+	bas.intValue=NH;
+	
+	BamReader::appendAuxField(bamInfo,"NH",&bas);
+}
+
+//one alignment of the first segment (or of an unpaired read) or of the second segment
+inline CountStruct alignmentAdder(const bam1_t* bamInfo){
+	if(BamReader::hasMultipleFragments(bamInfo) && !BamReader::isFirstFragment(bamInfo)){
+		return CountStruct(0,1);
+	}
+	
+	return CountStruct(1,0);
+}
+
+inline CountStruct alignmentAdder(const BamRecordView& view){
+	if((view.flag()&BAM_FPAIRED) && !(view.flag()&BAM_FREAD1)){
+		return CountStruct(0,1);
+	}
+	
+	return CountStruct(1,0);
+}
+
+//write a record that passes: as it was read, unless NH has to be added to it (decoded into bamInfo)
+void writePassing(OptionStruct& opts,BamOutput& out,const BamRecordView& view,const CountStruct& counts,bam1_t* bamInfo){
+	if(opts.addNH && view.numHits(-1)<0){
+		view.copyTo(bamInfo);
+		appendNHIfMissing(bamInfo,counts);
+		out.write(bamInfo);
+		return;
+	}
+	
+	out.write(view);
+}
+
+/* two-pass filter in bounded memory
+ 
+ the first pass spills (fingerprint, record, segment) into on-disk buckets, which are
+ resolved one at a time into a verdict per record; the second pass filters by record index
+ 
+ */
+int runGetUniqReads_spilled(OptionStruct& opts){
+	
+	BamInput bf;
+	
+	if(!bf.open(opts.bamfile,opts.numThreads,opts.samIn)){
+		cerr<<"bam file "<<opts.bamfile<<" cannot be open for counting"<<endl;
+		return 1;
+	}
+	
+	ReadHitsSpill spill(opts.tmpDir,opts.maxMem);
+	if(!spill.open()){
+		return 1;
+	}
+	
+	cerr<<"spilling read hits to "<<spill.dir<<endl;
+	
+	bam1_t *bamInfo=bam_init1();
+	BamRecordView view;
+	
+	//first pass
+	uint64_t total=0;
+	FilterStats& stats=opts.stats;
+	stats.mode="two-pass,spilled";
+	stats.beginPass("first");
+	
+	int ret;
+	while((ret=bf.read(view))>=0){
+		total++;
+		if(total%1000000==1){
+			cerr<<"first pass: passing through read "<<total<<endl;
+		}
+		
+		if(stats.tick()){
+			stats.progress(bf.bytesIn(),0,0,0);
+		}
+		
+		if(!spill.add(fingerprintQName(view),alignmentAdder(view).secondAlignmentCount>0)){
+			cerr<<"error writing spill files in "<<spill.dir<<endl;
+			bam_destroy1(bamInfo);
+			return 1;
+		}
+	}
+	
+	if(bf.failed(ret)){
+		cerr<<"bam file "<<opts.bamfile<<" is truncated or corrupt after "<<total<<" reads"<<endl;
+		bam_destroy1(bamInfo);
+		return 1;
+	}
+	
+	bf.close();
+	stats.endPass(stats.inputSize,0);
+	stats.recordsIn=total;
+	
+	cerr<<"inReads\t"<<total<<endl;
+	
+	cerr<<"resolving read hits bucket by bucket"<<endl;
+	stats.beginPass("resolve");
+	if(!spill.resolve(opts.maxHits)){
+		bam_destroy1(bamInfo);
+		return 1;
+	}
+	stats.endPass(0,0);
+	
+	cerr<<"resolved "<<spill.numReads<<" reads ("<<spill.numSplits<<" buckets split to fit --max-mem)"<<endl;
+	
+	stats.hasHistogram=true;
+	stats.hits=spill.hitsHistogram;
+	stats.addCounter("distinctReads",spill.numReads);
+	stats.addCounter("spillBucketsSplit",spill.numSplits);
+	
+	//second pass
+	
+	if(opts.outfile!=""){
+		
+		int outTotal=0;
+		
+		if(!bf.open(opts.bamfile,opts.numThreads,opts.samIn)){
+			cerr<<"bam file "<<opts.bamfile<<" cannot be open"<<endl;
+			bam_destroy1(bamInfo);
+			return 1;
+		}
+		
+		BamOutput out;
+		
+		if(!out.open(opts.outfile,bf.header(),opts.numThreads,opts.compressLevel)){
+			cerr<<"bam file "<<opts.outfile<<" cannot be open for writing"<<endl;
+			bam_destroy1(bamInfo);
+			return 1;
+		}
+		
+		uint64_t recordIndex=0;
+		stats.beginPass("second");
+		
+		while((ret=bf.read(view))>=0){
+			if(recordIndex%1000000==0){
+				cerr<<"second pass: passing through read "<<(recordIndex+1)<<endl;
+			}
+			
+			if(stats.tick()){
+				stats.progress(bf.bytesIn(),out.bytesOut(),0,0);
+			}
+			
+			if(recordIndex>=spill.numRecords){
+				cerr<<"bam file "<<opts.bamfile<<" has more records in the second pass than in the first. abort"<<endl;
+				out.close();
+				if(!isStdStream(opts.outfile)){
+					unlink(opts.outfile.c_str());
+				}
+				bam_destroy1(bamInfo);
+				return 1;
+			}
+			
+			if(spill.passes(recordIndex)){
+				unsigned int NH=opts.addNH?spill.numHits(recordIndex):0;
+				writePassing(opts,out,view,CountStruct(NH,NH),bamInfo);
+				
+				outTotal++;
+			}
+			
+			recordIndex++;
+		}
+		
+		if(bf.failed(ret)){
+			cerr<<"bam file "<<opts.bamfile<<" is truncated or corrupt after "<<recordIndex<<" reads"<<endl;
+			out.close();
+			if(!isStdStream(opts.outfile)){
+				unlink(opts.outfile.c_str());
+			}
+			bam_destroy1(bamInfo);
+			return 1;
+		}
+		
+		if(out.close()!=0){
+			cerr<<"error writing bam file "<<opts.outfile<<endl;
+			bam_destroy1(bamInfo);
+			return 1;
+		}
+		bf.close();
+		stats.endPass(stats.inputSize,fileSize(opts.outfile));
+		stats.recordsOut=outTotal;
+		
+		cerr<<"outReads\t"<<outTotal<<endl;
+	}
+	
+	bam_destroy1(bamInfo);
+	
+	cerr<<"<Done>"<<endl;
+	return 0;
+}
+
 int runGetUniqReads_twoPass(OptionStruct& opts){
 	
 	//CountPair firstAlignmentAdder(1,0);
@@ -107,73 +544,84 @@ int runGetUniqReads_twoPass(OptionStruct& opts){
 	
 	char qnameBuffer[256];
 	
-	samfile_t* bf=samopen(opts.bamfile.c_str(),"rb",0);
+	BamInput bf;
 
 
 
-	if(!bf){
+	if(!bf.open(opts.bamfile,opts.numThreads,opts.samIn)){
 		cerr<<"bam file "<<opts.bamfile<<" cannot be open for counting"<<endl;
 		return 1;
 	}
 
 	
-	map<string,CountStruct> readHitsMap;
+	//read names are only kept when they have to be reported
+	ReadHitsMap readHitsMap(opts.printStatFile!="");
 	
 	
 	
 	bam1_t *bamInfo=bam_init1();
+	BamRecordView view;
 
 	//first pass
 	unsigned int total;
 	total=0;
 	
+	FilterStats& stats=opts.stats;
+	stats.mode="two-pass";
+	stats.beginPass("first");
 	
-	
-	map<string,BamReader::BamAuxStruct> auxfields;
-	
-	while(samread(bf,bamInfo)>=0){
+	int ret;
+	while((ret=bf.read(view))>=0){
 		total++;
 		if(total%1000000==1){
 			cerr<<"first pass: passing through read "<<total<<endl;
 		}
 		
-		string qname=BamReader::getQName(bamInfo);
+		if(stats.tick()){
+			stats.progress(bf.bytesIn(),0,readHitsMap.size(),readHitsMap.memoryUsage());
+		}
+		
 		//unsigned char qual=BamReader::getMappingQual(bamInfo);
 		
 				
-		CountStruct Adder;
+		CountStruct Adder=alignmentAdder(view);
 		
-		if(BamReader::hasMultipleFragments(bamInfo))
-		{
-			if(BamReader::isFirstFragment(bamInfo))
-			{
-				Adder.firstAlignmentCount=1;
-				Adder.secondAlignmentCount=0;			
-			}
-			else
-			{
-				Adder.firstAlignmentCount=0;
-				Adder.secondAlignmentCount=1;	
-			}
-		}
-		else
-		{
-			Adder.firstAlignmentCount=1;
-			Adder.secondAlignmentCount=0;
-		}
+		bool inserted;
+		readHitsMap.findOrInsert(fingerprintQName(view),view.qname(),view.l_qname()-1,inserted)+=Adder;
 		
-		map<string,CountStruct>::iterator i=readHitsMap.find(qname);
-		if(i==readHitsMap.end()){
-			readHitsMap.insert(map<string,CountStruct>::value_type(qname,Adder));
-		}
-		else
-		{
-			i->second+=Adder;
+		if(opts.maxMem>0 && inserted && readHitsMap.memoryUsage()>opts.maxMem){
+			//start over, spilling to disk
+			cerr<<"read hits table exceeds --max-mem after "<<total<<" reads. counting again with spill files"<<endl;
+			stats.noteTable(readHitsMap.size(),readHitsMap.memoryUsage());
+			stats.passes.back().name="first (abandoned for spilling)";
+			stats.endPass(bf.bytesIn(),0);
+			bf.close();
+			bam_destroy1(bamInfo);
+			return runGetUniqReads_spilled(opts);
 		}
 	}
-
 	
-	samclose(bf);
+	if(bf.failed(ret)){
+		cerr<<"bam file "<<opts.bamfile<<" is truncated or corrupt after "<<total<<" reads"<<endl;
+		bam_destroy1(bamInfo);
+		return 1;
+	}
+	
+	bf.close();
+	stats.endPass(stats.inputSize,0);
+	stats.recordsIn=total;
+	stats.noteTable(readHitsMap.size(),readHitsMap.memoryUsage());
+	stats.addCounter("distinctReads",readHitsMap.size());
+	
+	if(stats.jsonFile!=""){
+		stats.hasHistogram=true;
+		for(size_t slot=0;slot<readHitsMap.capacity();slot++){
+			if(readHitsMap.used(slot)){
+				const CountStruct& counts=readHitsMap.values[slot];
+				stats.hits.add(max(counts.firstAlignmentCount,counts.secondAlignmentCount));
+			}
+		}
+	}
 	
 	cerr<<"inReads\t"<<total<<endl;
 	
@@ -193,18 +641,29 @@ int runGetUniqReads_twoPass(OptionStruct& opts){
 		
 		statOutFile<<"QName\tFirstAlignmentCount\tSecondAlignmentCount"<<endl;
 		
+		//report in name order
+		vector<size_t> slots;
+		slots.reserve(readHitsMap.size());
+		for(size_t slot=0;slot<readHitsMap.capacity();slot++){
+			if(readHitsMap.used(slot)){
+				slots.push_back(slot);
+			}
+		}
+		
+		sort(slots.begin(),slots.end(),ReadHitsMapNameLess(readHitsMap));
 		
-		for(map<string,CountStruct>::iterator i=readHitsMap.begin();i!=readHitsMap.end();i++)
+		for(vector<size_t>::iterator i=slots.begin();i!=slots.end();i++)
 		{
-			statOutFile<<i->first<<"\t"<<i->second.firstAlignmentCount<<"\t"<<i->second.secondAlignmentCount<<endl;
-			totalFirstAlignmentCount+=i->second.firstAlignmentCount;
-			totalSecondAlignmentCount+=i->second.secondAlignmentCount;
+			CountStruct& counts=readHitsMap.values[*i];
+			statOutFile<<readHitsMap.names[*i]<<"\t"<<counts.firstAlignmentCount<<"\t"<<counts.secondAlignmentCount<<endl;
+			totalFirstAlignmentCount+=counts.firstAlignmentCount;
+			totalSecondAlignmentCount+=counts.secondAlignmentCount;
 			
-			if(i->second.firstAlignmentCount>0){
+			if(counts.firstAlignmentCount>0){
 				totalUniqFirstAlignmentCount++;
 			}
 			
-			if(i->second.secondAlignmentCount>0){
+			if(counts.secondAlignmentCount>0){
 				totalUniqSecondAlignmentCount++;	
 			}
 				
@@ -231,59 +690,46 @@ int runGetUniqReads_twoPass(OptionStruct& opts){
 		
 		int outTotal=0;
 		
-		bf = samopen(opts.bamfile.c_str(),"rb",0);
-		
-		samfile_t* out= samopen(opts.outfile.c_str(), "wb", bf->header);
-		
-		if(!bf){
+		if(!bf.open(opts.bamfile,opts.numThreads,opts.samIn)){
 			cerr<<"bam file "<<opts.bamfile<<" cannot be open"<<endl;
 			return 1;
 		}
-		total=0;
 		
+		BamOutput out;
 		
+		if(!out.open(opts.outfile,bf.header(),opts.numThreads,opts.compressLevel)){
+			cerr<<"bam file "<<opts.outfile<<" cannot be open for writing"<<endl;
+			return 1;
+		}
+		total=0;
 		
+		stats.beginPass("second");
 		
-		while(samread(bf,bamInfo)>=0){
+		while((ret=bf.read(view))>=0){
 			total++;
 			if(total%1000000==1){
 				cerr<<"second pass: passing through read "<<total<<endl;
 			}
 			
-			string qname=BamReader::getQName(bamInfo);
+			if(stats.tick()){
+				stats.progress(bf.bytesIn(),out.bytesOut(),readHitsMap.size(),readHitsMap.memoryUsage());
+			}
+			
 			//unsigned char qual=BamReader::getMappingQual(bamInfo);
 			
-			map<string,CountStruct>::iterator i=readHitsMap.find(qname);
-			if(i==readHitsMap.end()){
-				cerr<<"cannot found read "<<qname<<" in second pass?";
+			CountStruct* counts=readHitsMap.find(fingerprintQName(view));
+			if(!counts){
+				cerr<<"cannot found read "<<view.qname()<<" in second pass?";
 			}
 			else{
 				
 	
-				if(i->second.firstAlignmentCount<=opts.maxHits && i->second.secondAlignmentCount<=opts.maxHits){
+				if(counts->firstAlignmentCount<=opts.maxHits && counts->secondAlignmentCount<=opts.maxHits){
 					//only output these:
 					//TODO: do we need the best?
 					//can we directly write to a bam file?
 					
-					if(opts.addNH && !BamReader::hasAuxField(bamInfo,"NH")){
-						int NH;
-						if(!BamReader::hasMultipleFragments(bamInfo) || BamReader::isFirstFragment(bamInfo)){
-							//first fragment
-							NH=i->second.firstAlignmentCount;
-						}
-						else{
-							NH=i->second.secondAlignmentCount;
-						}
-						
-						BamReader::BamAuxStruct bas;
-						bas.type=BAMAUX_INTVALUE;
-						bas.intValue=NH;
-						
-						BamReader::appendAuxField(bamInfo,"NH",&bas);
-						
-					}
-					
-					bam_write1(out->x.bam,bamInfo);
+					writePassing(opts,out,view,*counts,bamInfo);
 					
 					outTotal++;
 				
@@ -291,8 +737,23 @@ int runGetUniqReads_twoPass(OptionStruct& opts){
 			}
 		}
 		
-		samclose(out);
-		samclose(bf);
+		if(bf.failed(ret)){
+			cerr<<"bam file "<<opts.bamfile<<" is truncated or corrupt after "<<total<<" reads"<<endl;
+			out.close();
+			if(!isStdStream(opts.outfile)){
+				unlink(opts.outfile.c_str());
+			}
+			bam_destroy1(bamInfo);
+			return 1;
+		}
+		
+		if(out.close()!=0){
+			cerr<<"error writing bam file "<<opts.outfile<<endl;
+			return 1;
+		}
+		bf.close();
+		stats.endPass(stats.inputSize,fileSize(opts.outfile));
+		stats.recordsOut=outTotal;
 		
 		cerr<<"outReads\t"<<outTotal<<endl;
 	}
@@ -306,78 +767,253 @@ int runGetUniqReads_twoPass(OptionStruct& opts){
 }
 
 
-int runGetUniqReads_useNHFlag(OptionStruct& opts){
+//the @HD line of the header, "" if there is none
+string headerHDLine(const bam_header_t* header){
+	if(!header->text || header->l_text<3 || strncmp(header->text,"@HD",3)!=0){
+		return "";
+	}
+	
+	string hdLine(header->text,header->l_text);
+	size_t eol=hdLine.find('\n');
+	if(eol!=string::npos){
+		hdLine=hdLine.substr(0,eol);
+	}
+	
+	return hdLine;
+}
+
+//@HD SO:queryname or GO:query: all alignments of a read are next to each other
+bool isNameGroupedHeader(const bam_header_t* header){
+	string hdLine=headerHDLine(header);
+	return hdLine.find("\tSO:queryname")!=string::npos || hdLine.find("\tGO:query")!=string::npos;
+}
+
+bool isCoordinateSortedHeader(const bam_header_t* header){
+	return headerHDLine(header).find("\tSO:coordinate")!=string::npos;
+}
+
+/* pending mates
+ 
+ NH of the alignment of a pair met first, held until its mate alignment arrives. The key
+ is the read name fingerprint mixed with the segment and position of the mate alignment,
+ so that each alignment of a multi-mapped pair meets its own mate. Entries whose mate has
+ not come are evicted once the stream has passed its position (coordinate sorted input)
+ or moved on to the next read (name grouped input)
+ 
+ */
+#define PENDING_MATES_CAPACITY 1024
 
+#define PENDING_MATES_NONE 0 //neither sorted nor grouped: mates are not checked
+#define PENDING_MATES_BY_POSITION 1
+#define PENDING_MATES_BY_READ 2
 
+inline uint64_t packPosition(int32_t tid,int32_t pos){
+	return (uint64_t(uint32_t(tid))<<32)|uint32_t(pos);
+}
+
+inline ReadNameFingerprint mateKey(const ReadNameFingerprint& fp,bool firstSegment,int32_t tid,int32_t pos){
+	uint64_t where=mixHash64(packPosition(tid,pos)^(firstSegment?1:2));
+	ReadNameFingerprint key(fp.hi^where,fp.lo^mixHash64(where));
+	if(key.empty()){
+		key.lo=1;
+	}
+	return key;
+}
+
+class PendingMates{
+public:
+	int mode; //PENDING_MATES_*
+	FingerprintHashMap<uint32_t> numHits; //NH of the alignment met first, by the key of its mate
 	
+	//by position: (position of the mate, key), earliest first
+	priority_queue<pair<uint64_t,ReadNameFingerprint>,vector<pair<uint64_t,ReadNameFingerprint> >,greater<pair<uint64_t,ReadNameFingerprint> > > evictions;
 	
-	int total;
-	
-	samfile_t*  bf = samopen(opts.bamfile.c_str(),"rb",0);
-	bam1_t *bamInfo=bam_init1();
+	ReadNameFingerprint currentRead; //by read
 	
+	PendingMates(int _mode):mode(_mode){}
 	
-	samfile_t* out=NULL;
+	inline size_t size() const{
+		return numHits.size();
+	}
 	
-	ofstream *statOutFile=NULL;
-	set<string>* qnamesRecord=NULL; //remember those outputed ones
+	inline size_t memoryUsage() const{
+		return numHits.memoryUsage()+evictions.size()*sizeof(pair<uint64_t,ReadNameFingerprint>);
+	}
 	
-	if(opts.printStatFile!=""){
-		statOutFile=new ofstream(opts.printStatFile.c_str());
-		qnamesRecord=new set<string>;
+	//NH of the mate of this alignment, or 0 if its mate has not been met (yet). Alignments of
+	//both mapped mates have to be passed in input order
+	uint32_t meet(const BamRecordView& view,const ReadNameFingerprint& fp,bool firstSegment,uint32_t NH){
+		if(mode==PENDING_MATES_NONE){
+			return 0;
+		}
+		
+		int32_t tid=view.tid();
+		int32_t pos=view.pos();
+		
+		if(mode==PENDING_MATES_BY_POSITION){
+			uint64_t here=packPosition(tid,pos);
+			while(!evictions.empty() && evictions.top().first<here){
+				numHits.erase(evictions.top().second);
+				evictions.pop();
+			}
+		}else if(fp!=currentRead){
+			numHits.clear(PENDING_MATES_CAPACITY);
+			currentRead=fp;
+		}
+		
+		ReadNameFingerprint key=mateKey(fp,firstSegment,tid,pos);
+		uint32_t* mateNH=numHits.find(key);
+		if(mateNH){
+			uint32_t found=*mateNH;
+			numHits.erase(key);
+			return found;
+		}
+		
+		//a mate behind this one that was not met is not coming
+		uint64_t matePosition=packPosition(view.mtid(),view.mpos());
+		if(mode==PENDING_MATES_BY_READ || matePosition>=packPosition(tid,pos)){
+			ReadNameFingerprint mate=mateKey(fp,!firstSegment,view.mtid(),view.mpos());
+			bool inserted;
+			numHits.findOrInsert(mate,inserted)=NH;
+			if(mode==PENDING_MATES_BY_POSITION){
+				evictions.push(pair<uint64_t,ReadNameFingerprint>(matePosition,mate));
+			}
+		}
+		
+		return 0;
 	}
+};
+
+//single pass over the opened input: keep each alignment whose own NH is within max hits and write it as it streams
+int runGetUniqReads_useNHFlag(OptionStruct& opts,BamInput& bf){
 	
+	unsigned int total;
+	unsigned int outTotal=0;
+	unsigned int missingNH=0;
+	unsigned int inconsistentMates=0; //alignment pairs
 	
-	if(opts.outfile!="")
-		out = samopen(opts.outfile.c_str(), "wb", bf->header);
+	BamOutput out;
 	
-	if(!bf){
-		cerr<<"bam file "<<opts.bamfile<<" cannot be open"<<endl;
+	if(opts.outfile!="" && !out.open(opts.outfile,bf.header(),opts.numThreads,opts.compressLevel)){
+		cerr<<"bam file "<<opts.outfile<<" cannot be open for writing"<<endl;
 		return 1;
 	}
-	total=0;
 	
+	BamRecordView view;
 	
+	ofstream *statOutFile=NULL;
+	FingerprintHashMap<char>* qnamesRecord=NULL; //remember those outputed ones
+	
+	int pendingMode=PENDING_MATES_NONE;
+	if(isCoordinateSortedHeader(bf.header())){
+		pendingMode=PENDING_MATES_BY_POSITION;
+	}else if(isNameGroupedHeader(bf.header())){
+		pendingMode=PENDING_MATES_BY_READ;
+	}else{
+		cerr<<"bam file "<<opts.bamfile<<" is neither sorted by coordinate nor grouped by read name: NH of mates is not checked"<<endl;
+	}
 	
+	PendingMates pendingMates(pendingMode);
 	
-	while(samread(bf,bamInfo)>=0){
+	if(opts.printStatFile!=""){
+		statOutFile=new ofstream(opts.printStatFile.c_str());
+		qnamesRecord=new FingerprintHashMap<char>;
+	}
+	
+	total=0;
+	
+	bool aborted=false;
+	
+	FilterStats& stats=opts.stats;
+	stats.mode="use-NH-flag";
+	stats.hasHistogram=true;
+	stats.beginPass("single");
+	
+	int ret;
+	while((ret=bf.read(view))>=0){
 		total++;
 		if(total%1000000==1){
 			cerr<<"Passing through read "<<total<<endl;
 		}
 		
+		if(stats.tick()){
+			stats.progress(bf.bytesIn(),out.bytesOut(),pendingMates.size(),pendingMates.memoryUsage());
+		}
 		
-		//unsigned char qual=BamReader::getMappingQual(bamInfo);
 		
-		int numHits=BamReader::getNumHits(bamInfo,-1);
-		string qname=BamReader::getQName(bamInfo);
+		uint16_t flag=view.flag();
+		bool paired=(flag&BAM_FPAIRED);
+		bool firstSegment=(!paired || (flag&BAM_FREAD1));
+		
+		int numHits=view.numHits(-1);
 		
 		if(numHits==-1){
-			//string qname=BamReader::getQName(bamInfo);
-			cerr<<"Read at line "<<total<<" with name "<<qname<<" has no NH flag. abort";
-			break;
+			if(flag&BAM_FUNMAP){
+				//unmapped records often carry no NH. As in the two pass mode, they count as one alignment
+				numHits=1;
+			}else{
+				missingNH++;
+				
+				if(opts.missingNHPolicy==MISSING_NH_ABORT){
+					cerr<<"Read at line "<<total<<" with name "<<view.qname()<<" has no NH flag. abort"<<endl;
+					aborted=true;
+					break;
+				}else if(opts.missingNHPolicy==MISSING_NH_DROP){
+					continue;
+				}
+				
+				numHits=1;
+			}
 		}
 		
-		if(statOutFile){
+		ReadNameFingerprint fp=fingerprintQName(view);
+		
+		//each read once, at the primary alignment of its first segment
+		if(!(flag&BAM_FSECONDARY) && firstSegment){
+			stats.hits.add(numHits);
+		}
+		
+		//check that both mates of an alignment pair report the same NH, as each is filtered by its own
+		if(paired && !(flag&(BAM_FUNMAP|BAM_FMUNMAP))){
+			uint32_t mateNH=pendingMates.meet(view,fp,firstSegment,numHits);
+			stats.noteTable(pendingMates.size(),pendingMates.memoryUsage());
 			
-			if(qnamesRecord->find(qname)==qnamesRecord->end()){
-				(*statOutFile)<<qname<<"\t"<<numHits<<endl;
-				qnamesRecord->insert(qname);	
+			if(mateNH>0 && mateNH!=(uint32_t)numHits){
+				inconsistentMates++;
+				
+				if(opts.inconsistentNHPolicy==INCONSISTENT_NH_ABORT){
+					cerr<<"Read "<<view.qname()<<" has NH "<<numHits<<" on one mate but "<<mateNH<<" on the other. abort"<<endl;
+					aborted=true;
+					break;
+				}
+				
+				if(inconsistentMates==1){
+					cerr<<"Read "<<view.qname()<<" has NH "<<numHits<<" on one mate but "<<mateNH<<" on the other. Each mate is filtered by its own NH"<<endl;
+				}
+			}
+		}
+		
+		if(statOutFile){
+			bool inserted;
+			qnamesRecord->findOrInsert(fp,inserted);
+			if(inserted){
+				(*statOutFile)<<view.qname()<<"\t"<<numHits<<endl;
 			}
 		}
 		
 	
 		if(numHits<=opts.maxHits){	
 			
-			if(out)
-				bam_write1(out->x.bam,bamInfo);
-				
+			if(out.isOpen())
+				out.write(view);
+			
+			outTotal++;
 		}
 		
 	}
 	
-	if(out)
-		samclose(out);
+	bool inputFailed=(!aborted && bf.failed(ret));
+	bool outputFailed=(out.close()!=0);
 	
 	if(statOutFile){
 		statOutFile->close();
@@ -388,18 +1024,292 @@ int runGetUniqReads_useNHFlag(OptionStruct& opts){
 		delete qnamesRecord;	
 	}
 	
-	samclose(bf);
+	bf.close();
+	
+	stats.noteTable(pendingMates.size(),pendingMates.memoryUsage());
+	stats.endPass(stats.inputSize,outputFailed?0:fileSize(opts.outfile));
+	stats.recordsIn=total;
+	stats.recordsOut=outTotal;
+	stats.addCounter("readsWithoutNH",missingNH);
+	stats.addCounter("pairsWithInconsistentNH",inconsistentMates);
+	
+	if(aborted || inputFailed || outputFailed){
+		//do not leave a truncated bam behind
+		if(opts.outfile!="" && !isStdStream(opts.outfile)){
+			unlink(opts.outfile.c_str());
+		}
+		
+		if(inputFailed){
+			cerr<<"bam file "<<opts.bamfile<<" is truncated or corrupt after "<<total<<" reads"<<endl;
+		}
+		
+		if(outputFailed){
+			cerr<<"error writing bam file "<<opts.outfile<<endl;
+		}
+		return 1;
+	}
+	
+	cerr<<"inReads\t"<<total<<endl;
+	cerr<<"outReads\t"<<outTotal<<endl;
+	
+	if(missingNH>0){
+		cerr<<"readsWithoutNH\t"<<missingNH<<"\t"<<(opts.missingNHPolicy==MISSING_NH_DROP?"dropped":"kept as unique")<<endl;
+	}
+	
+	if(inconsistentMates>0){
+		cerr<<"pairsWithInconsistentNH\t"<<inconsistentMates<<"\tkept by the NH of each mate"<<endl;
+	}
+	
+	cerr<<"<Done>"<<endl;
+	return 0;
+}
+
+class NameGroupStat{
+	public:
+		unsigned int totalFirstAlignmentCount;
+		unsigned int totalSecondAlignmentCount;
+		unsigned int totalUniqFirstAlignmentCount;
+		unsigned int totalUniqSecondAlignmentCount;
+		unsigned int totalGroups;
+		
+		NameGroupStat():totalFirstAlignmentCount(0),totalSecondAlignmentCount(0),totalUniqFirstAlignmentCount(0),totalUniqSecondAlignmentCount(0),totalGroups(0){}
+};
+
+/* alignments of the current read
+ 
+ copied one after another out of the input blocks (which are recycled as reading goes on)
+ into a buffer reused from read to read
+ 
+ */
+class NameGroup{
+	public:
+		vector<unsigned char> buffer;
+		vector<pair<size_t,int> > records; //offset in buffer, length
+		size_t used;
+		
+		NameGroup():used(0){}
+		
+		inline unsigned int size() const{
+			return records.size();
+		}
+		
+		inline void clear(){
+			records.clear();
+			used=0;
+		}
+		
+		void add(const BamRecordView& view){
+			if(used+view.length>buffer.size()){
+				buffer.resize((used+view.length)*2);
+			}
+			
+			memcpy(&buffer[used],view.data,view.length);
+			records.push_back(pair<size_t,int>(used,view.length));
+			used+=view.length;
+		}
+		
+		inline BamRecordView operator [] (unsigned int i) const{
+			return BamRecordView(&buffer[records[i].first],records[i].second);
+		}
+};
+
+//emit or drop the alignments of one read
+void flushNameGroup(OptionStruct& opts,const NameGroup& group,const CountStruct& counts,BamOutput& out,ofstream* statOutFile,NameGroupStat& stat,unsigned int& outTotal,bam1_t* bamInfo){
+	if(group.size()==0){
+		return;
+	}
+	
+	opts.stats.hits.add(max(counts.firstAlignmentCount,counts.secondAlignmentCount));
+	
+	if(statOutFile){
+		(*statOutFile)<<group[0].qname()<<"\t"<<counts.firstAlignmentCount<<"\t"<<counts.secondAlignmentCount<<endl;
+		stat.totalFirstAlignmentCount+=counts.firstAlignmentCount;
+		stat.totalSecondAlignmentCount+=counts.secondAlignmentCount;
+		if(counts.firstAlignmentCount>0){
+			stat.totalUniqFirstAlignmentCount++;
+		}
+		if(counts.secondAlignmentCount>0){
+			stat.totalUniqSecondAlignmentCount++;
+		}
+		stat.totalGroups++;
+	}
+	
+	if(counts.firstAlignmentCount>opts.maxHits || counts.secondAlignmentCount>opts.maxHits){
+		return;
+	}
+	
+	for(unsigned int i=0;i<group.size();i++){
+		if(out.isOpen()){
+			writePassing(opts,out,group[i],counts,bamInfo);
+		}
+		
+		outTotal++;
+	}
+}
+
+//single pass over the opened input, whose alignments are grouped by read name. Only the current read is buffered
+int runGetUniqReads_nameGrouped(OptionStruct& opts,BamInput& bf){
+	
+	BamOutput out;
+	if(opts.outfile!="" && !out.open(opts.outfile,bf.header(),opts.numThreads,opts.compressLevel)){
+		cerr<<"bam file "<<opts.outfile<<" cannot be open for writing"<<endl;
+		return 1;
+	}
+	
+	ofstream* statOutFile=NULL;
+	if(opts.printStatFile!=""){
+		statOutFile=new ofstream(opts.printStatFile.c_str());
+		(*statOutFile)<<"QName\tFirstAlignmentCount\tSecondAlignmentCount"<<endl;
+	}
+	
+	BamRecordView view;
+	NameGroup group;
+	size_t largestGroup=0;
+	CountStruct groupCounts;
+	NameGroupStat stat;
+	bam1_t* bamInfo=bam_init1(); //for --add-NH
+	
+	unsigned int total=0;
+	unsigned int outTotal=0;
+	
+	FilterStats& stats=opts.stats;
+	stats.mode="name-grouped";
+	stats.hasHistogram=true;
+	stats.beginPass("single");
+	
+	int ret;
+	while((ret=bf.read(view))>=0){
+		total++;
+		if(total%1000000==1){
+			cerr<<"Passing through read "<<total<<endl;
+		}
+		
+		if(stats.tick()){
+			stats.progress(bf.bytesIn(),out.bytesOut(),group.size(),group.buffer.size());
+		}
+		
+		if(group.size()>0 && strcmp(view.qname(),group[0].qname())!=0){
+			flushNameGroup(opts,group,groupCounts,out,statOutFile,stat,outTotal,bamInfo);
+			
+			if(group.size()>largestGroup){
+				largestGroup=group.size();
+			}
+			
+			group.clear();
+			groupCounts=CountStruct();
+		}
+		
+		groupCounts+=alignmentAdder(view);
+		group.add(view);
+	}
+	
+	if(bf.failed(ret)){
+		//the last group may be incomplete: nothing more is written
+		cerr<<"bam file "<<opts.bamfile<<" is truncated or corrupt after "<<total<<" reads"<<endl;
+		out.close();
+		if(opts.outfile!="" && !isStdStream(opts.outfile)){
+			unlink(opts.outfile.c_str());
+		}
+		if(statOutFile){
+			statOutFile->close();
+			delete statOutFile;
+		}
+		bam_destroy1(bamInfo);
+		return 1;
+	}
+	
+	flushNameGroup(opts,group,groupCounts,out,statOutFile,stat,outTotal,bamInfo);
+	
+	if(group.size()>largestGroup){
+		largestGroup=group.size();
+	}
+	
+	stats.noteTable(largestGroup,group.buffer.size());
+	
 	bam_destroy1(bamInfo);
 	
+	if(out.close()!=0){
+		cerr<<"error writing bam file "<<opts.outfile<<endl;
+		return 1;
+	}
+	
+	bf.close();
+	stats.endPass(stats.inputSize,fileSize(opts.outfile));
+	stats.recordsIn=total;
+	stats.recordsOut=outTotal;
+	stats.addCounter("distinctReads",stat.totalGroups);
+	
+	cerr<<"inReads\t"<<total<<endl;
+	
+	if(statOutFile){
+		(*statOutFile)<<"TotalAlignments"<<"\t"<<stat.totalFirstAlignmentCount<<"\t"<<stat.totalSecondAlignmentCount<<endl;
+		(*statOutFile)<<"TotalMapped"<<"\t"<<stat.totalUniqFirstAlignmentCount<<"\t"<<stat.totalUniqSecondAlignmentCount<<endl;
+		(*statOutFile)<<"TotalMappedUnion"<<"\t"<<stat.totalGroups<<"\t"<<stat.totalGroups<<endl;
+		statOutFile->close();
+		delete statOutFile;
+		
+		cerr<<"TotalAlignments"<<"\tread1="<<stat.totalFirstAlignmentCount<<"\tread2="<<stat.totalSecondAlignmentCount<<endl;
+		cerr<<"TotalMapped"<<"\tread1="<<stat.totalUniqFirstAlignmentCount<<"\tread2="<<stat.totalUniqSecondAlignmentCount<<endl;
+		cerr<<"TotalMappedUnion"<<"\t"<<stat.totalGroups<<endl;
+	}
+	
+	if(opts.outfile!=""){
+		cerr<<"outReads\t"<<outTotal<<endl;
+	}
+	
+	cerr<<"<Done>"<<endl;
 	return 0;
 }
 
+//whether the input is grouped by read name, either forced or declared by its header
+bool useNameGroupedMode(OptionStruct& opts,const bam_header_t* header){
+	if(opts.nameGrouped){
+		return true;
+	}
+	
+	if(opts.forceTwoPass){
+		return false;
+	}
+	
+	bool grouped=isNameGroupedHeader(header);
+	
+	if(grouped){
+		cerr<<"bam file "<<opts.bamfile<<" is grouped by read name. Use single pass name grouped mode"<<endl;
+	}
+	
+	return grouped;
+}
+
 int runGetUniqReads(OptionStruct& opts){
-	//if(opts.useNHFlag){
-	//	return runGetUniqReads_useNHFlag(opts);
-	//}else{
-		return runGetUniqReads_twoPass(opts);
-	//}
+	opts.stats.inputSize=fileSize(opts.bamfile);
+	
+	//opened once here for the mode to be chosen from its header: stdin cannot be opened again
+	BamInput bf;
+	
+	if(!bf.open(opts.bamfile,opts.numThreads,opts.samIn)){
+		cerr<<"bam file "<<opts.bamfile<<" cannot be open"<<endl;
+		return 1;
+	}
+	
+	int ret;
+	
+	if(opts.useNHFlag){
+		ret=runGetUniqReads_useNHFlag(opts,bf);
+	}else if(useNameGroupedMode(opts,bf.header())){
+		ret=runGetUniqReads_nameGrouped(opts,bf);
+	}else if(isStdStream(opts.bamfile)){
+		cerr<<"input from stdin is read once and cannot be filtered in two passes. Use --use-NH-flag, or --name-grouped if the alignments of each read are next to each other"<<endl;
+		return 1;
+	}else{
+		bf.close();
+		ret=runGetUniqReads_twoPass(opts);
+	}
+	
+	if(ret==0 && !opts.stats.writeJson(opts.bamfile,opts.outfile,opts.maxHits)){
+		cerr<<"cannot write stats to "<<opts.stats.jsonFile<<endl;
+	}
+	
+	return ret;
 }
 
 int main(int argc,char*argv[])
@@ -410,9 +1320,20 @@ int main(int argc,char*argv[])
 	long_options.push_back("max-hits=");
 	long_options.push_back("in=");
 	long_options.push_back("out=");
+	long_options.push_back("sam-in");
 	long_options.push_back("add-NH");
-	//long_options.push_back("use-NH-flag"); //cancel use NH flag
+	long_options.push_back("use-NH-flag");
+	long_options.push_back("missing-NH=");
+	long_options.push_back("inconsistent-NH=");
+	long_options.push_back("name-grouped");
+	long_options.push_back("two-pass");
+	long_options.push_back("threads=");
+	long_options.push_back("compress-level=");
+	long_options.push_back("max-mem=");
+	long_options.push_back("tmp-dir=");
 	long_options.push_back("print-NH-stat-to=");
+	long_options.push_back("stats-json=");
+	long_options.push_back("progress=");
 	
 	//long_options.push_bacl("out-best-qual");
 	
@@ -453,9 +1374,63 @@ int main(int argc,char*argv[])
 	
 	opts.bamfile=getOptValue(optmap,"--in");
 	opts.outfile=getOptValue(optmap,"--out","");
+	opts.samIn=hasOpt(optmap,"--sam-in");
 	opts.addNH=hasOpt(optmap,"--add-NH");
-	//opts.useNHFlag=hasOpt(optmap,"--use-NH-flag");
+	opts.useNHFlag=hasOpt(optmap,"--use-NH-flag");
+	opts.nameGrouped=hasOpt(optmap,"--name-grouped");
+	opts.forceTwoPass=hasOpt(optmap,"--two-pass");
+	opts.numThreads=atoi(getOptValue(optmap,"--threads","1").c_str());
+	opts.compressLevel=atoi(getOptValue(optmap,"--compress-level","-1").c_str());
+	if(opts.compressLevel<-1 || opts.compressLevel>9){
+		cerr<<"--compress-level has to be between 0 and 9. abort"<<endl;
+		printUsage(argsFinal.programName);
+		return 1;
+	}
+	
+	string inconsistentNHPolicy=getOptValue(optmap,"--inconsistent-NH","abort");
+	if(inconsistentNHPolicy=="abort"){
+		opts.inconsistentNHPolicy=INCONSISTENT_NH_ABORT;
+	}else if(inconsistentNHPolicy=="keep"){
+		opts.inconsistentNHPolicy=INCONSISTENT_NH_KEEP;
+	}else{
+		cerr<<"unknown --inconsistent-NH policy "<<inconsistentNHPolicy<<". abort"<<endl;
+		printUsage(argsFinal.programName);
+		return 1;
+	}
+	
+	string missingNHPolicy=getOptValue(optmap,"--missing-NH","abort");
+	if(missingNHPolicy=="abort"){
+		opts.missingNHPolicy=MISSING_NH_ABORT;
+	}else if(missingNHPolicy=="drop"){
+		opts.missingNHPolicy=MISSING_NH_DROP;
+	}else if(missingNHPolicy=="keep"){
+		opts.missingNHPolicy=MISSING_NH_KEEP;
+	}else{
+		cerr<<"unknown --missing-NH policy "<<missingNHPolicy<<". abort"<<endl;
+		printUsage(argsFinal.programName);
+		return 1;
+	}
 	opts.printStatFile=getOptValue(optmap,"--print-NH-stat-to","");
+	
+	opts.maxMem=0;
+	if(hasOpt(optmap,"--max-mem")){
+		if(!parseMemorySize(getOptValue(optmap,"--max-mem"),opts.maxMem)){
+			cerr<<"invalid --max-mem "<<getOptValue(optmap,"--max-mem")<<". abort"<<endl;
+			printUsage(argsFinal.programName);
+			return 1;
+		}
+		
+		if(opts.printStatFile!=""){
+			cerr<<"--print-NH-stat-to needs all read names in memory and cannot be used with --max-mem. abort"<<endl;
+			return 1;
+		}
+	}
+	
+	opts.stats.jsonFile=getOptValue(optmap,"--stats-json","");
+	opts.stats.progressInterval=atof(getOptValue(optmap,"--progress","0").c_str());
+	
+	const char* tmpDirEnv=getenv("TMPDIR");
+	opts.tmpDir=getOptValue(optmap,"--tmp-dir",(tmpDirEnv && tmpDirEnv[0])?tmpDirEnv:"/tmp");
 	//opts.bestQual=hasOpt(optmap,"--out-best-qual");
 		
 	
@@ -20,10 +20,32 @@
 #include <iostream>
 #include <fstream>
 #include <set>
+#include <list>
+#include <algorithm>
 #include <Gff.h>
 #include <BamUtil.h>
 #include "AdvGetOptCpp/AdvGetOpt.h"
+#include "OutputBuffer.h"
+#include "ReadNameTable.h"
+#include "MultiMapperEM.h"
+#include "MultiMapperSpill.h"
+#include "RunTiming.h"
 #include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <zlib.h>
 using namespace std;
 using namespace Gff;
 
@@ -40,24 +62,299 @@ void outArgsHelp(string argname,string help){
 #define EXPRESSIONMODE_FPKM  3
 #define EXPRESSIONMODE_FPKM_DIVHITS 4
 
+/* gene selection
+ 
+ the genes asked for by --region and --genes-file. Only these are derived, counted and
+ reported; without any, every gene is. The bed files or block index are still read in
+ full: each gene is looked up by name, and its span binary searched among the regions
+ of its chromosome
+ 
+ */
+class GeneSelection{
+public:
+	set<string> names;
+	map<string,vector<pair<int,int> > > regions; //chrom -> [start0,end1), sorted and disjoint
+	
+	inline bool active() const{
+		return !names.empty() || !regions.empty();
+	}
+	
+	inline bool selects(const string& name,const string& chrom,int start0,int end1) const{
+		if(names.find(name)!=names.end()){
+			return true;
+		}
+		
+		map<string,vector<pair<int,int> > >::const_iterator i=regions.find(chrom);
+		if(i==regions.end()){
+			return false;
+		}
+		
+		//the first region ending after start0; disjoint regions end in start order
+		const vector<pair<int,int> >& spans=i->second;
+		int lo=0;
+		int hi=spans.size();
+		while(lo<hi){
+			int mid=(lo+hi)/2;
+			if(spans[mid].second<=start0){
+				lo=mid+1;
+			}else{
+				hi=mid;
+			}
+		}
+		
+		return lo<(int)spans.size() && spans[lo].first<end1;
+	}
+	
+	//add [start0,end1) to the regions of chrom, merging it with those it overlaps or touches
+	void addSpan(const string& chrom,int start0,int end1){
+		vector<pair<int,int> >& spans=regions[chrom];
+		
+		vector<pair<int,int> >::iterator first=spans.begin();
+		while(first!=spans.end() && first->second<start0){
+			first++;
+		}
+		
+		vector<pair<int,int> >::iterator last=first;
+		while(last!=spans.end() && last->first<=end1){
+			start0=min(start0,last->first);
+			end1=max(end1,last->second);
+			last++;
+		}
+		
+		first=spans.erase(first,last);
+		spans.insert(first,pair<int,int>(start0,end1));
+	}
+	
+	//chr, chr:start-end or chr:start (1-based, inclusive; commas allowed in numbers). Return false if malformed
+	bool addRegion(const string& region){
+		size_t colon=region.rfind(':');
+		if(colon==string::npos){
+			addSpan(region,0,INT_MAX);
+			return region.length()>0;
+		}
+		
+		string chrom=region.substr(0,colon);
+		string range;
+		for(size_t i=colon+1;i<region.length();i++){
+			if(region[i]!=','){
+				range+=region[i];
+			}
+		}
+		
+		char* end;
+		long start=strtol(range.c_str(),&end,10);
+		long stop=INT_MAX;
+		if(end==range.c_str() || start<1){
+			return false;
+		}
+		
+		if(*end=='-'){
+			const char* stopStr=end+1;
+			stop=strtol(stopStr,&end,10);
+			if(end==stopStr || stop<start){
+				return false;
+			}
+		}
+		
+		if(*end!='\0' || chrom.length()==0 || start>INT_MAX){
+			return false;
+		}
+		
+		addSpan(chrom,start-1,min(stop,(long)INT_MAX));
+		return true;
+	}
+	
+	//gene names, the first word of each line; # starts a comment line. filename - is stdin
+	bool addNamesFromFile(const string& filename){
+		ifstream fin;
+		istream* in=&cin;
+		if(filename!="-"){
+			fin.open(filename.c_str());
+			if(!fin.good()){
+				return false;
+			}
+			in=&fin;
+		}
+		
+		string line;
+		while(getline(*in,line)){
+			size_t start=line.find_first_not_of(" \t\r");
+			if(start==string::npos || line[start]=='#'){
+				continue;
+			}
+			
+			size_t end=line.find_first_of(" \t\r",start);
+			names.insert(line.substr(start,end==string::npos?string::npos:end-start));
+		}
+		
+		return true;
+	}
+};
+
+/* run statistics
+ 
+ what --stats-json reports: wall and cpu time of each phase and of the counting of each
+ bam, and counters of the counting pass. The sweep reads the records itself, so it sees
+ every record, bgzf block and --max-hits drop; fetching goes through BamReader, which
+ only lets the index seeks be counted
+ 
+ */
+class TimeSpent{
+public:
+	string name;
+	double wall;
+	double cpu;
+	
+	TimeSpent(const string& _name=""):name(_name),wall(0.0),cpu(0.0){}
+};
+
+class Stopwatch{
+public:
+	int who;
+	double wallStart;
+	double cpuStart;
+	
+	Stopwatch(int _who=CPU_TIME_PROCESS,bool start=true):who(_who),wallStart(0.0),cpuStart(0.0){
+		if(start){
+			restart();
+		}
+	}
+	
+	inline void restart(){
+		wallStart=wallClockSeconds();
+		cpuStart=cpuSeconds(who);
+	}
+	
+	//add the time since the last restart
+	inline void addTo(TimeSpent& time) const{
+		time.wall+=wallClockSeconds()-wallStart;
+		time.cpu+=cpuSeconds(who)-cpuStart;
+	}
+};
+
+//counters of one counting thread, merged into the RunStats when it is done
+class CountingStats{
+public:
+	uint64_t indexSeeks;
+	uint64_t bgzfBlocks;
+	uint64_t readsExamined;
+	uint64_t readsCounted; //assigned to at least one block
+	uint64_t readsDroppedByMaxHits; //overlapping some block but over --max-hits
+	bool recordsSeen; //the record counters above are meaningful (sweep, FPKM span fetch)
+	vector<TimeSpent> bams; //with --threads, summed over the threads
+	
+	CountingStats():indexSeeks(0),bgzfBlocks(0),readsExamined(0),readsCounted(0),readsDroppedByMaxHits(0),recordsSeen(false){}
+	
+	CountingStats(const vector<string>& bamfilenames):indexSeeks(0),bgzfBlocks(0),readsExamined(0),readsCounted(0),readsDroppedByMaxHits(0),recordsSeen(false){
+		for(vector<string>::const_iterator i=bamfilenames.begin();i!=bamfilenames.end();i++){
+			bams.push_back(TimeSpent(*i));
+		}
+	}
+	
+	//a record was read from fp. lastBlock holds the compressed offset of the block of the previous record
+	inline void addRecord(BGZF* fp,int64_t& lastBlock){
+		int64_t block=bgzf_tell(fp)>>16;
+		if(block!=lastBlock){
+			bgzfBlocks++;
+			lastBlock=block;
+		}
+		readsExamined++;
+	}
+};
+
+class RunStats{
+public:
+	string filename;
+	Stopwatch runWatch;
+	Stopwatch phaseWatch;
+	vector<TimeSpent> phases;
+	CountingStats counting;
+	bool totalsFromCountingPass;
+	unsigned int numGenes;
+	unsigned int numGenesWithoutBlocks;
+	bool multiMappersKept; //--em or --write-classes
+	uint64_t multiMapperHits;
+	size_t multiMapperPeakBytes;
+	bool multiMappersSpilled;
+	unsigned int equivalenceClasses;
+	pthread_mutex_t lock;
+	
+	RunStats(const string& _filename):filename(_filename),totalsFromCountingPass(false),numGenes(0),numGenesWithoutBlocks(0),multiMappersKept(false),multiMapperHits(0),multiMapperPeakBytes(0),multiMappersSpilled(false),equivalenceClasses(0){
+		pthread_mutex_init(&lock,NULL);
+	}
+	
+	~RunStats(){
+		pthread_mutex_destroy(&lock);
+	}
+	
+	inline void beginPhase(const string& name){
+		phases.push_back(TimeSpent(name));
+		phaseWatch.restart();
+	}
+	
+	inline void endPhase(){
+		phaseWatch.addTo(phases.back());
+	}
+	
+	void noteMultiMappers(const MultiMapperHitStore& store,const EquivalenceClassTable& classes){
+		multiMappersKept=true;
+		multiMapperHits=store.numHits;
+		multiMapperPeakBytes=store.peakBytes;
+		multiMappersSpilled=store.spilled;
+		equivalenceClasses=classes.size();
+	}
+	
+	//add the counters of a counting thread. Times of the same bam add up
+	void merge(const CountingStats& stats){
+		pthread_mutex_lock(&lock);
+		counting.indexSeeks+=stats.indexSeeks;
+		counting.bgzfBlocks+=stats.bgzfBlocks;
+		counting.readsExamined+=stats.readsExamined;
+		counting.readsCounted+=stats.readsCounted;
+		counting.readsDroppedByMaxHits+=stats.readsDroppedByMaxHits;
+		counting.recordsSeen=counting.recordsSeen || stats.recordsSeen;
+		for(vector<TimeSpent>::const_iterator i=stats.bams.begin();i!=stats.bams.end();i++){
+			vector<TimeSpent>::iterator j=counting.bams.begin();
+			while(j!=counting.bams.end() && j->name!=i->name){
+				j++;
+			}
+			if(j==counting.bams.end()){
+				counting.bams.push_back(*i);
+			}else{
+				j->wall+=i->wall;
+				j->cpu+=i->cpu;
+			}
+		}
+		pthread_mutex_unlock(&lock);
+	}
+};
+
 class OptionStruct {
 public:
-	vector<BamReader*> bamfiles;
 	vector<Annotation*> annotations;
 	vector<string> bamfilenames;
 	vector<string> bedfilenames;
 	int totalNumOfReads;
+	vector<int> totalNumOfReadsPerBam; //--total-num-reads values, for --matrix
+	bool matrix;
+	string serveSocket; //--serve
+	GeneSelection selection;
+	int serveCacheSize;
 	double constitutiveThresholdFrac;
 	int constitutiveThresholdNum;
 	bool flexmaxThresholding;
 	int flexmaxThreshold; //numbp
 	bool forceFlexMaxBasepairPolicy;
+	bool thresholdsGiven; //any threshold option on the command line
+	
+	string blockIndexFile; //--block-index: genes and blocks instead of bed files
+	string buildBlockIndexFile;
 	
-	ofstream* regionBedOutStream;
+	OutputBuffer* regionBedOutStream;
 	string regionBedOut;
 	
 	string noBlockBedOut;
-	ofstream *noBlockBedOutStream;
+	OutputBuffer *noBlockBedOutStream;
 	
 	
 	int expressionMode; //EXPRESSIONMODE_*
@@ -65,19 +362,121 @@ public:
 	string itemRgb;
 	string fillNA;
 	string prefixDataLabel;
+	bool sweep;
+	int numThreads;
+	bool scanTotalReads;
+	bool useTotalsCache;
+	bool em; //--em: multi-mapped reads allocated by EM instead of NH division
+	double emTolerance;
+	int emMaxIterations;
+	string writeClassesFile; //--write-classes
+	string classesFile; //--classes: count from this instead of the bams
+	string tmpDir; //--tmp-dir
+	size_t maxMem; //--max-mem: bytes of multi-mapped read hits kept in memory
+	RunStats* stats; //--stats-json, else NULL
 	
-	OptionStruct():totalNumOfReads(0),constitutiveThresholdFrac(0.0),constitutiveThresholdNum(0),flexmaxThresholding(false),flexmaxThreshold(0),maxHits(0),regionBedOutStream(NULL),noBlockBedOutStream(NULL),itemRgb("0,0,0"){}
+	OptionStruct():totalNumOfReads(0),matrix(false),serveCacheSize(16),constitutiveThresholdFrac(0.0),constitutiveThresholdNum(0),flexmaxThresholding(false),flexmaxThreshold(0),thresholdsGiven(false),maxHits(0),regionBedOutStream(NULL),noBlockBedOutStream(NULL),itemRgb("0,0,0"),sweep(false),numThreads(1),scanTotalReads(false),useTotalsCache(false),em(false),emTolerance(1e-4),emMaxIterations(1000),maxMem(MULTI_MAPPER_MEMORY_BUDGET),stats(NULL){}
 	~OptionStruct(){
+		if(stats){
+			delete stats;
+		}
+		
 		if(regionBedOutStream){
-			regionBedOutStream->close();
+			if(regionBedOutStream->close()!=0){
+				cerr<<"error writing "<<regionBedOut<<endl;
+			}
 			delete regionBedOutStream;
 		}
 		
 		if(noBlockBedOutStream){
-			noBlockBedOutStream->close();
+			if(noBlockBedOutStream->close()!=0){
+				cerr<<"error writing "<<noBlockBedOut<<endl;
+			}
 			delete noBlockBedOutStream;
 		}
 	}
+	
+	//reads with NH>1 are collected into equivalence classes instead of added to the genes while counting
+	inline bool keepsClasses() const{
+		return em || writeClassesFile!="";
+	}
+};
+
+/* normalization totals
+ 
+ the four totals of a bam accumulated record by record, so that they can be collected
+ from any pass that streams the whole file:
+ reads: mapped alignments
+ fragments: mapped alignments of unpaired reads or of the first fragment of pairs
+ DivHits variants weight each alignment by 1/NH
+ 
+ */
+class NormalizationTotals{
+public:
+	double numReads;
+	double numReadsDivHits;
+	double numFragments;
+	double numFragmentsDivHits;
+	
+	NormalizationTotals():numReads(0.0),numReadsDivHits(0.0),numFragments(0.0),numFragmentsDivHits(0.0){}
+	
+	inline void addRead(const bam1_t* bamInfo){
+		if(bamInfo->core.flag&BAM_FUNMAP){
+			return;
+		}
+		
+		double weight=1.0/BamReader::getNumHits(bamInfo,1);
+		
+		numReads+=1.0;
+		numReadsDivHits+=weight;
+		
+		if(!BamReader::hasMultipleFragments(bamInfo) || BamReader::isFirstFragment(bamInfo)){
+			numFragments+=1.0;
+			numFragmentsDivHits+=weight;
+		}
+	}
+	
+	inline NormalizationTotals& operator += (const NormalizationTotals& right){
+		numReads+=right.numReads;
+		numReadsDivHits+=right.numReadsDivHits;
+		numFragments+=right.numFragments;
+		numFragmentsDivHits+=right.numFragmentsDivHits;
+		return *this;
+	}
+	
+	inline double forMode(int expressionMode) const{
+		switch(expressionMode){
+			case EXPRESSIONMODE_RPKM:
+				return numReads;
+			case EXPRESSIONMODE_RPKM_DIVHITS:
+				return numReadsDivHits;
+			case EXPRESSIONMODE_FPKM:
+				return numFragments;
+			case EXPRESSIONMODE_FPKM_DIVHITS:
+				return numFragmentsDivHits;
+			default:
+				return 0.0;
+		}
+	}
+	
+	inline void setForMode(int expressionMode,double total){
+		switch(expressionMode){
+			case EXPRESSIONMODE_RPKM:
+				numReads=total;
+				break;
+			case EXPRESSIONMODE_RPKM_DIVHITS:
+				numReadsDivHits=total;
+				break;
+			case EXPRESSIONMODE_FPKM:
+				numFragments=total;
+				break;
+			case EXPRESSIONMODE_FPKM_DIVHITS:
+				numFragmentsDivHits=total;
+				break;
+			default:
+				break;
+		}
+	}
 };
 
 
@@ -123,295 +522,3046 @@ public:
  
  */
 
-void printUsage(string programName){
+void printUsage(string programName){
+	
+	cerr<<"Usage: "<<programName<<" [options]"<<endl;
+	cerr<<"preprocessor options:"<<endl;
+	outArgsHelp("--@import-args filename","load arguments from tab delimited file");
+	cerr<<"options:"<<endl;
+	outArgsHelp("--bamfile bamfile","specify the bam file. Repeat this option for multiple bam files");
+	outArgsHelp("--bedfile befile","specify the bed file for the gene. Can repeat this option for multiple gene annotations");
+	outArgsHelp("--total-num-reads numReads","Specify total number of mapped reads. Instead of counting from the bam file");
+	outArgsHelp("--totals-cache","read the total number of reads from the sidecar file bamfile.totals. If it is missing or out of date, count all four totals in one pass and write it for later runs");
+	outArgsHelp("--scan-total-reads","with --rpkm, count total number of mapped reads by scanning the bam file even if the bam index records it");
+	outArgsHelp("--build-block-index file","derive the blocks of all genes in the bed files with the given threshold settings, write them to a binary block index file and exit. No bam file is needed");
+	outArgsHelp("--block-index file","load genes and blocks from a file written by --build-block-index instead of --bedfile. Its threshold settings are used");
+	outArgsHelp("--constitutive-threshold-frac fraction","Specify the min fraction [0.0,1.0] of transcripts covering a region to be used in counting. Default: 1.-");
+	outArgsHelp("--constitutive-threshold-num num","Specify the min number of transcripts covering a region to be used in counting. Default: 1");
+	outArgsHelp("--flexmax-thresholding bp","use a flexible max threshold such that all genes can be counted with at least bp number of basepairs");
+	outArgsHelp("--force-flexmax-bp-policy","enforce flexmax bp policy, if going down to 1 blockFreq and no bp width of region available, then fail the gene expression detection for that gene");
+	outArgsHelp("--fpkm-divhits","[default] count reads and expression as FPKM after normalizing read numbers to number of hits (using NH flag) for each read");
+	outArgsHelp("--fpkm","count reads and expression as FPKM");
+	outArgsHelp("--rpkm-divhits","count reads and expression as RPKM after normalizing read numbers to the number of hits (using NH flag) for each read");
+	outArgsHelp("--rpkm","count reads and expression as RPKM");
+	outArgsHelp("--max-hits hits","discard reads with more than a certain number of hits");
+	outArgsHelp("--em","with --fpkm-divhits or --rpkm-divhits, allocate multi-mapped reads to the genes they overlap by expectation-maximization in proportion to gene abundance instead of dividing them evenly by NH. Counts by sweeping (implies --sweep); not available with --matrix, --serve, --region or --genes-file");
+	outArgsHelp("--em-tolerance t","stop EM when no gene count changes by more than t times the count (or t reads for genes below one). Default: 1e-4");
+	outArgsHelp("--em-max-iterations N","stop EM after N iterations even if it has not converged. Default: 1000");
+	outArgsHelp("--write-classes file","also write the counts as a binary equivalence class file: unique reads per gene, and multi-mapped reads as classes of (NH, genes hit) with their number of reads, plus the totals. Counts by sweeping (implies --sweep); not available with --matrix, --serve, --region or --genes-file");
+	outArgsHelp("--max-mem size","with --em or --write-classes, bound the memory used to keep the hits of multi-mapped reads (e.g., 8G, 512M). Beyond it they are spilled to disk and collapsed into equivalence classes one bucket of reads at a time. Default: 1G");
+	outArgsHelp("--tmp-dir dir","directory for the --max-mem spill files. Default: $TMPDIR or /tmp");
+	outArgsHelp("--classes file","make the report from an equivalence class file instead of the bam files, e.g., with another --max-hits, --rpkm vs --rpkm-divhits (or --fpkm vs --fpkm-divhits), --em or --total-num-reads. The same bed files and threshold settings (or block index) have to be given; other thresholds need a new count from the bam files");
+	outArgsHelp("--label-prefix str","prefix label of RPKM/FPKM, etc by str");
+	outArgsHelp("--fill-NA-with str","fill NA data with str");
+	cerr<<"\tNote that both thresholds are applied unless --flexmax-thresholding is specified"<<endl;
+	outArgsHelp("--region-bed-out bedfile","output a regions used to calculate to a bedfile");
+	outArgsHelp("--region-bed-itemRgb rgb","set the itemRgb output for the bed out");
+	outArgsHelp("--no-block-bed-out bedfile","output a bed file consisting of genes with no available blocks for gene expression estimation according to the current settings");
+	outArgsHelp("--sweep","count by streaming each coordinate-sorted bam file once against all blocks sorted by position, instead of fetching each block from the bam index. Unless --total-num-reads is given, the total number of reads is counted in the same pass");
+	outArgsHelp("--threads N","count on N threads, one chromosome at a time. Each thread opens its own handles of the bam files. Default: 1");
+	outArgsHelp("--matrix","output one ReadCounts and one RPKM/FPKM column per bam file, each normalized by the total number of reads of its own bam, instead of summing all bam files. With --threads N, N bam files are counted at a time. --total-num-reads, if given, is repeated once per bam file in the same order");
+	outArgsHelp("--region chr:start-end","only derive, count and report genes overlapping the region (1-based, inclusive; chr alone for a whole chromosome). Repeat for several regions. Genes are fetched through the bam index; use --totals-cache so that the total number of reads does not need a full pass either");
+	outArgsHelp("--genes-file file","only derive, count and report the genes named in file (first word of each line), or - for stdin. Combines with --region");
+	outArgsHelp("--serve socket","keep the genes and blocks in memory and answer requests on the unix domain socket instead. A request is one line of tab-separated arguments (--bamfile, --fpkm/--rpkm/--fpkm-divhits/--rpkm-divhits, --max-hits, --total-num-reads, --label-prefix, --fill-NA-with), e.g., printf -- '--bamfile\\tx.bam\\n' | nc -U socket, and is answered with the output table. The request line has to arrive, and each part of the answer be taken, within 30 seconds. The request --shutdown stops the server. A stale socket at the path is replaced; a socket another server listens on, or any other file there, is left alone and the server does not start");
+	outArgsHelp("--serve-cache N","with --serve, keep up to N bam files and their indexes open. Default: 16");
+	outArgsHelp("--stats-json file","write wall and cpu time of each phase and of each bam, index seeks, bgzf blocks decompressed, reads examined, counted and dropped by --max-hits, genes without blocks, the hits of multi-mapped reads kept for --em or --write-classes (with their peak memory and whether they spilled to --tmp-dir) and peak memory to file as JSON. The record counters are only kept by --sweep and the FPKM fetch (null otherwise); with --threads, the times of a bam are summed over the threads");
+	//outArgsHelp("--use-coding-region-only","whether to use only coding region (for genes that have coding regions");
+	
+}
+
+/* gene record
+ 
+ blocks and reporting fields of a gene, derived once up front so that counting
+ can visit the genes in a different order (e.g. sorted sweep) from the report.
+ The blocks themselves are kept in the GeneTable
+ 
+ */
+class GeneRecord{
+public:
+	string name;
+	string chrom;
+	int start0;
+	int end1;
+	char strand;
+	pair<int,float> minUsed;
+	unsigned int firstBlock; //into GeneTable::blockStarts and blockEnds
+	unsigned int numBlocks; //sorted by start, non-overlapping
+	int probedLength; //sum of block lengths
+	double count;
+	bool hasChromInAnyBams;
+	
+	GeneRecord():start0(0),end1(0),strand('.'),firstBlock(0),numBlocks(0),probedLength(0),count(0.0),hasChromInAnyBams(false){}
+	
+	inline int blocksLength() const{
+		return probedLength;
+	}
+};
+
+/* gene table
+ 
+ gene records, and the blocks of all genes in one struct-of-arrays buffer of starts
+ and ends, gene after gene, so that passes over the blocks walk contiguous memory
+ 
+ */
+class GeneTable{
+public:
+	typedef vector<GeneRecord>::iterator iterator;
+	typedef vector<GeneRecord>::const_iterator const_iterator;
+	
+	vector<GeneRecord> records;
+	vector<Coord> blockStarts;
+	vector<Coord> blockEnds;
+	
+	inline iterator begin(){
+		return records.begin();
+	}
+	
+	inline iterator end(){
+		return records.end();
+	}
+	
+	inline const_iterator begin() const{
+		return records.begin();
+	}
+	
+	inline const_iterator end() const{
+		return records.end();
+	}
+	
+	inline unsigned int size() const{
+		return records.size();
+	}
+	
+	inline GeneRecord& operator [] (unsigned int i){
+		return records[i];
+	}
+	
+	inline const GeneRecord& operator [] (unsigned int i) const{
+		return records[i];
+	}
+	
+	void reserve(unsigned int numGenes,unsigned int numBlocks){
+		records.reserve(numGenes);
+		blockStarts.reserve(numBlocks);
+		blockEnds.reserve(numBlocks);
+	}
+	
+	//append a gene. Its blocks follow with addBlock before the next gene is added
+	inline GeneRecord& addGene(){
+		records.push_back(GeneRecord());
+		records.back().firstBlock=blockStarts.size();
+		return records.back();
+	}
+	
+	inline void addBlock(GeneRecord& gene,Coord start0,Coord end1){
+		blockStarts.push_back(start0);
+		blockEnds.push_back(end1);
+		gene.numBlocks++;
+		gene.probedLength+=end1-start0;
+	}
+	
+	//blocks of a gene: starts(gene)[0..gene.numBlocks)
+	inline const Coord* starts(const GeneRecord& gene) const{
+		return blockStarts.empty()?NULL:&blockStarts[gene.firstBlock];
+	}
+	
+	inline const Coord* ends(const GeneRecord& gene) const{
+		return blockEnds.empty()?NULL:&blockEnds[gene.firstBlock];
+	}
+};
+
+//derive blocks for every gene in every annotation (in name order)
+void deriveGeneBlocks(OptionStruct& opts,GeneTable& genes){
+	
+	//one set reused for every gene, flattened into the table
+	set<SortPair<Coord,Coord> > blocks;
+	
+	for(vector<Annotation*>::iterator annoI=opts.annotations.begin();annoI!=opts.annotations.end();annoI++){
+		Annotation* pannot=*annoI;
+		for(Annotation::NameGeneMapI nameGeneI=pannot->name_genes_begin();nameGeneI!=pannot->name_genes_end();nameGeneI++){
+			//cerr<<"processing gene "<<nameGeneI->first<<endl;
+			SmartPtr<Gene> gene=nameGeneI->second;
+			
+			if(opts.selection.active() && !opts.selection.selects(gene->name(),gene->chrom(),gene->start0(),gene->end1())){
+				continue;
+			}
+			
+			blocks.clear();
+			pair<int,float> minUsed;
+			
+			if(opts.flexmaxThresholding){
+				minUsed=gene->getFlexMaxConstitutiveBlocks(blocks,opts.flexmaxThreshold,opts.forceFlexMaxBasepairPolicy);
+			}else{
+				minUsed=gene->getConstitutiveBlocks(blocks,opts.constitutiveThresholdFrac,opts.constitutiveThresholdNum);
+			}
+			
+			GeneRecord& record=genes.addGene();
+			record.name=gene->name();
+			record.chrom=gene->chrom();
+			record.start0=gene->start0();
+			record.end1=gene->end1();
+			record.strand=gene->strand;
+			record.minUsed=minUsed;
+			for(set<SortPair<Coord,Coord> >::iterator i=blocks.begin();i!=blocks.end();i++){
+				genes.addBlock(record,i->k1,i->k2);
+			}
+		}
+	}
+}
+
+//write the region bed and no-block bed side files, if requested
+void writeGeneSideFiles(OptionStruct& opts,const GeneTable& genes){
+	if(!opts.regionBedOutStream && !opts.noBlockBedOutStream){
+		return;
+	}
+	
+	for(GeneTable::const_iterator gi=genes.begin();gi!=genes.end();gi++){
+		const GeneRecord& gene=*gi;
+		const Coord* starts=genes.starts(gene);
+		const Coord* ends=genes.ends(gene);
+		
+		if(gene.numBlocks>0){
+			if(opts.regionBedOutStream){
+				/* region bed out
+				 
+				 1) chrom
+				 2) chromStart (0-based)
+				 3) chromEnd (1-based)
+				 4) geneName
+				 5) score = 0
+				 6) strand
+				 7) thickStart=chromStart
+				 8) thickEnd=chromEnd
+				 9) itemRgb=0,0,0
+				 10) blockCount
+				 11) blockSizes
+				 12) blockStarts
+				 
+				 
+				 */
+				OutputBuffer& regionOut=*opts.regionBedOutStream;
+				int regionChromStart0=starts[0];
+				int regionChromEnd1=ends[gene.numBlocks-1];
+				regionOut.put(gene.chrom).tab();
+				regionOut.putInt(regionChromStart0).tab();
+				regionOut.putInt(regionChromEnd1).tab();
+				regionOut.put(gene.name).tab();
+				regionOut.put('0').tab();
+				regionOut.put(gene.strand).tab();
+				regionOut.putInt(regionChromStart0).tab();
+				regionOut.putInt(regionChromEnd1).tab();
+				regionOut.put(opts.itemRgb).tab();
+				regionOut.putUInt(gene.numBlocks).tab();
+			
+				//blockSizes then blockStarts, comma separated
+				for(unsigned int i=0;i<gene.numBlocks;i++){
+					if(i>0){
+						regionOut.put(',');
+					}
+					regionOut.putInt(ends[i]-starts[i]);
+				}
+				regionOut.tab();
+				for(unsigned int i=0;i<gene.numBlocks;i++){
+					if(i>0){
+						regionOut.put(',');
+					}
+					regionOut.putInt(starts[i]-regionChromStart0);
+				}
+				regionOut.endLine();
+				
+				
+			}
+		}else{
+			if(opts.noBlockBedOutStream){
+				OutputBuffer& noBlockOut=*opts.noBlockBedOutStream;
+				noBlockOut.put(gene.chrom).tab();
+				noBlockOut.putInt(gene.start0).tab();
+				noBlockOut.putInt(gene.end1).tab();
+				noBlockOut.put(gene.name).tab();
+				noBlockOut.put('0').tab();
+				noBlockOut.put(gene.strand).endLine();
+			}
+		}
+	}
+}
+
+/* block index
+ 
+ gene records and their blocks derived with one threshold setting, stored so that later
+ runs can map them instead of reading the bed files and deriving the blocks again. The
+ gene table is still built from the mapping, one record per gene.
+ 
+ layout (host byte order, every section 8-byte aligned):
+ BlockIndexHeader
+ BlockIndexGene[numGenes] (report order)
+ BlockIndexBlock[numBlocks] (blocks of each gene consecutive, sorted by start)
+ char strings[stringBytes] (names and chromosomes, not NUL-terminated)
+ 
+ */
+
+#define BLOCK_INDEX_MAGIC "GRPKMBIX"
+#define BLOCK_INDEX_VERSION 1
+
+class BlockIndexHeader{
+public:
+	char magic[8];
+	uint32_t version;
+	uint32_t numGenes;
+	uint64_t numBlocks;
+	uint64_t stringBytes;
+	
+	//threshold settings the blocks were derived with
+	double constitutiveThresholdFrac;
+	int32_t constitutiveThresholdNum;
+	int32_t flexmaxThresholding;
+	int32_t flexmaxThreshold;
+	int32_t forceFlexMaxBasepairPolicy;
+};
+
+class BlockIndexGene{
+public:
+	uint64_t firstBlock;
+	uint32_t numBlocks;
+	uint32_t nameOffset;
+	uint32_t nameLength;
+	uint32_t chromOffset;
+	uint32_t chromLength;
+	int32_t start0;
+	int32_t end1;
+	int32_t minUsedNum;
+	float minUsedFrac;
+	char strand;
+	char padding[3];
+};
+
+class BlockIndexBlock{
+public:
+	int32_t start0;
+	int32_t end1;
+};
+
+inline void setBlockIndexSettings(BlockIndexHeader& header,const OptionStruct& opts){
+	header.constitutiveThresholdFrac=opts.constitutiveThresholdFrac;
+	header.constitutiveThresholdNum=opts.constitutiveThresholdNum;
+	header.flexmaxThresholding=opts.flexmaxThresholding;
+	header.flexmaxThreshold=opts.flexmaxThreshold;
+	header.forceFlexMaxBasepairPolicy=opts.forceFlexMaxBasepairPolicy;
+}
+
+//return false on failure
+bool saveBlockIndex(const OptionStruct& opts,const GeneTable& genes,const string& filename){
+	BlockIndexHeader header;
+	memset(&header,0,sizeof(BlockIndexHeader));
+	memcpy(header.magic,BLOCK_INDEX_MAGIC,8);
+	header.version=BLOCK_INDEX_VERSION;
+	header.numGenes=genes.size();
+	setBlockIndexSettings(header,opts);
+	
+	vector<BlockIndexGene> geneEntries(genes.size());
+	string strings;
+	map<string,uint32_t> chromOffsets; //chromosome names are stored once
+	
+	for(unsigned int g=0;g<genes.size();g++){
+		const GeneRecord& gene=genes[g];
+		BlockIndexGene& entry=geneEntries[g];
+		memset(&entry,0,sizeof(BlockIndexGene));
+		
+		entry.firstBlock=gene.firstBlock;
+		entry.numBlocks=gene.numBlocks;
+		header.numBlocks+=gene.numBlocks;
+		
+		entry.nameOffset=strings.length();
+		entry.nameLength=gene.name.length();
+		strings+=gene.name;
+		
+		map<string,uint32_t>::iterator chromI=chromOffsets.find(gene.chrom);
+		if(chromI==chromOffsets.end()){
+			chromI=chromOffsets.insert(map<string,uint32_t>::value_type(gene.chrom,strings.length())).first;
+			strings+=gene.chrom;
+		}
+		entry.chromOffset=chromI->second;
+		entry.chromLength=gene.chrom.length();
+		
+		entry.start0=gene.start0;
+		entry.end1=gene.end1;
+		entry.minUsedNum=gene.minUsed.first;
+		entry.minUsedFrac=gene.minUsed.second;
+		entry.strand=gene.strand;
+	}
+	
+	header.stringBytes=strings.length();
+	
+	OutputBuffer out;
+	if(!out.open(filename)){
+		cerr<<"cannot open block index "<<filename<<" for writing"<<endl;
+		return false;
+	}
+	
+	out.put((const char*)&header,sizeof(BlockIndexHeader));
+	if(!geneEntries.empty()){
+		out.put((const char*)&geneEntries[0],geneEntries.size()*sizeof(BlockIndexGene));
+	}
+	
+	for(unsigned int i=0;i<genes.blockStarts.size();i++){
+		BlockIndexBlock block;
+		block.start0=genes.blockStarts[i];
+		block.end1=genes.blockEnds[i];
+		out.put((const char*)&block,sizeof(BlockIndexBlock));
+	}
+	
+	out.put(strings);
+	
+	if(out.close()!=0){
+		cerr<<"error writing block index "<<filename<<endl;
+		unlink(filename.c_str());
+		return false;
+	}
+	
+	cerr<<"block index "<<filename<<" written: "<<header.numGenes<<" genes, "<<header.numBlocks<<" blocks"<<endl;
+	return true;
+}
+
+/*
+ map a block index and copy it into gene records. The threshold settings are taken from the index;
+ if thresholds were also given on the command line, they have to agree with it.
+ Return false on failure
+ */
+bool loadBlockIndex(OptionStruct& opts,GeneTable& genes){
+	const string& filename=opts.blockIndexFile;
+	
+	int fd=open(filename.c_str(),O_RDONLY);
+	if(fd<0){
+		cerr<<"cannot open block index "<<filename<<endl;
+		return false;
+	}
+	
+	struct stat st;
+	if(fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(BlockIndexHeader)){
+		cerr<<filename<<" is not a block index"<<endl;
+		close(fd);
+		return false;
+	}
+	
+	size_t fileSize=st.st_size;
+	void* mapped=mmap(NULL,fileSize,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(mapped==MAP_FAILED){
+		cerr<<"cannot map block index "<<filename<<endl;
+		return false;
+	}
+	
+	const char* base=(const char*)mapped;
+	const BlockIndexHeader& header=*(const BlockIndexHeader*)base;
+	
+	size_t geneOffset=sizeof(BlockIndexHeader);
+	size_t blockOffset=geneOffset+size_t(header.numGenes)*sizeof(BlockIndexGene);
+	
+	//sizes from a corrupt header must not wrap the offsets around
+	bool sizesFit=(header.numBlocks<=fileSize/sizeof(BlockIndexBlock) && header.stringBytes<=fileSize && blockOffset<=fileSize);
+	size_t stringOffset=sizesFit?blockOffset+header.numBlocks*sizeof(BlockIndexBlock):0;
+	
+	if(memcmp(header.magic,BLOCK_INDEX_MAGIC,8)!=0 || header.version!=BLOCK_INDEX_VERSION || !sizesFit || stringOffset+header.stringBytes!=fileSize){
+		cerr<<filename<<" is not a block index of this version or is truncated"<<endl;
+		munmap(mapped,fileSize);
+		return false;
+	}
+	
+	if(opts.thresholdsGiven){
+		BlockIndexHeader requested;
+		setBlockIndexSettings(requested,opts);
+		if(requested.constitutiveThresholdFrac!=header.constitutiveThresholdFrac || requested.constitutiveThresholdNum!=header.constitutiveThresholdNum || requested.flexmaxThresholding!=header.flexmaxThresholding || requested.flexmaxThreshold!=header.flexmaxThreshold || requested.forceFlexMaxBasepairPolicy!=header.forceFlexMaxBasepairPolicy){
+			cerr<<"block index "<<filename<<" was built with different threshold settings. Rebuild it with --build-block-index"<<endl;
+			munmap(mapped,fileSize);
+			return false;
+		}
+	}
+	
+	opts.constitutiveThresholdFrac=header.constitutiveThresholdFrac;
+	opts.constitutiveThresholdNum=header.constitutiveThresholdNum;
+	opts.flexmaxThresholding=header.flexmaxThresholding;
+	opts.flexmaxThreshold=header.flexmaxThreshold;
+	opts.forceFlexMaxBasepairPolicy=header.forceFlexMaxBasepairPolicy;
+	
+	const BlockIndexGene* geneEntries=(const BlockIndexGene*)(base+geneOffset);
+	const BlockIndexBlock* blocks=(const BlockIndexBlock*)(base+blockOffset);
+	const char* strings=base+stringOffset;
+	
+	bool selecting=opts.selection.active();
+	if(!selecting){
+		genes.reserve(header.numGenes,header.numBlocks);
+	}
+	
+	for(unsigned int g=0;g<header.numGenes;g++){
+		const BlockIndexGene& entry=geneEntries[g];
+		if(entry.firstBlock>header.numBlocks || entry.numBlocks>header.numBlocks-entry.firstBlock || size_t(entry.nameOffset)+entry.nameLength>header.stringBytes || size_t(entry.chromOffset)+entry.chromLength>header.stringBytes){
+			cerr<<"block index "<<filename<<" is corrupted"<<endl;
+			munmap(mapped,fileSize);
+			genes=GeneTable();
+			return false;
+		}
+		
+		string name(strings+entry.nameOffset,entry.nameLength);
+		string chrom(strings+entry.chromOffset,entry.chromLength);
+		if(selecting && !opts.selection.selects(name,chrom,entry.start0,entry.end1)){
+			continue;
+		}
+		
+		GeneRecord& gene=genes.addGene();
+		gene.name=name;
+		gene.chrom=chrom;
+		gene.start0=entry.start0;
+		gene.end1=entry.end1;
+		gene.strand=entry.strand;
+		gene.minUsed=pair<int,float>(entry.minUsedNum,entry.minUsedFrac);
+		
+		for(uint32_t i=0;i<entry.numBlocks;i++){
+			const BlockIndexBlock& block=blocks[entry.firstBlock+i];
+			genes.addBlock(gene,block.start0,block.end1);
+		}
+	}
+	
+	munmap(mapped,fileSize);
+	
+	cerr<<"block index "<<filename<<" loaded: "<<genes.size()<<" of "<<header.numGenes<<" genes, "<<genes.blockStarts.size()<<" of "<<header.numBlocks<<" blocks"<<endl;
+	return true;
+}
+
+//genes and blocks from the block index or the bed files, restricted to the selection if any, then the bed side files
+bool loadGenes(OptionStruct& opts,GeneTable& genes){
+	if(opts.stats){
+		opts.stats->beginPhase(opts.blockIndexFile!=""?"load block index":"derive blocks");
+	}
+	
+	if(opts.blockIndexFile!=""){
+		if(!loadBlockIndex(opts,genes)){
+			return false;
+		}
+	}else{
+		deriveGeneBlocks(opts,genes);
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+		opts.stats->numGenes=genes.size();
+		for(GeneTable::iterator gi=genes.begin();gi!=genes.end();gi++){
+			if(gi->numBlocks==0){
+				opts.stats->numGenesWithoutBlocks++;
+			}
+		}
+	}
+	
+	if(opts.selection.active()){
+		set<string> found;
+		for(GeneTable::iterator gi=genes.begin();gi!=genes.end();gi++){
+			found.insert(gi->name);
+		}
+		
+		for(set<string>::iterator i=opts.selection.names.begin();i!=opts.selection.names.end();i++){
+			if(found.find(*i)==found.end()){
+				cerr<<"warning: gene "<<(*i)<<" not found in the annotation"<<endl;
+			}
+		}
+		
+		cerr<<genes.size()<<" genes selected"<<endl;
+	}
+	
+	writeGeneSideFiles(opts,genes);
+	return true;
+}
+
+//reference intervals [start0,end1) covered by the alignment, split at N (intron) operations
+void getReadReferenceSegments(const bam1_t* bamInfo,vector<pair<int,int> >& segments){
+	segments.clear();
+	
+	const uint32_t* cigar=bam1_cigar(bamInfo);
+	int refPos=bamInfo->core.pos;
+	int segStart0=refPos;
+	
+	for(unsigned int i=0;i<bamInfo->core.n_cigar;i++){
+		int op=cigar[i]&BAM_CIGAR_MASK;
+		int len=cigar[i]>>BAM_CIGAR_SHIFT;
+		switch(op){
+			case BAM_CMATCH:case BAM_CEQUAL:case BAM_CDIFF:case BAM_CDEL:
+				refPos+=len;
+				break;
+			case BAM_CREF_SKIP:
+				if(refPos>segStart0){
+					segments.push_back(pair<int,int>(segStart0,refPos));
+				}
+				refPos+=len;
+				segStart0=refPos;
+				break;
+			default:
+				break;
+		}
+	}
+	
+	if(refPos>segStart0){
+		segments.push_back(pair<int,int>(segStart0,refPos));
+	}
+}
+
+inline bool segmentsOverlap(const vector<pair<int,int> >& segments,int start0,int end1){
+	for(vector<pair<int,int> >::const_iterator i=segments.begin();i!=segments.end();i++){
+		if(i->first<end1 && i->second>start0){
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+/* indexed bam
+ 
+ a bam and its index open through samtools, for queries the BamReader fetch does not offer
+ 
+ */
+class IndexedBam{
+public:
+	samfile_t* bf;
+	bam_index_t* idx;
+	
+	IndexedBam():bf(NULL),idx(NULL){}
+	
+	~IndexedBam(){
+		close();
+	}
+	
+	//return false if the bam or its index cannot be open
+	bool open(const string& bamfilename){
+		close();
+		bf=samopen(bamfilename.c_str(),"rb",0);
+		idx=bf?bam_index_load(bamfilename.c_str()):NULL;
+		if(!idx){
+			close();
+			return false;
+		}
+		return true;
+	}
+	
+	void close(){
+		if(idx){
+			bam_index_destroy(idx);
+			idx=NULL;
+		}
+		
+		if(bf){
+			samclose(bf);
+			bf=NULL;
+		}
+	}
+};
+
+void closeIndexedBams(vector<IndexedBam*>& indexedBams){
+	for(vector<IndexedBam*>::iterator i=indexedBams.begin();i!=indexedBams.end();i++){
+		delete *i;
+	}
+	indexedBams.clear();
+}
+
+//open all bams or none
+bool openIndexedBams(const vector<string>& bamfilenames,vector<IndexedBam*>& indexedBams){
+	for(vector<string>::const_iterator i=bamfilenames.begin();i!=bamfilenames.end();i++){
+		IndexedBam* indexedBam=new IndexedBam;
+		if(!indexedBam->open(*i)){
+			cerr<<"bam file "<<(*i)<<" or its index cannot be open"<<endl;
+			delete indexedBam;
+			closeIndexedBams(indexedBams);
+			return false;
+		}
+		indexedBams.push_back(indexedBam);
+	}
+	
+	return true;
+}
+
+/* fragment span counter
+ 
+ counts the fragments of a gene in the FPKM modes with a single index query over the span
+ of its blocks. Each alignment is read once and its reference segments are tested against
+ the flat block arrays of the gene; a fragment overlapping any block is counted once, its
+ mates recognized by the fingerprint of the read name
+ 
+ */
+#define FRAGMENT_TABLE_CAPACITY 1024 //slots of the fragment table, which one very large gene must not leave behind
+
+class FragmentSpanCounter{
+public:
+	bam1_t* bamInfo;
+	vector<pair<int,int> > segments;
+	FingerprintHashMap<char> fragments; //counted for the current gene
+	
+	FragmentSpanCounter():bamInfo(bam_init1()),fragments(false,FRAGMENT_TABLE_CAPACITY){}
+	
+	~FragmentSpanCounter(){
+		bam_destroy1(bamInfo);
+	}
+	
+	//number of fragments overlapping the blocks of gene, each divided by its number of hits with --fpkm-divhits
+	double count(OptionStruct& opts,IndexedBam& bam,const GeneTable& genes,const GeneRecord& gene,CountingStats* stats){
+		int tid=bam_get_tid(bam.bf->header,gene.chrom.c_str());
+		if(tid<0 || gene.numBlocks==0){
+			return 0.0;
+		}
+		
+		const Coord* starts=genes.starts(gene);
+		const Coord* ends=genes.ends(gene);
+		
+		int spanStart0=starts[0];
+		int spanEnd1=ends[0];
+		for(unsigned int i=1;i<gene.numBlocks;i++){
+			spanStart0=min<int>(spanStart0,starts[i]);
+			spanEnd1=max<int>(spanEnd1,ends[i]);
+		}
+		
+		bool divHits=(opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS);
+		double count=0.0;
+		int64_t lastBlock=-1;
+		fragments.clear(FRAGMENT_TABLE_CAPACITY);
+		
+		bam_iter_t iter=bam_iter_query(bam.idx,tid,spanStart0,spanEnd1);
+		if(stats){
+			stats->indexSeeks++;
+			stats->recordsSeen=true;
+		}
+		
+		while(bam_iter_read(bam.bf->x.bam,iter,bamInfo)>=0){
+			if(stats){
+				stats->addRecord(bam.bf->x.bam,lastBlock);
+			}
+			
+			if(bamInfo->core.flag&BAM_FUNMAP){
+				continue;
+			}
+			
+			getReadReferenceSegments(bamInfo,segments);
+			
+			bool overlaps=false;
+			for(unsigned int i=0;i<gene.numBlocks && !overlaps;i++){
+				overlaps=segmentsOverlap(segments,starts[i],ends[i]);
+			}
+			
+			if(!overlaps){
+				continue;
+			}
+			
+			int numHits=BamReader::getNumHits(bamInfo,1);
+			
+			if(opts.maxHits>0 && numHits>opts.maxHits){
+				if(stats){
+					stats->readsDroppedByMaxHits++;
+				}
+				continue;
+			}
+			
+			bool inserted;
+			fragments.findOrInsert(fingerprintReadName(bam1_qname(bamInfo),bamInfo->core.l_qname-1),inserted);
+			if(inserted){
+				count+=divHits?(1.0/numHits):1.0;
+				if(stats){
+					stats->readsCounted++;
+				}
+			}
+		}
+		bam_iter_destroy(iter);
+		
+		return count;
+	}
+};
+
+//count one gene by fetching each of its blocks from the bam index, or in the FPKM modes its
+//whole span at once from indexedBams (parallel to bamfiles).
+//stats, if not NULL, has one entry in bams for each of bamfiles
+void countGeneByFetching(OptionStruct& opts,vector<BamReader*>& bamfiles,vector<IndexedBam*>& indexedBams,FragmentSpanCounter& fragmentCounter,const GeneTable& genes,GeneRecord& gene,CountingStats* stats){
+	
+	const Coord* starts=genes.starts(gene);
+	const Coord* ends=genes.ends(gene);
+	bool fragmentMode=(opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS);
+	
+	//go to each block, get number of reads or fragments.
+	for(unsigned int b=0;b<bamfiles.size();b++){
+		
+		BamReader* curBam=bamfiles[b];
+		
+		if(!curBam->hasChromInBam(gene.chrom)){
+			continue;
+		}
+		
+		gene.hasChromInAnyBams=true;
+		
+		Stopwatch bamWatch(CPU_TIME_THREAD,stats!=NULL);
+		
+		if(fragmentMode){
+			gene.count+=fragmentCounter.count(opts,*indexedBams[b],genes,gene,stats);
+			
+			if(stats){
+				bamWatch.addTo(stats->bams[b]);
+			}
+			continue;
+		}
+		
+		if(stats){
+			stats->indexSeeks+=gene.numBlocks;
+		}
+		
+		for(unsigned int i=0;i<gene.numBlocks;i++){
+			
+			int blockStart0=starts[i];
+			int blockEnd1=ends[i];
+			
+			switch (opts.expressionMode) {
+				case EXPRESSIONMODE_RPKM:
+					gene.count+=curBam->fetchCountOverlappingRegion(gene.chrom,blockStart0,blockEnd1,true,opts.maxHits);
+					break;
+				case EXPRESSIONMODE_RPKM_DIVHITS:
+					gene.count+=curBam->fetchCountOverlappingRegionDivideByNumHits(gene.chrom,blockStart0,blockEnd1,true,opts.maxHits);
+					break;
+				default:
+					break;
+			}
+		}
+		
+		if(stats){
+			bamWatch.addTo(stats->bams[b]);
+		}
+	}
+}
+
+//return false if the bams cannot be open
+bool countGenesByFetching(OptionStruct& opts,GeneTable& genes){
+	
+	vector<IndexedBam*> indexedBams;
+	if((opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS) && !openIndexedBams(opts.bamfilenames,indexedBams)){
+		return false;
+	}
+	
+	//only this mode fetches through BamReader; the sweep and the threads open their own readers
+	vector<BamReader*> bamfiles;
+	for(vector<string>::iterator i=opts.bamfilenames.begin();i!=opts.bamfilenames.end();i++){
+		bamfiles.push_back(new BamReader(*i));
+	}
+	
+	FragmentSpanCounter fragmentCounter;
+	CountingStats stats(opts.bamfilenames);
+	
+	for(GeneTable::iterator gi=genes.begin();gi!=genes.end();gi++){
+		countGeneByFetching(opts,bamfiles,indexedBams,fragmentCounter,genes,*gi,opts.stats?&stats:NULL);
+	}
+	
+	for(vector<BamReader*>::iterator i=bamfiles.begin();i!=bamfiles.end();i++){
+		(*i)->close();
+		delete *i;
+	}
+	
+	closeIndexedBams(indexedBams);
+	
+	if(opts.stats){
+		opts.stats->merge(stats);
+	}
+	
+	return true;
+}
+
+/* sweep block
+ 
+ a block of a gene placed on the sorted per-chromosome list used by the sweep
+ 
+ */
+class SweepBlock{
+public:
+	int start0;
+	int end1;
+	int geneIdx;
+	bool lastOfGene;
+	double count; //per bam, rolled up into the gene after each bam
+	
+	SweepBlock(int _start0,int _end1,int _geneIdx,bool _lastOfGene):start0(_start0),end1(_end1),geneIdx(_geneIdx),lastOfGene(_lastOfGene),count(0.0){}
+	
+	inline bool operator < (const SweepBlock& right) const{
+		if(start0!=right.start0){
+			return start0<right.start0;
+		}
+		
+		if(end1!=right.end1){
+			return end1<right.end1;
+		}
+		
+		return geneIdx<right.geneIdx;
+	}
+};
+
+typedef map<string,vector<SweepBlock> > ChromSweepBlocks;
+
+void buildSweepBlocks(GeneTable& genes,ChromSweepBlocks& chromBlocks){
+	for(unsigned int g=0;g<genes.size();g++){
+		const GeneRecord& gene=genes[g];
+		if(gene.numBlocks==0){
+			continue;
+		}
+		
+		const Coord* starts=genes.starts(gene);
+		const Coord* ends=genes.ends(gene);
+		vector<SweepBlock>& sweepBlocks=chromBlocks[gene.chrom];
+		for(unsigned int b=0;b<gene.numBlocks;b++){
+			sweepBlocks.push_back(SweepBlock(starts[b],ends[b],g,b+1==gene.numBlocks));
+		}
+	}
+	
+	for(ChromSweepBlocks::iterator i=chromBlocks.begin();i!=chromBlocks.end();i++){
+		sort(i->second.begin(),i->second.end());
+	}
+}
+
+/* chrom sweeper
+ 
+ assigns the reads of one chromosome, in coordinate order, to the sorted blocks of that
+ chromosome through an active set of blocks that can still overlap the current read
+ 
+ */
+class ChromSweeper{
+public:
+	OptionStruct& opts;
+	vector<SweepBlock>& blocks;
+	unsigned int nextBlock;
+	vector<unsigned int> active; //indices into blocks
+	map<int,FingerprintHashMap<char> > geneFragments; //fragments already counted for genes with active blocks
+	vector<pair<int,int> > segments;
+	bool fragmentMode;
+	bool divHits;
+	CountingStats* stats; //NULL if not kept
+	MultiMapperHitBuffer* multiMapperHits; //with --em or --write-classes, where reads with NH>1 go instead of the blocks
+	unsigned int bamIdx;
+	
+	ChromSweeper(OptionStruct& _opts,vector<SweepBlock>& _blocks,CountingStats* _stats,MultiMapperHitBuffer* _multiMapperHits,unsigned int _bamIdx):opts(_opts),blocks(_blocks),nextBlock(0),stats(_stats),multiMapperHits(_multiMapperHits),bamIdx(_bamIdx){
+		fragmentMode=(opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS);
+		divHits=(opts.expressionMode==EXPRESSIONMODE_RPKM_DIVHITS || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS);
+	}
+	
+	//reads must be fed in coordinate order
+	void addRead(const bam1_t* bamInfo){
+		const bam1_core_t& core=bamInfo->core;
+		
+		if(core.flag&BAM_FUNMAP){
+			return;
+		}
+		
+		int readStart0=core.pos;
+		
+		//retire blocks ending before this read. No later read can reach them
+		unsigned int keep=0;
+		for(unsigned int a=0;a<active.size();a++){
+			SweepBlock& block=blocks[active[a]];
+			if(block.end1<=readStart0){
+				if(block.lastOfGene){
+					geneFragments.erase(block.geneIdx);
+				}
+			}else{
+				active[keep++]=active[a];
+			}
+		}
+		active.resize(keep);
+		
+		int readEnd1=bam_calend(&core,bam1_cigar(bamInfo));
+		
+		while(nextBlock<blocks.size() && blocks[nextBlock].start0<readEnd1){
+			SweepBlock& block=blocks[nextBlock];
+			if(block.end1>readStart0){
+				active.push_back(nextBlock);
+			}else if(block.lastOfGene){
+				geneFragments.erase(block.geneIdx);
+			}
+			nextBlock++;
+		}
+		
+		if(active.empty()){
+			return;
+		}
+		
+		int numHits=BamReader::getNumHits(bamInfo,1);
+		
+		bool overMaxHits=(opts.maxHits>0 && numHits>opts.maxHits);
+		if(overMaxHits){
+			if(stats){
+				stats->readsDroppedByMaxHits++;
+			}
+			
+			//the equivalence classes keep every multi-mapped read and leave --max-hits to the count from them, so that --classes can raise it
+			if(!multiMapperHits){
+				return;
+			}
+		}
+		
+		double weight=divHits?(1.0/numHits):1.0;
+		
+		getReadReferenceSegments(bamInfo,segments);
+		
+		bool counted=false;
+		bool toEM=(multiMapperHits && numHits>1);
+		ReadNameFingerprint fp;
+		if(toEM || fragmentMode){
+			fp=fingerprintReadName(bam1_qname(bamInfo),core.l_qname-1);
+		}
+		
+		for(vector<unsigned int>::iterator ai=active.begin();ai!=active.end();ai++){
+			SweepBlock& block=blocks[*ai];
+			
+			if(!segmentsOverlap(segments,block.start0,block.end1)){
+				continue;
+			}
+			
+			if(fragmentMode){
+				//a fragment is counted once per gene no matter how many blocks its mates overlap
+				bool inserted;
+				fragmentsOf(block.geneIdx).findOrInsert(fp,inserted);
+				if(!inserted){
+					continue;
+				}
+			}
+			
+			if(toEM){
+				multiMapperHits->add(MultiMapperHit(fp,block.geneIdx,bamIdx,numHits));
+			}else{
+				block.count+=weight;
+			}
+			counted=true;
+		}
+		
+		if(counted && stats && !overMaxHits){
+			stats->readsCounted++;
+		}
+	}
+	
+	//fragments already counted for the gene, the same table FragmentSpanCounter keeps
+	FingerprintHashMap<char>& fragmentsOf(int geneIdx){
+		map<int,FingerprintHashMap<char> >::iterator i=geneFragments.find(geneIdx);
+		if(i==geneFragments.end()){
+			i=geneFragments.insert(map<int,FingerprintHashMap<char> >::value_type(geneIdx,FingerprintHashMap<char>(false,FRAGMENT_TABLE_CAPACITY))).first;
+		}
+		return i->second;
+	}
+	
+	//add block counts to their genes in block order, as the per-block fetch does, and reset them for the next bam
+	void rollUp(GeneTable& genes){
+		map<int,double> fragmentCounts;
+		
+		for(vector<SweepBlock>::iterator bi=blocks.begin();bi!=blocks.end();bi++){
+			if(fragmentMode){
+				fragmentCounts[bi->geneIdx]+=bi->count;
+			}else{
+				genes[bi->geneIdx].count+=bi->count;
+			}
+			
+			bi->count=0.0;
+		}
+		
+		for(map<int,double>::iterator i=fragmentCounts.begin();i!=fragmentCounts.end();i++){
+			genes[i->first].count+=i->second;
+		}
+		
+		nextBlock=0;
+		active.clear();
+		geneFragments.clear();
+	}
+};
+
+//stream one coordinate-sorted bam once, assigning each read to the active blocks it overlaps.
+//if totals is not NULL, the normalization totals are collected in the same pass.
+//if multiMapperHits is not NULL, reads with NH>1 are recorded there for EM as the bamIdx'th bam.
+//return false if the bam cannot be read or is not sorted
+bool sweepCountBam(OptionStruct& opts,GeneTable& genes,ChromSweepBlocks& chromBlocks,const string& bamfilename,NormalizationTotals* totals,CountingStats* stats,MultiMapperHitBuffer* multiMapperHits,unsigned int bamIdx){
+	
+	samfile_t* bf=samopen(bamfilename.c_str(),"rb",0);
+	
+	if(!bf){
+		cerr<<"bam file "<<bamfilename<<" cannot be open for sweeping"<<endl;
+		return false;
+	}
+	
+	bam_header_t* header=bf->header;
+	
+	vector<vector<SweepBlock>*> tidBlocks(header->n_targets,(vector<SweepBlock>*)NULL);
+	set<string> bamChroms;
+	for(int tid=0;tid<header->n_targets;tid++){
+		bamChroms.insert(header->target_name[tid]);
+		ChromSweepBlocks::iterator i=chromBlocks.find(header->target_name[tid]);
+		if(i!=chromBlocks.end()){
+			tidBlocks[tid]=&i->second;
+		}
+	}
+	
+	for(GeneTable::iterator gi=genes.begin();gi!=genes.end();gi++){
+		if(bamChroms.find(gi->chrom)!=bamChroms.end()){
+			gi->hasChromInAnyBams=true;
+		}
+	}
+	
+	bam1_t *bamInfo=bam_init1();
+	ChromSweeper* sweeper=NULL;
+	
+	int curTid=-1;
+	int curPos=-1;
+	bool sorted=true;
+	int64_t lastBlock=-1;
+	
+	if(stats){
+		stats->recordsSeen=true;
+	}
+	
+	while(samread(bf,bamInfo)>=0){
+		const bam1_core_t& core=bamInfo->core;
+		
+		if(stats){
+			stats->addRecord(bf->x.bam,lastBlock);
+		}
+		
+		if(core.tid<0){
+			//unplaced reads sit at the end of a sorted bam
+			break;
+		}
+		
+		if(totals){
+			totals->addRead(bamInfo);
+		}
+		
+		if(core.tid!=curTid){
+			if(core.tid<curTid){
+				sorted=false;
+				break;
+			}
+			
+			if(sweeper){
+				sweeper->rollUp(genes);
+				delete sweeper;
+				sweeper=NULL;
+			}
+			
+			curTid=core.tid;
+			curPos=-1;
+			
+			if(tidBlocks[curTid]){
+				sweeper=new ChromSweeper(opts,*tidBlocks[curTid],stats,multiMapperHits,bamIdx);
+			}
+		}
+		
+		if(core.pos<curPos){
+			sorted=false;
+			break;
+		}
+		
+		curPos=core.pos;
+		
+		if(sweeper){
+			sweeper->addRead(bamInfo);
+		}
+	}
+	
+	if(sweeper){
+		sweeper->rollUp(genes);
+		delete sweeper;
+	}
+	
+	bam_destroy1(bamInfo);
+	samclose(bf);
+	
+	if(!sorted){
+		cerr<<"bam file "<<bamfilename<<" is not sorted by coordinate. Sweep counting requires a coordinate-sorted bam"<<endl;
+		return false;
+	}
+	
+	return true;
+}
+
+bool countGenesBySweeping(OptionStruct& opts,GeneTable& genes,NormalizationTotals* totals,MultiMapperHitStore* multiMapperHits){
+	
+	ChromSweepBlocks chromBlocks;
+	buildSweepBlocks(genes,chromBlocks);
+	
+	CountingStats stats(opts.bamfilenames);
+	MultiMapperHitBuffer hitBuffer(multiMapperHits);
+	
+	for(unsigned int b=0;b<opts.bamfilenames.size();b++){
+		Stopwatch bamWatch(CPU_TIME_THREAD,opts.stats!=NULL);
+		
+		if(!sweepCountBam(opts,genes,chromBlocks,opts.bamfilenames[b],totals,opts.stats?&stats:NULL,multiMapperHits?&hitBuffer:NULL,b)){
+			return false;
+		}
+		
+		if(opts.stats){
+			bamWatch.addTo(stats.bams[b]);
+		}
+	}
+	
+	if(multiMapperHits){
+		hitBuffer.flush();
+	}
+	
+	if(opts.stats){
+		opts.stats->merge(stats);
+	}
+	
+	return true;
+}
+
+/* chrom shard
+ 
+ the genes of one chromosome, the unit of work handed to a counting thread
+ 
+ */
+class ChromShard{
+public:
+	string chrom;
+	vector<int> geneIdxs;
+};
+
+class CountingWorkQueue{
+public:
+	OptionStruct* opts;
+	GeneTable* genes;
+	vector<ChromShard>* shards;
+	ChromSweepBlocks* chromBlocks; //only for sweep
+	NormalizationTotals* totals; //only for sweep with fused totals
+	MultiMapperHitStore* multiMapperHits; //only for sweep with --em or --write-classes
+	unsigned int nextShard;
+	bool failed;
+	pthread_mutex_t lock;
+	
+	CountingWorkQueue(OptionStruct* _opts,GeneTable* _genes,vector<ChromShard>* _shards,ChromSweepBlocks* _chromBlocks,NormalizationTotals* _totals,MultiMapperHitStore* _multiMapperHits):opts(_opts),genes(_genes),shards(_shards),chromBlocks(_chromBlocks),totals(_totals),multiMapperHits(_multiMapperHits),nextShard(0),failed(false){
+		pthread_mutex_init(&lock,NULL);
+	}
+	
+	~CountingWorkQueue(){
+		pthread_mutex_destroy(&lock);
+	}
+	
+	//return NULL when all shards are taken
+	ChromShard* takeShard(){
+		ChromShard* shard=NULL;
+		pthread_mutex_lock(&lock);
+		if(!failed && nextShard<shards->size()){
+			shard=&(*shards)[nextShard++];
+		}
+		pthread_mutex_unlock(&lock);
+		return shard;
+	}
+	
+	void fail(){
+		pthread_mutex_lock(&lock);
+		failed=true;
+		pthread_mutex_unlock(&lock);
+	}
+	
+	void addTotals(const NormalizationTotals& workerTotals){
+		pthread_mutex_lock(&lock);
+		(*totals)+=workerTotals;
+		pthread_mutex_unlock(&lock);
+	}
+};
+
+//sweep one chromosome of each bam through the index. Each worker has its own bam handles
+void sweepCountShard(OptionStruct& opts,GeneTable& genes,ChromSweepBlocks& chromBlocks,ChromShard& shard,vector<samfile_t*>& bfs,vector<bam_index_t*>& idxs,NormalizationTotals* totals,CountingStats* stats,MultiMapperHitBuffer* multiMapperHits){
+	
+	ChromSweepBlocks::iterator blocksI=chromBlocks.find(shard.chrom);
+	
+	bam1_t *bamInfo=bam_init1();
+	
+	for(unsigned int b=0;b<bfs.size();b++){
+		int tid=bam_get_tid(bfs[b]->header,shard.chrom.c_str());
+		if(tid<0){
+			continue;
+		}
+		
+		for(vector<int>::iterator gi=shard.geneIdxs.begin();gi!=shard.geneIdxs.end();gi++){
+			genes[*gi].hasChromInAnyBams=true;
+		}
+		
+		if(blocksI==chromBlocks.end() && !totals){
+			continue;
+		}
+		
+		Stopwatch bamWatch(CPU_TIME_THREAD,stats!=NULL);
+		int64_t lastBlock=-1;
+		
+		ChromSweeper* sweeper=NULL;
+		if(blocksI!=chromBlocks.end()){
+			sweeper=new ChromSweeper(opts,blocksI->second,stats,multiMapperHits,b);
+		}
+		
+		bam_iter_t iter=bam_iter_query(idxs[b],tid,0,1<<29);
+		if(stats){
+			stats->indexSeeks++;
+			stats->recordsSeen=true;
+		}
+		
+		while(bam_iter_read(bfs[b]->x.bam,iter,bamInfo)>=0){
+			if(stats){
+				stats->addRecord(bfs[b]->x.bam,lastBlock);
+			}
+			
+			if(totals){
+				totals->addRead(bamInfo);
+			}
+			
+			if(sweeper){
+				sweeper->addRead(bamInfo);
+			}
+		}
+		bam_iter_destroy(iter);
+		
+		if(sweeper){
+			sweeper->rollUp(genes);
+			delete sweeper;
+		}
+		
+		if(stats){
+			bamWatch.addTo(stats->bams[b]);
+		}
+	}
+	
+	bam_destroy1(bamInfo);
+}
+
+void* countingWorker(void* data){
+	CountingWorkQueue* queue=(CountingWorkQueue*)data;
+	OptionStruct& opts=*queue->opts;
+	GeneTable& genes=*queue->genes;
+	
+	//own handles for every bam
+	vector<BamReader*> bamfiles;
+	vector<samfile_t*> bfs;
+	vector<bam_index_t*> idxs;
+	vector<IndexedBam*> indexedBams;
+	FragmentSpanCounter fragmentCounter;
+	NormalizationTotals totals;
+	MultiMapperHitBuffer multiMapperHits(queue->multiMapperHits);
+	CountingStats stats(opts.bamfilenames);
+	CountingStats* keptStats=opts.stats?&stats:NULL;
+	
+	for(vector<string>::iterator i=opts.bamfilenames.begin();i!=opts.bamfilenames.end();i++){
+		if(opts.sweep){
+			samfile_t* bf=samopen(i->c_str(),"rb",0);
+			bam_index_t* idx=bf?bam_index_load(i->c_str()):NULL;
+			if(!bf || !idx){
+				cerr<<"bam file "<<(*i)<<" or its index cannot be open for sweeping"<<endl;
+				if(bf){
+					samclose(bf);
+				}
+				queue->fail();
+				break;
+			}
+			bfs.push_back(bf);
+			idxs.push_back(idx);
+		}else{
+			bamfiles.push_back(new BamReader(*i));
+		}
+	}
+	
+	if(!opts.sweep && (opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS) && !openIndexedBams(opts.bamfilenames,indexedBams)){
+		queue->fail();
+	}
+	
+	ChromShard* shard;
+	
+	while((shard=queue->takeShard())!=NULL){
+		if(opts.sweep){
+			sweepCountShard(opts,genes,*queue->chromBlocks,*shard,bfs,idxs,queue->totals?&totals:NULL,keptStats,queue->multiMapperHits?&multiMapperHits:NULL);
+		}else{
+			for(vector<int>::iterator gi=shard->geneIdxs.begin();gi!=shard->geneIdxs.end();gi++){
+				countGeneByFetching(opts,bamfiles,indexedBams,fragmentCounter,genes,genes[*gi],keptStats);
+			}
+		}
+	}
+	
+	if(queue->totals){
+		queue->addTotals(totals);
+	}
+	
+	if(queue->multiMapperHits){
+		multiMapperHits.flush();
+	}
+	
+	if(opts.stats){
+		opts.stats->merge(stats);
+	}
+	
+	for(vector<BamReader*>::iterator i=bamfiles.begin();i!=bamfiles.end();i++){
+		(*i)->close();
+		delete *i;
+	}
+	
+	closeIndexedBams(indexedBams);
+	
+	for(unsigned int b=0;b<bfs.size();b++){
+		bam_index_destroy(idxs[b]);
+		samclose(bfs[b]);
+	}
+	
+	return NULL;
+}
+
+//count on opts.numThreads threads, one chromosome at a time. Each gene is counted by exactly one thread.
+//if totals is not NULL (sweep only), every chromosome of the bams is visited to collect the normalization totals
+bool countGenesThreaded(OptionStruct& opts,GeneTable& genes,NormalizationTotals* totals,MultiMapperHitStore* multiMapperHits){
+	
+	map<string,int> chromShardIdx;
+	vector<ChromShard> shards;
+	
+	for(unsigned int g=0;g<genes.size();g++){
+		map<string,int>::iterator i=chromShardIdx.find(genes[g].chrom);
+		if(i==chromShardIdx.end()){
+			i=chromShardIdx.insert(map<string,int>::value_type(genes[g].chrom,shards.size())).first;
+			shards.push_back(ChromShard());
+			shards.back().chrom=genes[g].chrom;
+		}
+		shards[i->second].geneIdxs.push_back(g);
+	}
+	
+	if(totals){
+		//chromosomes without genes still hold reads for the totals
+		for(vector<string>::iterator bi=opts.bamfilenames.begin();bi!=opts.bamfilenames.end();bi++){
+			samfile_t* bf=samopen(bi->c_str(),"rb",0);
+			if(!bf){
+				cerr<<"bam file "<<(*bi)<<" cannot be open"<<endl;
+				return false;
+			}
+			
+			for(int tid=0;tid<bf->header->n_targets;tid++){
+				string chrom=bf->header->target_name[tid];
+				if(chromShardIdx.find(chrom)==chromShardIdx.end()){
+					chromShardIdx.insert(map<string,int>::value_type(chrom,shards.size()));
+					shards.push_back(ChromShard());
+					shards.back().chrom=chrom;
+				}
+			}
+			
+			samclose(bf);
+		}
+	}
+	
+	ChromSweepBlocks chromBlocks;
+	if(opts.sweep){
+		buildSweepBlocks(genes,chromBlocks);
+	}
+	
+	CountingWorkQueue queue(&opts,&genes,&shards,&chromBlocks,totals,multiMapperHits);
+	
+	vector<pthread_t> threads(opts.numThreads);
+	for(int t=0;t<opts.numThreads;t++){
+		pthread_create(&threads[t],NULL,countingWorker,&queue);
+	}
+	
+	for(int t=0;t<opts.numThreads;t++){
+		pthread_join(threads[t],NULL);
+	}
+	
+	return !queue.failed;
+}
+
+//locate the index of a bam file the way bam_index_load does: x.bam.bai, then x.bai
+string findBamIndexFile(const string& bamfilename){
+	struct stat st;
+	
+	string indexfilename=bamfilename+".bai";
+	if(stat(indexfilename.c_str(),&st)==0){
+		return indexfilename;
+	}
+	
+	if(bamfilename.length()>4 && bamfilename.substr(bamfilename.length()-4)==".bam"){
+		indexfilename=bamfilename.substr(0,bamfilename.length()-4)+".bai";
+		if(stat(indexfilename.c_str(),&st)==0){
+			return indexfilename;
+		}
+	}
+	
+	return "";
+}
+
+/*
+ read the number of mapped reads from the metadata pseudo-bin (37450) that samtools
+ stores for each reference in the .bai. Return false if there is no index, the index
+ is older than the bam, or some reference has no metadata (indexes written by old samtools).
+ The index is little-endian, as is the host.
+ */
+bool countMappedReadsFromIndex(const string& bamfilename,double& numMapped){
+	
+	string indexfilename=findBamIndexFile(bamfilename);
+	if(indexfilename==""){
+		return false;
+	}
+	
+	struct stat bamStat,indexStat;
+	if(stat(bamfilename.c_str(),&bamStat)!=0 || stat(indexfilename.c_str(),&indexStat)!=0 || indexStat.st_mtime<bamStat.st_mtime){
+		return false;
+	}
+	
+	FILE* fin=fopen(indexfilename.c_str(),"rb");
+	if(!fin){
+		return false;
+	}
+	
+	bool success=true;
+	char magic[4];
+	int32_t n_ref=0;
+	uint64_t totalMapped=0;
+	
+	if(fread(magic,1,4,fin)!=4 || strncmp(magic,"BAI\1",4)!=0 || fread(&n_ref,4,1,fin)!=1){
+		success=false;
+	}
+	
+	for(int32_t ref=0;success && ref<n_ref;ref++){
+		int32_t n_bin=0;
+		if(fread(&n_bin,4,1,fin)!=1){
+			success=false;
+			break;
+		}
+		
+		bool hasMeta=false;
+		for(int32_t b=0;b<n_bin;b++){
+			uint32_t bin=0;
+			int32_t n_chunk=0;
+			if(fread(&bin,4,1,fin)!=1 || fread(&n_chunk,4,1,fin)!=1){
+				success=false;
+				break;
+			}
+			
+			if(bin==37450 && n_chunk==2){
+				//ref_beg, ref_end, n_mapped, n_unmapped
+				uint64_t meta[4];
+				if(fread(meta,8,4,fin)!=4){
+					success=false;
+					break;
+				}
+				totalMapped+=meta[2];
+				hasMeta=true;
+			}else if(fseek(fin,16L*n_chunk,SEEK_CUR)!=0){
+				success=false;
+				break;
+			}
+		}
+		
+		if(!success){
+			break;
+		}
+		
+		if(n_bin>0 && !hasMeta){
+			success=false;
+			break;
+		}
+		
+		int32_t n_intv=0;
+		if(fread(&n_intv,4,1,fin)!=1 || fseek(fin,8L*n_intv,SEEK_CUR)!=0){
+			success=false;
+		}
+	}
+	
+	fclose(fin);
+	
+	if(success){
+		numMapped=totalMapped;
+	}
+	
+	return success;
+}
+
+//for plain --rpkm the total number of reads is the number of mapped reads kept in the bam indexes
+bool countTotalNumOfReadsFromIndexes(OptionStruct& opts,double& totalNumOfReadsT){
+	if(opts.expressionMode!=EXPRESSIONMODE_RPKM || opts.scanTotalReads){
+		return false;
+	}
+	
+	totalNumOfReadsT=0.0;
+	for(vector<string>::iterator i=opts.bamfilenames.begin();i!=opts.bamfilenames.end();i++){
+		double numMapped;
+		if(!countMappedReadsFromIndex(*i,numMapped)){
+			cerr<<"no usable index metadata for "<<(*i)<<". Count total number of reads from the bam file instead"<<endl;
+			return false;
+		}
+		totalNumOfReadsT+=numMapped;
+	}
+	
+	return true;
+}
+
+/* totals cache
+ 
+ a sidecar file bamfile.totals holding all four normalization totals of a bam, keyed by
+ the size, modification time and header checksum of the bam:
+ 
+ #geneRPKM normalization totals
+ BamSize<tab>bytes
+ BamMTime<tab>seconds
+ HeaderChecksum<tab>crc32 of header text, reference names and lengths
+ NumReads<tab>total
+ NumReadsDivHits<tab>total
+ NumFragments<tab>total
+ NumFragmentsDivHits<tab>total
+ 
+ */
+class BamFileKey{
+public:
+	long long size;
+	long long mtime;
+	unsigned long headerChecksum;
+	
+	BamFileKey():size(-1),mtime(-1),headerChecksum(0){}
+	
+	inline bool operator == (const BamFileKey& right) const{
+		return size==right.size && mtime==right.mtime && headerChecksum==right.headerChecksum;
+	}
+};
+
+bool getBamFileKey(const string& bamfilename,BamFileKey& key){
+	struct stat st;
+	if(stat(bamfilename.c_str(),&st)!=0){
+		return false;
+	}
+	
+	samfile_t* bf=samopen(bamfilename.c_str(),"rb",0);
+	if(!bf){
+		return false;
+	}
+	
+	bam_header_t* header=bf->header;
+	uLong crc=crc32(0L,Z_NULL,0);
+	if(header->l_text>0){
+		crc=crc32(crc,(const Bytef*)header->text,header->l_text);
+	}
+	for(int tid=0;tid<header->n_targets;tid++){
+		crc=crc32(crc,(const Bytef*)header->target_name[tid],strlen(header->target_name[tid])+1);
+		crc=crc32(crc,(const Bytef*)&header->target_len[tid],sizeof(uint32_t));
+	}
+	
+	samclose(bf);
+	
+	key.size=st.st_size;
+	key.mtime=st.st_mtime;
+	key.headerChecksum=crc;
+	
+	return true;
+}
+
+inline string totalsCacheFileName(const string& bamfilename){
+	return bamfilename+".totals";
+}
+
+bool loadTotalsCache(const string& bamfilename,const BamFileKey& key,NormalizationTotals& totals){
+	ifstream fin(totalsCacheFileName(bamfilename).c_str());
+	if(!fin.good()){
+		return false;
+	}
+	
+	BamFileKey cachedKey;
+	int numTotals=0;
+	string line;
+	
+	while(getline(fin,line)){
+		if(line.length()==0 || line[0]=='#'){
+			continue;
+		}
+		
+		size_t tab=line.find('\t');
+		if(tab==string::npos){
+			return false;
+		}
+		
+		string field=line.substr(0,tab);
+		const char* value=line.c_str()+tab+1;
+		
+		if(field=="BamSize"){
+			cachedKey.size=atoll(value);
+		}else if(field=="BamMTime"){
+			cachedKey.mtime=atoll(value);
+		}else if(field=="HeaderChecksum"){
+			cachedKey.headerChecksum=strtoul(value,NULL,10);
+		}else if(field=="NumReads"){
+			totals.numReads=atof(value);
+			numTotals++;
+		}else if(field=="NumReadsDivHits"){
+			totals.numReadsDivHits=atof(value);
+			numTotals++;
+		}else if(field=="NumFragments"){
+			totals.numFragments=atof(value);
+			numTotals++;
+		}else if(field=="NumFragmentsDivHits"){
+			totals.numFragmentsDivHits=atof(value);
+			numTotals++;
+		}
+	}
+	
+	return numTotals==4 && cachedKey==key;
+}
+
+//written to a temporary file renamed over the cache, so that a concurrent run never reads it half written
+void saveTotalsCache(const string& bamfilename,const BamFileKey& key,const NormalizationTotals& totals){
+	string cachefilename=totalsCacheFileName(bamfilename);
+	
+	char pidSuffix[32];
+	sprintf(pidSuffix,".tmp%d",(int)getpid());
+	string tmpfilename=cachefilename+pidSuffix;
+	
+	ofstream fout(tmpfilename.c_str());
+	if(!fout.good()){
+		cerr<<"cannot write totals cache "<<cachefilename<<". Continue without caching"<<endl;
+		return;
+	}
+	
+	fout.precision(17);
+	fout<<"#geneRPKM normalization totals"<<endl;
+	fout<<"BamSize"<<"\t"<<key.size<<endl;
+	fout<<"BamMTime"<<"\t"<<key.mtime<<endl;
+	fout<<"HeaderChecksum"<<"\t"<<key.headerChecksum<<endl;
+	fout<<"NumReads"<<"\t"<<totals.numReads<<endl;
+	fout<<"NumReadsDivHits"<<"\t"<<totals.numReadsDivHits<<endl;
+	fout<<"NumFragments"<<"\t"<<totals.numFragments<<endl;
+	fout<<"NumFragmentsDivHits"<<"\t"<<totals.numFragmentsDivHits<<endl;
+	fout.close();
+	
+	if(fout.fail() || rename(tmpfilename.c_str(),cachefilename.c_str())!=0){
+		cerr<<"cannot write totals cache "<<cachefilename<<". Continue without caching"<<endl;
+		unlink(tmpfilename.c_str());
+	}
+}
+
+//all four totals of a bam in one pass
+bool countAllTotalsInBam(const string& bamfilename,NormalizationTotals& totals){
+	samfile_t* bf=samopen(bamfilename.c_str(),"rb",0);
+	if(!bf){
+		cerr<<"bam file "<<bamfilename<<" cannot be open for counting"<<endl;
+		return false;
+	}
+	
+	bam1_t *bamInfo=bam_init1();
+	while(samread(bf,bamInfo)>=0){
+		totals.addRead(bamInfo);
+	}
+	bam_destroy1(bamInfo);
+	samclose(bf);
+	
+	return true;
+}
+
+//totals of a bam from its sidecar cache, filling in a missing or stale cache on the way
+bool getTotalsFromCache(const string& bamfilename,NormalizationTotals& totals){
+	BamFileKey key;
+	if(!getBamFileKey(bamfilename,key)){
+		cerr<<"bam file "<<bamfilename<<" cannot be open for counting"<<endl;
+		return false;
+	}
+	
+	if(!loadTotalsCache(bamfilename,key,totals)){
+		cerr<<"counting totals of "<<bamfilename<<" into "<<totalsCacheFileName(bamfilename)<<endl;
+		totals=NormalizationTotals();
+		if(!countAllTotalsInBam(bamfilename,totals)){
+			return false;
+		}
+		saveTotalsCache(bamfilename,key,totals);
+	}
+	
+	return true;
+}
+
+//total of the current mode from the sidecar caches
+bool countTotalNumOfReadsFromCaches(OptionStruct& opts,double& totalNumOfReadsT){
+	if(!opts.useTotalsCache){
+		return false;
+	}
+	
+	totalNumOfReadsT=0.0;
+	for(vector<string>::iterator i=opts.bamfilenames.begin();i!=opts.bamfilenames.end();i++){
+		NormalizationTotals totals;
+		if(!getTotalsFromCache(*i,totals)){
+			return false;
+		}
+		
+		totalNumOfReadsT+=totals.forMode(opts.expressionMode);
+	}
+	
+	return true;
+}
+
+//total of the current mode by scanning the whole bam
+double scanTotalNumOfReadsInBam(const string& bamfilename,int expressionMode){
+	switch(expressionMode){
+		case EXPRESSIONMODE_RPKM:
+			return BamReader::countTotalNumOfReadsInBam(bamfilename);
+		case EXPRESSIONMODE_RPKM_DIVHITS:
+			return BamReader::countTotalNumOfReadsInBamDivHits(bamfilename);
+		case EXPRESSIONMODE_FPKM:
+			return BamReader::countTotalNumOfFragmentsInBam(bamfilename);
+		case EXPRESSIONMODE_FPKM_DIVHITS:
+			return BamReader::countTotalNumOfFragmentsInBamDivHits(bamfilename);
+		default:
+			return 0.0;
+	}
+}
+
+//write the report of the counted genes
+void writeReport(OutputBuffer& out,const OptionStruct& opts,const GeneTable& genes){
+	
+	/*
+	1) GeneName
+	2) Chrom
+	3) Gene Start (1-based)
+	4) Gene End (1-based)
+	5) Strand
+	6) Length of probed region
+	7) Read Counts
+	8) RPKM or RPKM
+	 9) log2(RPKM) or log2(FPKM)
+	 11) MinConsUsedFrac
+	 12) MinConsUsedNum
+	 13) TotalNumberOfReads
+	 */
+	//write header
+	out.put("GeneName").tab();
+	out.put("Chrom").tab();
+	out.put("GeneStart").tab();
+	out.put("GeneEnd").tab();
+	out.put("Strand").tab();
+	out.put("LengthProbed").tab();
+	out.put(opts.prefixDataLabel).put("ReadCounts").tab();
+	switch (opts.expressionMode) {
+		case EXPRESSIONMODE_FPKM:case EXPRESSIONMODE_FPKM_DIVHITS:
+			out.put(opts.prefixDataLabel).put("FPKM").tab();
+			out.put(opts.prefixDataLabel).put("log2(FPKM)").tab();
+			//out.put(opts.prefixDataLabel).put("log2(1+FPKM)").tab();
+			
+			break;
+		case EXPRESSIONMODE_RPKM:case EXPRESSIONMODE_RPKM_DIVHITS:
+			out.put(opts.prefixDataLabel).put("RPKM").tab();
+			out.put(opts.prefixDataLabel).put("log2(RPKM)").tab();
+			//out.put(opts.prefixDataLabel).put("log2(1+RPKM)").tab();
+			break;
+		default:
+			break;
+	}
+	out.put("MinConsUsedFrac").tab();
+	out.put("MinConsUsedNum").tab();
+	out.put("TotalNumberOfReads").endLine();
+	
+	for(GeneTable::const_iterator gi=genes.begin();gi!=genes.end();gi++){
+		const GeneRecord& gene=*gi;
+		
+		//length is only probed when some bam has the chromosome
+		int lengthProbed=gene.hasChromInAnyBams?gene.blocksLength():0;
+		double countD=gene.count;
+		
+		/*
+		1) GeneName
+		2) Chrom
+		3) Gene Start (1-based)
+		4) Gene End (1-based)
+		5) Strand
+		6) Length of probed region
+		7) Read Counts
+		8) RPKM or RPKM
+		9) log2(RPKM) or log2(FPKM)
+		10) MinConsUsedFrac
+		11) MinConsUsedNum
+		12) TotalNumberOfReads			
+		*/
+		
+		out.put(gene.name).tab();
+		out.put(gene.chrom).tab();
+		out.putInt(gene.start0+1).tab();
+		out.putInt(gene.end1).tab();
+		out.put(gene.strand).tab();
+		out.putInt(lengthProbed).tab();
+		if(lengthProbed==0 || !gene.hasChromInAnyBams){
+			out.put(opts.fillNA).tab();
+			out.put(opts.fillNA).tab();
+			out.put(opts.fillNA).tab();
+			//out.put(opts.fillNA).tab();
+		}else{
+			out.putDouble(countD).tab();
+			double RPKM=countD/(float(opts.totalNumOfReads)/1e6)/(float(lengthProbed)/1e3);
+			
+			out.putDouble(RPKM).tab();
+			if(RPKM==0.0){
+				out.put(opts.fillNA).tab();
+			}else {
+				out.putDouble(log(RPKM)/log(2)).tab();
+			}
+
+			
+			//out.putDouble(log(RPKM+1.0)/log(2)).tab();
+		}
+		out.putDouble(gene.minUsed.second).tab();
+		out.putInt(gene.minUsed.first).tab();
+		out.putInt(opts.totalNumOfReads).endLine();
+	}
+}
+
+/* equivalence class file
+ 
+ the counts of one sweep, written with --write-classes so that the report can be made again
+ with --classes under another --max-hits, with or without NH division or EM, or with other
+ totals, without reading the bams. Every multi-mapped read is kept, whatever --max-hits the
+ count had. Genes and blocks are not stored: the same bed files and thresholds, or block index, have to be given again, which
+ is checked against a checksum of the gene table.
+ 
+ layout (host byte order, every section 8-byte aligned):
+ ClassFileHeader
+ ClassFileGene[numGenes] (report order)
+ ClassFileClass[numClasses]
+ ClassFileTarget[numTargets] (targets of each class consecutive, sorted by gene)
+ 
+ */
+
+#define CLASS_FILE_MAGIC "GRPKMECF"
+#define CLASS_FILE_VERSION 1
+
+class ClassFileHeader{
+public:
+	char magic[8];
+	uint32_t version;
+	uint32_t numGenes;
+	uint64_t geneChecksum;
+	uint64_t numClasses;
+	uint64_t numTargets;
+	int32_t fragments; //counted as fragments (FPKM) or reads (RPKM)
+	int32_t maxHits; //--max-hits the classes were cut at by older files, 0 for none
+	
+	//NormalizationTotals of the bams, 0 if not known
+	double numReads;
+	double numReadsDivHits;
+	double numFragments;
+	double numFragmentsDivHits;
+};
+
+class ClassFileGene{
+public:
+	double uniqueCount; //reads with NH 1
+	int32_t hasChromInAnyBams;
+	int32_t padding;
+};
+
+class ClassFileClass{
+public:
+	uint64_t numReads;
+	uint64_t firstTarget;
+	uint32_t numTargets;
+	uint32_t numHits;
+};
+
+class ClassFileTarget{
+public:
+	int32_t gene;
+	uint32_t multiplicity;
+};
+
+//names, chromosomes and blocks of the genes in report order
+uint64_t geneTableChecksum(const GeneTable& genes){
+	uint64_t checksum=mixHash64(genes.size());
+	
+	for(GeneTable::const_iterator gi=genes.begin();gi!=genes.end();gi++){
+		checksum=mixHash64(checksum^hashBytes64(gi->name.data(),gi->name.length(),1));
+		checksum=mixHash64(checksum^hashBytes64(gi->chrom.data(),gi->chrom.length(),2));
+		
+		const Coord* starts=genes.starts(*gi);
+		const Coord* ends=genes.ends(*gi);
+		for(unsigned int i=0;i<gi->numBlocks;i++){
+			checksum=mixHash64(checksum^((uint64_t(uint32_t(starts[i]))<<32)|uint32_t(ends[i])));
+		}
+	}
+	
+	return checksum;
+}
+
+//genes hold the counts of unique reads. Return false on failure
+bool saveClassFile(const OptionStruct& opts,const GeneTable& genes,const EquivalenceClassTable& classes,const NormalizationTotals& totals,const string& filename){
+	ClassFileHeader header;
+	memset(&header,0,sizeof(ClassFileHeader));
+	memcpy(header.magic,CLASS_FILE_MAGIC,8);
+	header.version=CLASS_FILE_VERSION;
+	header.numGenes=genes.size();
+	header.geneChecksum=geneTableChecksum(genes);
+	header.numClasses=classes.size();
+	header.numTargets=classes.genes.size();
+	header.fragments=(opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS);
+	header.maxHits=0; //every multi-mapped read is kept, --max-hits applies when counting from the classes
+	header.numReads=totals.numReads;
+	header.numReadsDivHits=totals.numReadsDivHits;
+	header.numFragments=totals.numFragments;
+	header.numFragmentsDivHits=totals.numFragmentsDivHits;
+	
+	OutputBuffer out;
+	if(!out.open(filename)){
+		cerr<<"cannot open equivalence class file "<<filename<<" for writing"<<endl;
+		return false;
+	}
+	
+	out.put((const char*)&header,sizeof(ClassFileHeader));
+	
+	for(GeneTable::const_iterator gi=genes.begin();gi!=genes.end();gi++){
+		ClassFileGene entry;
+		memset(&entry,0,sizeof(ClassFileGene));
+		entry.uniqueCount=gi->count;
+		entry.hasChromInAnyBams=gi->hasChromInAnyBams;
+		out.put((const char*)&entry,sizeof(ClassFileGene));
+	}
+	
+	for(unsigned int c=0;c<classes.size();c++){
+		ClassFileClass entry;
+		entry.numReads=classes.numReads[c];
+		entry.firstTarget=classes.offsets[c];
+		entry.numTargets=classes.offsets[c+1]-classes.offsets[c];
+		entry.numHits=classes.numHits[c];
+		out.put((const char*)&entry,sizeof(ClassFileClass));
+	}
+	
+	for(unsigned int k=0;k<classes.genes.size();k++){
+		ClassFileTarget entry;
+		entry.gene=classes.genes[k];
+		entry.multiplicity=classes.multiplicities[k];
+		out.put((const char*)&entry,sizeof(ClassFileTarget));
+	}
+	
+	if(out.close()!=0){
+		cerr<<"error writing equivalence class file "<<filename<<endl;
+		unlink(filename.c_str());
+		return false;
+	}
+	
+	cerr<<"equivalence class file "<<filename<<" written: "<<header.numGenes<<" genes, "<<header.numClasses<<" classes"<<endl;
+	return true;
+}
+
+/*
+ map the class file of opts.classesFile onto genes (loaded the same way as when it was
+ written): unique counts into the genes, the classes into classes and the totals into totals.
+ Return false on failure
+ */
+bool loadClassFile(OptionStruct& opts,GeneTable& genes,EquivalenceClassTable& classes,NormalizationTotals& totals){
+	const string& filename=opts.classesFile;
+	
+	int fd=open(filename.c_str(),O_RDONLY);
+	if(fd<0){
+		cerr<<"cannot open equivalence class file "<<filename<<endl;
+		return false;
+	}
+	
+	struct stat st;
+	if(fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(ClassFileHeader)){
+		cerr<<filename<<" is not an equivalence class file"<<endl;
+		close(fd);
+		return false;
+	}
+	
+	size_t fileSize=st.st_size;
+	void* mapped=mmap(NULL,fileSize,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(mapped==MAP_FAILED){
+		cerr<<"cannot map equivalence class file "<<filename<<endl;
+		return false;
+	}
+	
+	const char* base=(const char*)mapped;
+	const ClassFileHeader& header=*(const ClassFileHeader*)base;
+	
+	size_t geneOffset=sizeof(ClassFileHeader);
+	size_t classOffset=geneOffset+size_t(header.numGenes)*sizeof(ClassFileGene);
+	size_t targetOffset=classOffset+header.numClasses*sizeof(ClassFileClass);
+	
+	if(memcmp(header.magic,CLASS_FILE_MAGIC,8)!=0 || header.version!=CLASS_FILE_VERSION || targetOffset+header.numTargets*sizeof(ClassFileTarget)!=fileSize){
+		cerr<<filename<<" is not an equivalence class file of this version or is truncated"<<endl;
+		munmap(mapped,fileSize);
+		return false;
+	}
+	
+	bool fragments=(opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS);
+	bool ok=true;
+	
+	if(header.numGenes!=genes.size() || header.geneChecksum!=geneTableChecksum(genes)){
+		cerr<<"equivalence class file "<<filename<<" was counted with other genes or blocks (bed files or threshold settings). Count again from the bam files"<<endl;
+		ok=false;
+	}else if(header.fragments!=fragments){
+		cerr<<"equivalence class file "<<filename<<" counts "<<(header.fragments?"fragments. Use --fpkm or --fpkm-divhits":"reads. Use --rpkm or --rpkm-divhits")<<endl;
+		ok=false;
+	}
+	
+	const ClassFileGene* geneEntries=(const ClassFileGene*)(base+geneOffset);
+	const ClassFileClass* classEntries=(const ClassFileClass*)(base+classOffset);
+	const ClassFileTarget* targetEntries=(const ClassFileTarget*)(base+targetOffset);
+	
+	for(unsigned int g=0;ok && g<header.numGenes;g++){
+		genes[g].count=geneEntries[g].uniqueCount;
+		genes[g].hasChromInAnyBams=geneEntries[g].hasChromInAnyBams;
+	}
+	
+	vector<pair<int,unsigned int> > targets;
+	for(uint64_t c=0;ok && c<header.numClasses;c++){
+		const ClassFileClass& entry=classEntries[c];
+		ok=(entry.firstTarget+entry.numTargets<=header.numTargets);
+		
+		targets.clear();
+		for(uint32_t k=0;ok && k<entry.numTargets;k++){
+			const ClassFileTarget& target=targetEntries[entry.firstTarget+k];
+			ok=(target.gene>=0 && (uint32_t)target.gene<header.numGenes);
+			targets.push_back(pair<int,unsigned int>(target.gene,target.multiplicity));
+		}
+		
+		if(!ok){
+			cerr<<"equivalence class file "<<filename<<" is corrupted"<<endl;
+			break;
+		}
+		
+		classes.addClass(entry.numHits,entry.numReads,targets);
+	}
+	
+	if(!ok){
+		munmap(mapped,fileSize);
+		return false;
+	}
+	
+	totals.numReads=header.numReads;
+	totals.numReadsDivHits=header.numReadsDivHits;
+	totals.numFragments=header.numFragments;
+	totals.numFragmentsDivHits=header.numFragmentsDivHits;
+	
+	if(header.maxHits>0 && (opts.maxHits<=0 || opts.maxHits>header.maxHits)){
+		cerr<<"warning: equivalence class file "<<filename<<" was counted with --max-hits "<<header.maxHits<<". Reads with more hits are not in it"<<endl;
+	}
+	
+	munmap(mapped,fileSize);
+	
+	cerr<<"equivalence class file "<<filename<<" loaded: "<<header.numGenes<<" genes, "<<header.numClasses<<" classes"<<endl;
+	return true;
+}
+
+//add to the genes, which hold the counts of unique reads, their shares of the multi-mapped reads: by EM with --em, else divided by NH or not as the mode says
+void assignClasses(OptionStruct& opts,GeneTable& genes,const EquivalenceClassTable& classes){
+	vector<double> shares(genes.size(),0.0);
+	
+	if(opts.em){
+		vector<double> fixedCounts(genes.size());
+		vector<int> probedLengths(genes.size());
+		for(unsigned int g=0;g<genes.size();g++){
+			fixedCounts[g]=genes[g].count;
+			probedLengths[g]=genes[g].blocksLength();
+		}
+		
+		bool converged;
+		int iterations=allocateMultiMappersByEM(classes,opts.maxHits,fixedCounts,probedLengths,opts.emTolerance,opts.emMaxIterations,shares,converged);
+		
+		cerr<<"EM over "<<classes.size()<<" equivalence classes of multi-mapped reads "<<(converged?"converged":"stopped without converging")<<" after "<<iterations<<" iterations"<<endl;
+	}else{
+		classes.addCounts(shares,opts.maxHits,opts.expressionMode==EXPRESSIONMODE_RPKM_DIVHITS || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS);
+	}
+	
+	for(unsigned int g=0;g<genes.size();g++){
+		genes[g].count+=shares[g];
+	}
+}
+
+//--classes: the report from an equivalence class file instead of the bams
+int runGeneRPKMFromClasses(OptionStruct& opts){
+	
+	GeneTable genes;
+	
+	if(!loadGenes(opts,genes)){
+		return 1;
+	}
+	
+	if(opts.stats){
+		opts.stats->beginPhase("load equivalence classes");
+	}
+	
+	EquivalenceClassTable classes;
+	NormalizationTotals totals;
+	if(!loadClassFile(opts,genes,classes,totals)){
+		return 1;
+	}
+	
+	assignClasses(opts,genes,classes);
+	
+	if(opts.totalNumOfReads==0){
+		opts.totalNumOfReads=ceil(totals.forMode(opts.expressionMode));
+		if(opts.totalNumOfReads==0){
+			cerr<<"the total number of reads for this mode is not in "<<opts.classesFile<<". Give it with --total-num-reads"<<endl;
+			return 1;
+		}
+		
+		cerr<<"total number of reads is "<<opts.totalNumOfReads<<" (from equivalence class file)"<<endl;
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+		opts.stats->beginPhase("write report");
+	}
+	
+	OutputBuffer out(STDOUT_FILENO);
+	writeReport(out,opts,genes);
+	
+	if(out.close()!=0){
+		cerr<<"error writing the output"<<endl;
+		return 1;
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+	}
+	
+	return 0;
+}
+
+int runGeneRPKM(OptionStruct& opts){
+	
+	if(opts.stats){
+		opts.stats->beginPhase("count totals");
+	}
+	
+	if(opts.totalNumOfReads==0){
+		double totalNumOfReadsT;
+		if(countTotalNumOfReadsFromCaches(opts,totalNumOfReadsT)){
+			opts.totalNumOfReads=ceil(totalNumOfReadsT);
+			
+			cerr<<"total number of reads is "<<opts.totalNumOfReads<<" (from totals cache)"<<endl;
+		}else if(countTotalNumOfReadsFromIndexes(opts,totalNumOfReadsT)){
+			opts.totalNumOfReads=ceil(totalNumOfReadsT);
+			
+			cerr<<"total number of reads is "<<opts.totalNumOfReads<<" (from bam index)"<<endl;
+		}
+	}
+	
+	//with sweep, the totals come from the counting pass itself so that each bam is read only once
+	bool fuseTotals=(opts.totalNumOfReads==0 && opts.sweep);
+	NormalizationTotals fusedTotals;
+	
+	//total number of reads not specified. count from bam files.
+	if(opts.totalNumOfReads==0 && !fuseTotals){
+		if(opts.selection.active()){
+			cerr<<"scanning the bam files for the total number of reads. --totals-cache keeps it for later runs"<<endl;
+		}
+		
+		double totalNumOfReadsT=0.0;
+		for(vector<string>::iterator i=opts.bamfilenames.begin();i!=opts.bamfilenames.end();i++){
+			totalNumOfReadsT+=scanTotalNumOfReadsInBam(*i,opts.expressionMode);
+		}
+		
+		opts.totalNumOfReads=ceil(totalNumOfReadsT);
+		
+		cerr<<"total number of reads is "<<opts.totalNumOfReads<<endl;
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+		opts.stats->totalsFromCountingPass=fuseTotals;
+	}
+	
+	//return 0;
+	
+	GeneTable genes;
+	
+	if(!loadGenes(opts,genes)){
+		return 1;
+	}
+	
+	if(opts.stats){
+		opts.stats->beginPhase("count genes");
+	}
+	
+	MultiMapperHitStore multiMapperHits(opts.tmpDir,opts.maxMem);
+	MultiMapperHitStore* keptHits=opts.keepsClasses()?&multiMapperHits:NULL;
+	
+	//Now we have the blocks for expression calculation
+	if(opts.numThreads>1){
+		if(!countGenesThreaded(opts,genes,fuseTotals?&fusedTotals:NULL,keptHits)){
+			return 1;
+		}
+	}else if(opts.sweep){
+		if(!countGenesBySweeping(opts,genes,fuseTotals?&fusedTotals:NULL,keptHits)){
+			return 1;
+		}
+	}else if(!countGenesByFetching(opts,genes)){
+		return 1;
+	}
+	
+	if(fuseTotals){
+		opts.totalNumOfReads=ceil(fusedTotals.forMode(opts.expressionMode));
+		
+		cerr<<"total number of reads is "<<opts.totalNumOfReads<<endl;
+	}
+	
+	if(keptHits){
+		if(opts.stats){
+			opts.stats->endPhase();
+			opts.stats->beginPhase("allocate multi-mappers");
+		}
+		
+		EquivalenceClassTable classes;
+		if(!multiMapperHits.collapse(classes)){
+			return 1;
+		}
+		
+		cerr<<multiMapperHits.numHits<<" gene hits of multi-mapped reads collapsed into "<<classes.size()<<" equivalence classes"<<endl;
+		
+		if(opts.stats){
+			opts.stats->noteMultiMappers(multiMapperHits,classes);
+		}
+		
+		if(opts.writeClassesFile!=""){
+			NormalizationTotals totals;
+			if(fuseTotals){
+				totals=fusedTotals;
+			}else{
+				//only the total of this mode is known
+				totals.setForMode(opts.expressionMode,opts.totalNumOfReads);
+			}
+			
+			if(!saveClassFile(opts,genes,classes,totals,opts.writeClassesFile)){
+				return 1;
+			}
+		}
+		
+		assignClasses(opts,genes,classes);
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+		opts.stats->beginPhase("write report");
+	}
+	
+	OutputBuffer out(STDOUT_FILENO);
+	writeReport(out,opts,genes);
+	
+	if(out.close()!=0){
+		cerr<<"error writing the output"<<endl;
+		return 1;
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+	}
+		
+	return 0;
+}
+
+/* matrix mode
+ 
+ one count and one expression column per bam, each normalized by the total of its own bam.
+ Genes and blocks are derived once and shared; the bams are counted concurrently, one bam
+ per thread at a time, each thread on its own copy of the gene table
+ 
+ */
+class MatrixColumn{
+public:
+	string bamfilename;
+	string label;
+	int totalNumOfReads; //0: not known before counting
+	vector<double> counts;
+	vector<char> hasChrom;
+};
+
+class MatrixWorkQueue{
+public:
+	OptionStruct* opts;
+	const GeneTable* genes;
+	vector<MatrixColumn>* columns;
+	unsigned int nextColumn;
+	bool failed;
+	pthread_mutex_t lock;
+	
+	MatrixWorkQueue(OptionStruct* _opts,const GeneTable* _genes,vector<MatrixColumn>* _columns):opts(_opts),genes(_genes),columns(_columns),nextColumn(0),failed(false){
+		pthread_mutex_init(&lock,NULL);
+	}
+	
+	~MatrixWorkQueue(){
+		pthread_mutex_destroy(&lock);
+	}
+	
+	//return NULL when all columns are taken
+	MatrixColumn* takeColumn(){
+		MatrixColumn* column=NULL;
+		pthread_mutex_lock(&lock);
+		if(!failed && nextColumn<columns->size()){
+			column=&(*columns)[nextColumn++];
+		}
+		pthread_mutex_unlock(&lock);
+		return column;
+	}
+	
+	void fail(){
+		pthread_mutex_lock(&lock);
+		failed=true;
+		pthread_mutex_unlock(&lock);
+	}
+};
+
+//sample label of a column: file name without directory and .bam extension
+string matrixColumnLabel(const string& bamfilename){
+	string label=bamfilename;
+	size_t slash=label.rfind('/');
+	if(slash!=string::npos){
+		label=label.substr(slash+1);
+	}
+	
+	if(label.length()>4 && label.substr(label.length()-4)==".bam"){
+		label=label.substr(0,label.length()-4);
+	}
+	
+	return label;
+}
+
+//count one bam into its column, with genes as the thread's own scratch table
+bool countMatrixColumn(OptionStruct& opts,GeneTable& genes,ChromSweepBlocks& chromBlocks,MatrixColumn& column){
+	
+	//the time of a column includes getting its total
+	CountingStats stats(vector<string>(1,column.bamfilename));
+	CountingStats* keptStats=opts.stats?&stats:NULL;
+	Stopwatch columnWatch(CPU_TIME_THREAD,opts.stats!=NULL);
+	
+	for(GeneTable::iterator gi=genes.begin();gi!=genes.end();gi++){
+		gi->count=0.0;
+		gi->hasChromInAnyBams=false;
+	}
+	
+	//total: as for the single column, except that it is per bam
+	if(column.totalNumOfReads==0){
+		double totalNumOfReadsT;
+		NormalizationTotals totals;
+		if(opts.useTotalsCache && getTotalsFromCache(column.bamfilename,totals)){
+			column.totalNumOfReads=ceil(totals.forMode(opts.expressionMode));
+		}else if(opts.expressionMode==EXPRESSIONMODE_RPKM && !opts.scanTotalReads && countMappedReadsFromIndex(column.bamfilename,totalNumOfReadsT)){
+			column.totalNumOfReads=ceil(totalNumOfReadsT);
+		}else if(!opts.sweep){
+			column.totalNumOfReads=ceil(scanTotalNumOfReadsInBam(column.bamfilename,opts.expressionMode));
+		}
+	}
+	
+	if(opts.sweep){
+		NormalizationTotals fusedTotals;
+		bool fuseTotals=(column.totalNumOfReads==0);
+		if(!sweepCountBam(opts,genes,chromBlocks,column.bamfilename,fuseTotals?&fusedTotals:NULL,keptStats,NULL,0)){
+			return false;
+		}
+		
+		if(fuseTotals){
+			column.totalNumOfReads=ceil(fusedTotals.forMode(opts.expressionMode));
+		}
+	}else{
+		vector<IndexedBam*> indexedBams;
+		if((opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS) && !openIndexedBams(vector<string>(1,column.bamfilename),indexedBams)){
+			return false;
+		}
+		
+		vector<BamReader*> bamfiles(1,new BamReader(column.bamfilename));
+		FragmentSpanCounter fragmentCounter;
+		for(GeneTable::iterator gi=genes.begin();gi!=genes.end();gi++){
+			countGeneByFetching(opts,bamfiles,indexedBams,fragmentCounter,genes,*gi,keptStats);
+		}
+		bamfiles[0]->close();
+		delete bamfiles[0];
+		closeIndexedBams(indexedBams);
+	}
+	
+	column.counts.resize(genes.size());
+	column.hasChrom.resize(genes.size());
+	for(unsigned int g=0;g<genes.size();g++){
+		column.counts[g]=genes[g].count;
+		column.hasChrom[g]=genes[g].hasChromInAnyBams;
+	}
+	
+	cerr<<"total number of reads of "<<column.bamfilename<<" is "<<column.totalNumOfReads<<endl;
+	
+	if(opts.stats){
+		//fetching has added its own time of the bam; the column's replaces it
+		stats.bams[0]=TimeSpent(column.bamfilename);
+		columnWatch.addTo(stats.bams[0]);
+		opts.stats->merge(stats);
+	}
+	
+	return true;
+}
+
+void* matrixWorker(void* data){
+	MatrixWorkQueue* queue=(MatrixWorkQueue*)data;
+	
+	GeneTable genes(*queue->genes);
+	ChromSweepBlocks chromBlocks;
+	if(queue->opts->sweep){
+		buildSweepBlocks(genes,chromBlocks);
+	}
+	
+	MatrixColumn* column;
+	while((column=queue->takeColumn())!=NULL){
+		if(!countMatrixColumn(*queue->opts,genes,chromBlocks,*column)){
+			queue->fail();
+		}
+	}
+	
+	return NULL;
+}
+
+int runGeneRPKMMatrix(OptionStruct& opts){
+	
+	vector<MatrixColumn> columns(opts.bamfilenames.size());
+	for(unsigned int b=0;b<columns.size();b++){
+		columns[b].bamfilename=opts.bamfilenames[b];
+		columns[b].label=matrixColumnLabel(opts.bamfilenames[b]);
+		columns[b].totalNumOfReads=opts.totalNumOfReadsPerBam.empty()?0:opts.totalNumOfReadsPerBam[b];
+	}
+	
+	GeneTable genes;
+	
+	if(!loadGenes(opts,genes)){
+		return 1;
+	}
+	
+	if(opts.stats){
+		opts.stats->beginPhase("count columns");
+	}
+	
+	MatrixWorkQueue queue(&opts,&genes,&columns);
+	
+	int numThreads=opts.numThreads<int(columns.size())?opts.numThreads:columns.size();
+	vector<pthread_t> threads(numThreads);
+	for(int t=0;t<numThreads;t++){
+		pthread_create(&threads[t],NULL,matrixWorker,&queue);
+	}
+	
+	for(int t=0;t<numThreads;t++){
+		pthread_join(threads[t],NULL);
+	}
+	
+	if(queue.failed){
+		return 1;
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+		opts.stats->beginPhase("write report");
+	}
+	
+	const char* expressionLabel=(opts.expressionMode==EXPRESSIONMODE_RPKM || opts.expressionMode==EXPRESSIONMODE_RPKM_DIVHITS)?"RPKM":"FPKM";
+	
+	/*
+	 1) GeneName
+	 2) Chrom
+	 3) Gene Start (1-based)
+	 4) Gene End (1-based)
+	 5) Strand
+	 6) Length of probed region
+	 then for each bam:
+	 ReadCounts, RPKM or FPKM
+	 then
+	 MinConsUsedFrac
+	 MinConsUsedNum
+	 */
+	OutputBuffer out(STDOUT_FILENO);
+	
+	out.put("GeneName").tab();
+	out.put("Chrom").tab();
+	out.put("GeneStart").tab();
+	out.put("GeneEnd").tab();
+	out.put("Strand").tab();
+	out.put("LengthProbed").tab();
+	for(vector<MatrixColumn>::iterator ci=columns.begin();ci!=columns.end();ci++){
+		out.put(opts.prefixDataLabel).put(ci->label).put(".ReadCounts").tab();
+		out.put(opts.prefixDataLabel).put(ci->label).put('.').put(expressionLabel).tab();
+	}
+	out.put("MinConsUsedFrac").tab();
+	out.put("MinConsUsedNum").endLine();
+	
+	for(unsigned int g=0;g<genes.size();g++){
+		const GeneRecord& gene=genes[g];
+		
+		bool hasChromInAnyBams=false;
+		for(vector<MatrixColumn>::iterator ci=columns.begin();ci!=columns.end();ci++){
+			hasChromInAnyBams=hasChromInAnyBams || ci->hasChrom[g];
+		}
+		
+		int lengthProbed=hasChromInAnyBams?gene.blocksLength():0;
+		
+		out.put(gene.name).tab();
+		out.put(gene.chrom).tab();
+		out.putInt(gene.start0+1).tab();
+		out.putInt(gene.end1).tab();
+		out.put(gene.strand).tab();
+		out.putInt(lengthProbed).tab();
+		
+		for(vector<MatrixColumn>::iterator ci=columns.begin();ci!=columns.end();ci++){
+			if(lengthProbed==0 || !ci->hasChrom[g]){
+				out.put(opts.fillNA).tab();
+				out.put(opts.fillNA).tab();
+			}else{
+				double countD=ci->counts[g];
+				double RPKM=countD/(float(ci->totalNumOfReads)/1e6)/(float(lengthProbed)/1e3);
+				out.putDouble(countD).tab();
+				out.putDouble(RPKM).tab();
+			}
+		}
+		
+		out.putDouble(gene.minUsed.second).tab();
+		out.putInt(gene.minUsed.first).endLine();
+	}
+	
+	if(out.close()!=0){
+		cerr<<"error writing the output"<<endl;
+		return 1;
+	}
+	
+	if(opts.stats){
+		opts.stats->endPhase();
+	}
+	
+	return 0;
+}
+
+/* server mode
+ 
+ genes and blocks are derived once and kept resident; requests come over a unix domain
+ socket, one per connection, each a single line of tab-separated arguments:
+ 
+ --bamfile<tab>x.bam[<tab>--bamfile<tab>y.bam...][<tab>--fpkm|--rpkm|--fpkm-divhits|--rpkm-divhits][<tab>--max-hits<tab>N]
+ [<tab>--total-num-reads<tab>N][<tab>--label-prefix<tab>str][<tab>--fill-NA-with<tab>str]
+ 
+ and are answered with the same table as the command line, then the connection is closed.
+ Arguments missing from a request take the values the server was started with.
+ A failed request is answered with a single line #error<tab>message.
+ The request --shutdown stops the server.
+ 
+ */
+
+//an open bam (with its index) of the server, and the totals counted from it so far
+class BamHandle{
+public:
+	BamReader* reader;
+	IndexedBam* indexedBam; //for the FPKM span fetch
+	long long size;
+	long long mtime;
+	map<int,int> totals; //expression mode -> total number of reads
+	list<string>::iterator lruPos;
+	
+	BamHandle():reader(NULL),indexedBam(NULL),size(-1),mtime(-1){}
+};
+
+/* bam handle cache
+ 
+ at most capacity bams are kept open, the least recently used is closed first.
+ A bam that changed on disk since it was open is reopened
+ 
+ */
+class BamHandleCache{
+public:
+	unsigned int capacity;
+	map<string,BamHandle> handles;
+	list<string> lru; //most recently used first
+	
+	BamHandleCache(unsigned int _capacity):capacity(_capacity<1?1:_capacity){}
+	
+	~BamHandleCache(){
+		for(map<string,BamHandle>::iterator i=handles.begin();i!=handles.end();i++){
+			closeHandle(i->second);
+		}
+	}
+	
+	//return NULL with error set if the bam or its index cannot be open
+	BamHandle* get(const string& bamfilename,string& error){
+		struct stat st;
+		if(stat(bamfilename.c_str(),&st)!=0){
+			error="cannot open bam file "+bamfilename;
+			return NULL;
+		}
+		
+		map<string,BamHandle>::iterator i=handles.find(bamfilename);
+		if(i!=handles.end()){
+			if(i->second.size==st.st_size && i->second.mtime==st.st_mtime){
+				lru.erase(i->second.lruPos);
+				lru.push_front(bamfilename);
+				i->second.lruPos=lru.begin();
+				return &i->second;
+			}
+			
+			//changed on disk
+			evict(i);
+		}
+		
+		if(findBamIndexFile(bamfilename)==""){
+			error="bam file "+bamfilename+" has no index";
+			return NULL;
+		}
+		
+		while(handles.size()>=capacity){
+			evict(handles.find(lru.back()));
+		}
+		
+		IndexedBam* indexedBam=new IndexedBam;
+		if(!indexedBam->open(bamfilename)){
+			delete indexedBam;
+			error="bam file "+bamfilename+" or its index cannot be open";
+			return NULL;
+		}
+		
+		BamHandle& handle=handles[bamfilename];
+		handle.reader=new BamReader(bamfilename);
+		handle.indexedBam=indexedBam;
+		handle.size=st.st_size;
+		handle.mtime=st.st_mtime;
+		lru.push_front(bamfilename);
+		handle.lruPos=lru.begin();
+		
+		return &handle;
+	}
+	
+private:
+	void closeHandle(BamHandle& handle){
+		if(handle.reader){
+			handle.reader->close();
+			delete handle.reader;
+			handle.reader=NULL;
+		}
+		
+		if(handle.indexedBam){
+			delete handle.indexedBam;
+			handle.indexedBam=NULL;
+		}
+	}
+	
+	void evict(map<string,BamHandle>::iterator i){
+		closeHandle(i->second);
+		lru.erase(i->second.lruPos);
+		handles.erase(i);
+	}
+};
+
+//total number of reads of a bam for the request's mode, counted once per open handle
+bool getServedTotal(OptionStruct& serverOpts,OptionStruct& reqOpts,const string& bamfilename,BamHandle& handle,int& total){
+	map<int,int>::iterator i=handle.totals.find(reqOpts.expressionMode);
+	if(i!=handle.totals.end()){
+		total=i->second;
+		return true;
+	}
 	
-	cerr<<"Usage: "<<programName<<" [options]"<<endl;
-	cerr<<"preprocessor options:"<<endl;
-	outArgsHelp("--@import-args filename","load arguments from tab delimited file");
-	cerr<<"options:"<<endl;
-	outArgsHelp("--bamfile bamfile","specify the bam file. Repeat this option for multiple bam files");
-	outArgsHelp("--bedfile befile","specify the bed file for the gene. Can repeat this option for multiple gene annotations");
-	outArgsHelp("--total-num-reads numReads","Specify total number of mapped reads. Instead of counting from the bam file");
-	outArgsHelp("--constitutive-threshold-frac fraction","Specify the min fraction [0.0,1.0] of transcripts covering a region to be used in counting. Default: 1.-");
-	outArgsHelp("--constitutive-threshold-num num","Specify the min number of transcripts covering a region to be used in counting. Default: 1");
-	outArgsHelp("--flexmax-thresholding bp","use a flexible max threshold such that all genes can be counted with at least bp number of basepairs");
-	outArgsHelp("--force-flexmax-bp-policy","enforce flexmax bp policy, if going down to 1 blockFreq and no bp width of region available, then fail the gene expression detection for that gene");
-	outArgsHelp("--fpkm-divhits","[default] count reads and expression as FPKM after normalizing read numbers to number of hits (using NH flag) for each read");
-	outArgsHelp("--fpkm","count reads and expression as FPKM");
-	outArgsHelp("--rpkm-divhits","count reads and expression as RPKM after normalizing read numbers to the number of hits (using NH flag) for each read");
-	outArgsHelp("--rpkm","count reads and expression as RPKM");
-	outArgsHelp("--max-hits hits","discard reads with more than a certain number of hits");
-	outArgsHelp("--label-prefix str","prefix label of RPKM/FPKM, etc by str");
-	outArgsHelp("--fill-NA-with str","fill NA data with str");
-	cerr<<"\tNote that both thresholds are applied unless --flexmax-thresholding is specified"<<endl;
-	outArgsHelp("--region-bed-out bedfile","output a regions used to calculate to a bedfile");
-	outArgsHelp("--region-bed-itemRgb rgb","set the itemRgb output for the bed out");
-	outArgsHelp("--no-block-bed-out bedfile","output a bed file consisting of genes with no available blocks for gene expression estimation according to the current settings");
-	//outArgsHelp("--use-coding-region-only","whether to use only coding region (for genes that have coding regions");
+	double totalNumOfReadsT;
+	NormalizationTotals totals;
+	if(serverOpts.useTotalsCache){
+		if(!getTotalsFromCache(bamfilename,totals)){
+			return false;
+		}
+		totalNumOfReadsT=totals.forMode(reqOpts.expressionMode);
+	}else if(reqOpts.expressionMode!=EXPRESSIONMODE_RPKM || serverOpts.scanTotalReads || !countMappedReadsFromIndex(bamfilename,totalNumOfReadsT)){
+		totalNumOfReadsT=scanTotalNumOfReadsInBam(bamfilename,reqOpts.expressionMode);
+	}
 	
+	total=ceil(totalNumOfReadsT);
+	handle.totals[reqOpts.expressionMode]=total;
+	return true;
 }
 
-int runGeneRPKM(OptionStruct& opts){
+//answer one request. Return false with error set if it cannot be served
+bool serveRequest(OptionStruct& serverOpts,GeneTable& genes,BamHandleCache& cache,const vector<string>& args,OutputBuffer& out,bool& shutdown,string& error){
 	
-	//total number of reads not specified. count from bam files.
-	if(opts.totalNumOfReads==0){
-		double totalNumOfReadsT=0.0;
-		for(vector<string>::iterator i=opts.bamfilenames.begin();i!=opts.bamfilenames.end();i++){
-			switch(opts.expressionMode){
-				case EXPRESSIONMODE_RPKM:
-					totalNumOfReadsT+=BamReader::countTotalNumOfReadsInBam(*i);
-					break;
-				case EXPRESSIONMODE_RPKM_DIVHITS:
-					totalNumOfReadsT+=BamReader::countTotalNumOfReadsInBamDivHits(*i);
-					break;
-				case EXPRESSIONMODE_FPKM:
-					totalNumOfReadsT+=BamReader::countTotalNumOfFragmentsInBam(*i);
-					break;
-				case EXPRESSIONMODE_FPKM_DIVHITS:
-					totalNumOfReadsT+=BamReader::countTotalNumOfFragmentsInBamDivHits(*i);
-					break;
-				default:
-					break;
-					
+	OptionStruct reqOpts;
+	reqOpts.expressionMode=serverOpts.expressionMode;
+	reqOpts.maxHits=serverOpts.maxHits;
+	reqOpts.prefixDataLabel=serverOpts.prefixDataLabel;
+	reqOpts.fillNA=serverOpts.fillNA;
+	
+	for(unsigned int i=0;i<args.size();i++){
+		const string& arg=args[i];
+		
+		if(arg=="--shutdown"){
+			shutdown=true;
+			return true;
+		}else if(arg=="--rpkm"){
+			reqOpts.expressionMode=EXPRESSIONMODE_RPKM;
+		}else if(arg=="--rpkm-divhits"){
+			reqOpts.expressionMode=EXPRESSIONMODE_RPKM_DIVHITS;
+		}else if(arg=="--fpkm"){
+			reqOpts.expressionMode=EXPRESSIONMODE_FPKM;
+		}else if(arg=="--fpkm-divhits"){
+			reqOpts.expressionMode=EXPRESSIONMODE_FPKM_DIVHITS;
+		}else if(arg=="--bamfile" || arg=="--max-hits" || arg=="--total-num-reads" || arg=="--label-prefix" || arg=="--fill-NA-with"){
+			if(i+1>=args.size()){
+				error="missing value of "+arg;
+				return false;
+			}
+			
+			const string& value=args[++i];
+			if(arg=="--bamfile"){
+				reqOpts.bamfilenames.push_back(value);
+			}else if(arg=="--max-hits"){
+				reqOpts.maxHits=atoi(value.c_str());
+			}else if(arg=="--total-num-reads"){
+				reqOpts.totalNumOfReads+=atoi(value.c_str());
+			}else if(arg=="--label-prefix"){
+				reqOpts.prefixDataLabel=value;
+			}else{
+				reqOpts.fillNA=value;
 			}
+		}else if(arg!=""){
+			error="unknown argument "+arg;
+			return false;
+		}
+	}
+	
+	if(reqOpts.bamfilenames.size()==0){
+		error="no bam file specified";
+		return false;
+	}
+	
+	vector<BamReader*> bamfiles;
+	vector<IndexedBam*> indexedBams;
+	int totalNumOfReads=0;
+	
+	for(vector<string>::iterator i=reqOpts.bamfilenames.begin();i!=reqOpts.bamfilenames.end();i++){
+		BamHandle* handle=cache.get(*i,error);
+		if(!handle){
+			return false;
 		}
 		
-		opts.totalNumOfReads=ceil(totalNumOfReadsT);
+		bamfiles.push_back(handle->reader);
+		indexedBams.push_back(handle->indexedBam);
 		
-		cerr<<"total number of reads is "<<opts.totalNumOfReads<<endl;
+		if(reqOpts.totalNumOfReads==0){
+			int total;
+			if(!getServedTotal(serverOpts,reqOpts,*i,*handle,total)){
+				error="cannot count total number of reads of "+(*i);
+				return false;
+			}
+			totalNumOfReads+=total;
+		}
 	}
 	
-	//return 0;
+	if(reqOpts.totalNumOfReads==0){
+		reqOpts.totalNumOfReads=totalNumOfReads;
+	}
 	
-	double countD=0.0;
-	int countI=0;
+	FragmentSpanCounter fragmentCounter;
+	for(GeneTable::iterator gi=genes.begin();gi!=genes.end();gi++){
+		gi->count=0.0;
+		gi->hasChromInAnyBams=false;
+		countGeneByFetching(reqOpts,bamfiles,indexedBams,fragmentCounter,genes,*gi,NULL);
+	}
 	
-	BamReader::AdvFragmentSetCounter afsc;
+	writeReport(out,reqOpts,genes);
+	return true;
+}
+
+#define SERVE_CLIENT_TIMEOUT 30 //seconds for a client to send its request line, or to take each part of the answer
+
+//read one request line from a connection. Return false if the client sent none
+bool readRequestLine(int conn,string& line){
+	line.clear();
+	char buffer[4096];
 	
-	/*
-	1) GeneName
-	2) Chrom
-	3) Gene Start (1-based)
-	4) Gene End (1-based)
-	5) Strand
-	6) Length of probed region
-	7) Read Counts
-	8) RPKM or RPKM
-	 9) log2(RPKM) or log2(FPKM)
-	 11) MinConsUsedFrac
-	 12) MinConsUsedNum
-	 13) TotalNumberOfReads
-	 */
-	//write header
-	cout<<"GeneName"<<"\t";
-	cout<<"Chrom"<<"\t";
-	cout<<"GeneStart"<<"\t";
-	cout<<"GeneEnd"<<"\t";
-	cout<<"Strand"<<"\t";
-	cout<<"LengthProbed"<<"\t";
-	cout<<opts.prefixDataLabel<<"ReadCounts"<<"\t";
-	switch (opts.expressionMode) {
-		case EXPRESSIONMODE_FPKM:case EXPRESSIONMODE_FPKM_DIVHITS:
-			cout<<opts.prefixDataLabel<<"FPKM"<<"\t";
-			cout<<opts.prefixDataLabel<<"log2(FPKM)"<<"\t";
-			//cout<<opts.prefixDataLabel<<"log2(1+FPKM)"<<"\t";
-			
-			break;
-		case EXPRESSIONMODE_RPKM:case EXPRESSIONMODE_RPKM_DIVHITS:
-			cout<<opts.prefixDataLabel<<"RPKM"<<"\t";
-			cout<<opts.prefixDataLabel<<"log2(RPKM)"<<"\t";
-			//cout<<opts.prefixDataLabel<<"log2(1+RPKM)"<<"\t";
-			break;
-		default:
-			break;
+	while(line.length()<(1<<20)){
+		ssize_t n=read(conn,buffer,sizeof(buffer));
+		if(n<0 && errno==EINTR){
+			continue;
+		}
+		
+		if(n<0){
+			if(errno==EAGAIN || errno==EWOULDBLOCK){
+				cerr<<"client sent no complete request within "<<SERVE_CLIENT_TIMEOUT<<" seconds"<<endl;
+			}
+			return false;
+		}
+		
+		if(n==0){
+			return line.length()>0;
+		}
+		
+		line.append(buffer,n);
+		
+		size_t newline=line.find('\n');
+		if(newline!=string::npos){
+			line.erase(newline);
+			if(line.length()>0 && line[line.length()-1]=='\r'){
+				line.erase(line.length()-1);
+			}
+			return true;
+		}
 	}
-	cout<<"MinConsUsedFrac"<<"\t";
-	cout<<"MinConsUsedNum"<<"\t";
-	cout<<"TotalNumberOfReads"<<endl;
 	
-	//now go to each genes and count
-	for(vector<Annotation*>::iterator annoI=opts.annotations.begin();annoI!=opts.annotations.end();annoI++){
-		Annotation* pannot=*annoI;
-		for(Annotation::NameGeneMapI nameGeneI=pannot->name_genes_begin();nameGeneI!=pannot->name_genes_end();nameGeneI++){
-			//cerr<<"processing gene "<<nameGeneI->first<<endl;
-			SmartPtr<Gene> gene=nameGeneI->second;
-			
-			double countD=0.0;
-			
+	return false;
+}
 
-			pair<int,float> minUsed;
-			
-			
-			set<SortPair<Coord,Coord> > blocks;
-			///TODO
-			if(opts.flexmaxThresholding){
-				///add here
-				minUsed=gene->getFlexMaxConstitutiveBlocks(blocks,opts.flexmaxThreshold,opts.forceFlexMaxBasepairPolicy);
-			}else{
-				minUsed=gene->getConstitutiveBlocks(blocks,opts.constitutiveThresholdFrac,opts.constitutiveThresholdNum);
+int runGeneRPKMServer(OptionStruct& opts){
+	
+	GeneTable genes;
+	
+	if(!loadGenes(opts,genes)){
+		return 1;
+	}
+	
+	struct sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	if(opts.serveSocket.length()>=sizeof(addr.sun_path)){
+		cerr<<"socket path "<<opts.serveSocket<<" is too long"<<endl;
+		return 1;
+	}
+	strcpy(addr.sun_path,opts.serveSocket.c_str());
+	
+	//only a stale socket is replaced, never one a server still listens on or another file given by mistake
+	struct stat st;
+	if(lstat(opts.serveSocket.c_str(),&st)==0){
+		if(!S_ISSOCK(st.st_mode)){
+			cerr<<opts.serveSocket<<" exists and is not a socket. abort"<<endl;
+			return 1;
+		}
+		
+		int probe=socket(AF_UNIX,SOCK_STREAM,0);
+		int connected=(probe<0)?-1:connect(probe,(struct sockaddr*)&addr,sizeof(addr));
+		int connectError=errno;
+		if(probe>=0){
+			close(probe);
+		}
+		
+		if(connected==0){
+			cerr<<"another server is already serving on "<<opts.serveSocket<<". abort"<<endl;
+			return 1;
+		}
+		
+		if(probe<0 || connectError!=ECONNREFUSED){
+			cerr<<"cannot tell whether socket "<<opts.serveSocket<<" is stale: "<<strerror(connectError)<<". abort"<<endl;
+			return 1;
+		}
+		
+		unlink(opts.serveSocket.c_str());
+	}
+	
+	int sock=socket(AF_UNIX,SOCK_STREAM,0);
+	if(sock<0 || bind(sock,(struct sockaddr*)&addr,sizeof(addr))!=0 || listen(sock,16)!=0){
+		cerr<<"cannot listen on socket "<<opts.serveSocket<<endl;
+		if(sock>=0){
+			close(sock);
+		}
+		return 1;
+	}
+	
+	//a client hanging up must not end the server
+	signal(SIGPIPE,SIG_IGN);
+	
+	cerr<<"serving "<<genes.size()<<" genes on "<<opts.serveSocket<<endl;
+	
+	BamHandleCache cache(opts.serveCacheSize);
+	bool shutdown=false;
+	
+	while(!shutdown){
+		int conn=accept(sock,NULL,NULL);
+		if(conn<0){
+			if(errno==EINTR){
+				continue;
 			}
-			
-			//if we have regionBedOutStream
-			if(blocks.size()>0){
-				if(opts.regionBedOutStream){
-					/* region bed out
-					 
-					 1) chrom
-					 2) chromStart (0-based)
-					 3) chromEnd (1-based)
-					 4) geneName
-					 5) score = 0
-					 6) strand
-					 7) thickStart=chromStart
-					 8) thickEnd=chromEnd
-					 9) itemRgb=0,0,0
-					 10) blockCount
-					 11) blockSizes
-					 12) blockStarts
-					 
-					 
-					 */
-					(*opts.regionBedOutStream)<<gene->chrom()<<"\t";
-					int regionChromStart0=blocks.begin()->k1;
-					int regionChromEnd1=blocks.rbegin()->k2;
-					(*opts.regionBedOutStream)<<regionChromStart0<<"\t";
-					(*opts.regionBedOutStream)<<regionChromEnd1<<"\t";
-					(*opts.regionBedOutStream)<<gene->name()<<"\t";
-					(*opts.regionBedOutStream)<<"0"<<"\t";
-					(*opts.regionBedOutStream)<<gene->strand<<"\t";
-					(*opts.regionBedOutStream)<<regionChromStart0<<"\t";
-					(*opts.regionBedOutStream)<<regionChromEnd1<<"\t";
-					(*opts.regionBedOutStream)<<opts.itemRgb<<"\t";
-					(*opts.regionBedOutStream)<<blocks.size()<<"\t";
-				
-					
-					set<SortPair<Coord,Coord> >::iterator i=blocks.begin();
-					string blockSizes=StringUtil::str(i->k2-i->k1);
-					string blockStarts=StringUtil::str(i->k1-regionChromStart0);
-					i++;
-					for(;i!=blocks.end();i++){
-						blockSizes+=","+StringUtil::str(i->k2-i->k1);
-						blockStarts+=","+StringUtil::str(i->k1-regionChromStart0);
-					}
-					(*opts.regionBedOutStream)<<blockSizes<<"\t";
-					(*opts.regionBedOutStream)<<blockStarts<<endl;
-					
-					
-				}
-			}else{
-				if(opts.noBlockBedOutStream){
-					(*opts.noBlockBedOutStream)<<gene->chrom()<<"\t";
-					(*opts.noBlockBedOutStream)<<gene->start0()<<"\t";
-					(*opts.noBlockBedOutStream)<<gene->end1()<<"\t";
-					(*opts.noBlockBedOutStream)<<gene->name()<<"\t";
-					(*opts.noBlockBedOutStream)<<"0"<<"\t";
-					(*opts.noBlockBedOutStream)<<gene->strand<<endl;
+			cerr<<"error accepting connections on "<<opts.serveSocket<<endl;
+			break;
+		}
+		
+		//a client that connects and sends nothing, or never reads its answer, must not block the others
+		struct timeval timeout;
+		timeout.tv_sec=SERVE_CLIENT_TIMEOUT;
+		timeout.tv_usec=0;
+		setsockopt(conn,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+		setsockopt(conn,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+		
+		string line;
+		if(readRequestLine(conn,line)){
+			vector<string> args;
+			size_t start=0;
+			while(true){
+				size_t tab=line.find('\t',start);
+				args.push_back(line.substr(start,tab==string::npos?string::npos:tab-start));
+				if(tab==string::npos){
+					break;
 				}
+				start=tab+1;
 			}
 			
-			//Now we have the blocks for expression calculation
-			//go to each block, get number of reads or fragments.		
-			
-			int lengthProbed=0;
-			
-			bool hasChromInAnyBams=false;
-			
-			for(vector<BamReader*>::iterator bfi=opts.bamfiles.begin();bfi!=opts.bamfiles.end();bfi++){
-				
-				BamReader* curBam=*bfi;
-				
-				if(!curBam->hasChromInBam(gene->chrom())){
-					continue;
-				}
-				
-				hasChromInAnyBams=true;
-				
-				afsc.resetCount();
-				lengthProbed=0;
-				for(set<SortPair<Coord,Coord> >::iterator i=blocks.begin();i!=blocks.end();i++){
-					
-					int blockStart0=i->k1;
-					int blockEnd1=i->k2;
-					lengthProbed+=blockEnd1-blockStart0;
-					
-					switch (opts.expressionMode) {
-						case EXPRESSIONMODE_FPKM:
-							curBam->fetchFragmentCountOverlappingRegion(afsc,gene->chrom(),blockStart0,blockEnd1,true,opts.maxHits);
-							break;
-						case EXPRESSIONMODE_FPKM_DIVHITS:
-							curBam->fetchFragmentCountOverlappingRegionDivideByNumHits(afsc,gene->chrom(),blockStart0,blockEnd1,true,opts.maxHits);
-							break;
-						case EXPRESSIONMODE_RPKM:
-							countD+=curBam->fetchCountOverlappingRegion(gene->chrom(),blockStart0,blockEnd1,true,opts.maxHits);
-							break;
-						case EXPRESSIONMODE_RPKM_DIVHITS:
-							countD+=curBam->fetchCountOverlappingRegionDivideByNumHits(gene->chrom(),blockStart0,blockEnd1,true,opts.maxHits);
-							break;
-						default:
-							break;
-					}
-				}
-				
-				
-				//transmit read info from afsc to countI or countD
-				if(opts.expressionMode==EXPRESSIONMODE_FPKM || opts.expressionMode==EXPRESSIONMODE_FPKM_DIVHITS){
-					countD+=afsc;
-				}
-				
-				
-				
-				
-				
+			OutputBuffer out(conn);
+			string error;
+			if(!serveRequest(opts,genes,cache,args,out,shutdown,error)){
+				cerr<<"request failed: "<<error<<endl;
+				out.put("#error").tab().put(error).endLine();
 			}
 			
-			//end of gene: output!
-			/*
-			1) GeneName
-			2) Chrom
-			3) Gene Start (1-based)
-			4) Gene End (1-based)
-			5) Strand
-			6) Length of probed region
-			7) Read Counts
-			8) RPKM or RPKM
-			9) log2(RPKM) or log2(FPKM)
-			10) MinConsUsedFrac
-			11) MinConsUsedNum
-			12) TotalNumberOfReads			
-			*/
-			
-			cout<<gene->name()<<"\t";
-			cout<<gene->chrom()<<"\t";
-			cout<<(gene->start0()+1)<<"\t";
-			cout<<gene->end1()<<"\t";
-			cout<<gene->strand<<"\t";
-			cout<<lengthProbed<<"\t";
-			if(lengthProbed==0 || !hasChromInAnyBams){
-				cout<<opts.fillNA<<"\t";
-				cout<<opts.fillNA<<"\t";
-				cout<<opts.fillNA<<"\t";
-				//cout<<opts.fillNA<<"\t";
-			}else{
-				cout<<countD<<"\t";
-				double RPKM=countD/(float(opts.totalNumOfReads)/1e6)/(float(lengthProbed)/1e3);
-				
-				cout<<RPKM<<"\t";
-				if(RPKM==0.0){
-					cout<<opts.fillNA<<"\t";
-				}else {
-					cout<<(log(RPKM)/log(2))<<"\t";
-				}
-
-				
-				//cout<<(log(RPKM+1.0)/log(2))<<"\t";
+			if(out.close()!=0){
+				cerr<<"client hung up or did not take the answer within "<<SERVE_CLIENT_TIMEOUT<<" seconds"<<endl;
 			}
-			cout<<minUsed.second<<"\t";
-			cout<<minUsed.first<<"\t";
-			cout<<opts.totalNumOfReads<<endl;
 		}
-	}
 		
-	return 1;
+		close(conn);
+	}
+	
+	close(sock);
+	unlink(opts.serveSocket.c_str());
+	
+	cerr<<"<Done>"<<endl;
+	return 0;
+}
+
+void writeTimeSpentJson(ostream& os,const vector<TimeSpent>& times,const char* nameField){
+	os<<"[";
+	for(unsigned int i=0;i<times.size();i++){
+		os<<(i>0?",":"")<<"\n    {\""<<nameField<<"\": "<<jsonString(times[i].name)<<", \"wall_s\": "<<times[i].wall<<", \"cpu_s\": "<<times[i].cpu<<"}";
+	}
+	os<<(times.empty()?"]":"\n  ]");
+}
+
+//the --stats-json report. mode: what ran (fetch, sweep, matrix, build-block-index)
+void writeStatsJson(const OptionStruct& opts,const string& mode){
+	RunStats& stats=*opts.stats;
+	
+	TimeSpent total("total");
+	stats.runWatch.addTo(total);
+	
+	struct rusage usage;
+	getrusage(RUSAGE_SELF,&usage);
+	
+	ofstream fout(stats.filename.c_str());
+	if(!fout.good()){
+		cerr<<"cannot write stats to "<<stats.filename<<endl;
+		return;
+	}
+	
+	const char* expressionModes[]={"","RPKM","RPKM_DIVHITS","FPKM","FPKM_DIVHITS"};
+	const CountingStats& counting=stats.counting;
+	//record counters are null when fetching, which does not see the records
+	const char* unseen="null";
+	
+	fout.precision(6);
+	fout<<fixed;
+	fout<<"{"<<endl;
+	fout<<"  \"program\": \"geneRPKM\","<<endl;
+	fout<<"  \"mode\": "<<jsonString(mode)<<","<<endl;
+	fout<<"  \"expressionMode\": \""<<expressionModes[opts.expressionMode]<<"\","<<endl;
+	fout<<"  \"threads\": "<<opts.numThreads<<","<<endl;
+	fout<<"  \"wall_s\": "<<total.wall<<","<<endl;
+	fout<<"  \"cpu_s\": "<<total.cpu<<","<<endl;
+	fout<<"  \"peakRSS_kb\": "<<usage.ru_maxrss<<","<<endl;
+	fout<<"  \"phases\": ";
+	writeTimeSpentJson(fout,stats.phases,"name");
+	fout<<","<<endl;
+	fout<<"  \"bams\": ";
+	writeTimeSpentJson(fout,counting.bams,"file");
+	fout<<","<<endl;
+	fout<<"  \"totalsFromCountingPass\": "<<(stats.totalsFromCountingPass?"true":"false")<<","<<endl;
+	fout<<"  \"genes\": "<<stats.numGenes<<","<<endl;
+	fout<<"  \"genesWithoutBlocks\": "<<stats.numGenesWithoutBlocks<<","<<endl;
+	fout<<"  \"indexSeeks\": "<<counting.indexSeeks<<","<<endl;
+	if(stats.multiMappersKept){
+		fout<<"  \"multiMappers\": {\"hits\": "<<stats.multiMapperHits<<", \"peakBytes\": "<<stats.multiMapperPeakBytes<<", \"spilled\": "<<(stats.multiMappersSpilled?"true":"false")<<", \"equivalenceClasses\": "<<stats.equivalenceClasses<<"},"<<endl;
+	}else{
+		fout<<"  \"multiMappers\": null,"<<endl;
+	}
+	if(counting.recordsSeen){
+		fout<<"  \"bgzfBlocks\": "<<counting.bgzfBlocks<<","<<endl;
+		fout<<"  \"readsExamined\": "<<counting.readsExamined<<","<<endl;
+		fout<<"  \"readsCounted\": "<<counting.readsCounted<<","<<endl;
+		fout<<"  \"readsDroppedByMaxHits\": "<<counting.readsDroppedByMaxHits<<endl;
+	}else{
+		fout<<"  \"bgzfBlocks\": "<<unseen<<","<<endl;
+		fout<<"  \"readsExamined\": "<<unseen<<","<<endl;
+		fout<<"  \"readsCounted\": "<<unseen<<","<<endl;
+		fout<<"  \"readsDroppedByMaxHits\": "<<unseen<<endl;
+	}
+	fout<<"}"<<endl;
+	
+	fout.close();
+	if(fout.fail()){
+		cerr<<"error writing stats to "<<stats.filename<<endl;
+	}
 }
 
 int main(int argc,char*argv[])
@@ -436,6 +3586,25 @@ int main(int argc,char*argv[])
 	long_options.push_back("label-prefix=");
 	long_options.push_back("fill-NA-with=");
 	long_options.push_back("no-block-bed-out=");
+	long_options.push_back("sweep");
+	long_options.push_back("threads=");
+	long_options.push_back("scan-total-reads");
+	long_options.push_back("totals-cache");
+	long_options.push_back("build-block-index=");
+	long_options.push_back("block-index=");
+	long_options.push_back("matrix");
+	long_options.push_back("serve=");
+	long_options.push_back("region=");
+	long_options.push_back("genes-file=");
+	long_options.push_back("serve-cache=");
+	long_options.push_back("stats-json=");
+	long_options.push_back("em");
+	long_options.push_back("em-tolerance=");
+	long_options.push_back("em-max-iterations=");
+	long_options.push_back("write-classes=");
+	long_options.push_back("classes=");
+	long_options.push_back("max-mem=");
+	long_options.push_back("tmp-dir=");
 	
 	
 	OptionStruct opts;
@@ -465,6 +3634,7 @@ int main(int argc,char*argv[])
 	
 	for(vector<string>::iterator i=tmpNum.begin();i!=tmpNum.end();i++){
 		opts.totalNumOfReads+=atoi(i->c_str());
+		opts.totalNumOfReadsPerBam.push_back(atoi(i->c_str()));
 	}
 	
 	
@@ -480,6 +3650,11 @@ int main(int argc,char*argv[])
 		opts.flexmaxThreshold=atoi(getOptValue(optmap,"--flexmax-thresholding").c_str());
 	}
 	
+	opts.thresholdsGiven=hasOpt(optmap,"--constitutive-threshold-frac") || hasOpt(optmap,"--constitutive-threshold-num") || hasOpt(optmap,"--flexmax-thresholding") || hasOpt(optmap,"--force-flexmax-bp-policy");
+	
+	opts.blockIndexFile=getOptValue(optmap,"--block-index","");
+	opts.buildBlockIndexFile=getOptValue(optmap,"--build-block-index","");
+	
 	//cerr<<opts.flexmaxThresholding<<endl;
 	//cerr<<opts.constitutiveThresholdFrac<<endl;
 	//cerr<<opts.constitutiveThresholdNum<<endl;
@@ -499,11 +3674,19 @@ int main(int argc,char*argv[])
 	opts.fillNA=getOptValue(optmap,"--fill-NA-with","NA");
 	
 	if(opts.regionBedOut.length()>0){
-		opts.regionBedOutStream=new ofstream(opts.regionBedOut.c_str());
+		opts.regionBedOutStream=new OutputBuffer;
+		if(!opts.regionBedOutStream->open(opts.regionBedOut)){
+			cerr<<"cannot open "<<opts.regionBedOut<<" for writing. abort"<<endl;
+			return 1;
+		}
 	}
 	
 	if(opts.noBlockBedOut.length()>0){
-		opts.noBlockBedOutStream=new ofstream(opts.noBlockBedOut.c_str());
+		opts.noBlockBedOutStream=new OutputBuffer;
+		if(!opts.noBlockBedOutStream->open(opts.noBlockBedOut)){
+			cerr<<"cannot open "<<opts.noBlockBedOut<<" for writing. abort"<<endl;
+			return 1;
+		}
 	}
 	
 	if(hasOpt(optmap,"--rpkm")){
@@ -518,22 +3701,112 @@ int main(int argc,char*argv[])
 	}
 	
 	opts.forceFlexMaxBasepairPolicy=hasOpt(optmap,"--force-flexmax-bp-policy");
+	opts.sweep=hasOpt(optmap,"--sweep");
+	opts.scanTotalReads=hasOpt(optmap,"--scan-total-reads");
+	opts.useTotalsCache=hasOpt(optmap,"--totals-cache");
+	opts.matrix=hasOpt(optmap,"--matrix");
+	opts.serveSocket=getOptValue(optmap,"--serve","");
+	opts.serveCacheSize=atoi(getOptValue(optmap,"--serve-cache","16").c_str());
+	
+	vector<string> selectionArgs;
+	getOptValues(selectionArgs,optmap,"--region");
+	for(vector<string>::iterator i=selectionArgs.begin();i!=selectionArgs.end();i++){
+		if(!opts.selection.addRegion(*i)){
+			cerr<<"invalid region "<<(*i)<<". abort"<<endl;
+			printUsage(argsFinal.programName);
+			return 1;
+		}
+	}
+	
+	selectionArgs.clear();
+	getOptValues(selectionArgs,optmap,"--genes-file");
+	for(vector<string>::iterator i=selectionArgs.begin();i!=selectionArgs.end();i++){
+		if(!opts.selection.addNamesFromFile(*i)){
+			cerr<<"cannot open genes file "<<(*i)<<". abort"<<endl;
+			return 1;
+		}
+	}
+	
+	if(opts.selection.active() && opts.sweep){
+		//a sweep reads every bam whole; the selected genes are reached faster through the index
+		cerr<<"--sweep is ignored with --region or --genes-file"<<endl;
+		opts.sweep=false;
+	}
+	opts.em=hasOpt(optmap,"--em");
+	opts.emTolerance=atof(getOptValue(optmap,"--em-tolerance","1e-4").c_str());
+	opts.emMaxIterations=atoi(getOptValue(optmap,"--em-max-iterations","1000").c_str());
+	opts.writeClassesFile=getOptValue(optmap,"--write-classes","");
+	opts.classesFile=getOptValue(optmap,"--classes","");
+	
+	if(hasOpt(optmap,"--max-mem") && !parseMemorySize(getOptValue(optmap,"--max-mem"),opts.maxMem)){
+		cerr<<"invalid --max-mem "<<getOptValue(optmap,"--max-mem")<<". abort"<<endl;
+		printUsage(argsFinal.programName);
+		return 1;
+	}
 	
+	const char* tmpDirEnv=getenv("TMPDIR");
+	opts.tmpDir=getOptValue(optmap,"--tmp-dir",(tmpDirEnv && tmpDirEnv[0])?tmpDirEnv:"/tmp");
 	
-	if(opts.bamfilenames.size()==0){
+	if(opts.em && opts.expressionMode!=EXPRESSIONMODE_FPKM_DIVHITS && opts.expressionMode!=EXPRESSIONMODE_RPKM_DIVHITS){
+		cerr<<"--em takes the place of the division by NH. Use it with --fpkm-divhits or --rpkm-divhits"<<endl;
+		return 1;
+	}
+	
+	if(opts.keepsClasses() || opts.classesFile!=""){
+		if(opts.matrix || opts.serveSocket!="" || opts.selection.active()){
+			cerr<<"--em, --write-classes and --classes cannot be used with --matrix, --serve, --region or --genes-file"<<endl;
+			return 1;
+		}
+		
+		if(opts.classesFile!="" && (opts.writeClassesFile!="" || opts.bamfilenames.size()>0)){
+			cerr<<"--classes takes the place of the bam files and cannot be used with --bamfile or --write-classes"<<endl;
+			return 1;
+		}
+		
+		//equivalence classes need every alignment of a read, which the sweep visits once
+		opts.sweep=(opts.classesFile=="");
+	}
+	
+	opts.numThreads=atoi(getOptValue(optmap,"--threads","1").c_str());
+	if(opts.numThreads<1){
+		opts.numThreads=1;
+	}
+	
+	if(hasOpt(optmap,"--stats-json")){
+		if(opts.serveSocket!=""){
+			cerr<<"--stats-json is ignored with --serve"<<endl;
+		}else{
+			opts.stats=new RunStats(getOptValue(optmap,"--stats-json"));
+		}
+	}
+	
+	
+	if(opts.bamfilenames.size()==0 && opts.buildBlockIndexFile=="" && opts.serveSocket=="" && opts.classesFile==""){
 		cerr<<"no bam file specified"<<endl;
 		printUsage(argsFinal.programName);
 		return 1;
 	}
 	
-	if(opts.bedfilenames.size()==0){
+	if(opts.matrix && opts.totalNumOfReadsPerBam.size()>0 && opts.totalNumOfReadsPerBam.size()!=opts.bamfilenames.size()){
+		cerr<<"with --matrix, --total-num-reads has to be given once for each bam file"<<endl;
+		printUsage(argsFinal.programName);
+		return 1;
+	}
+	
+	if(opts.blockIndexFile!=""){
+		if(opts.bedfilenames.size()>0 || opts.buildBlockIndexFile!=""){
+			cerr<<"--block-index cannot be used with --bedfile or --build-block-index"<<endl;
+			printUsage(argsFinal.programName);
+			return 1;
+		}
+	}else if(opts.bedfilenames.size()==0){
 		cerr<<"no bed file specified"<<endl;
 		printUsage(argsFinal.programName);
 		return 1;
 	}
 	
-	for(vector<string>::iterator i=opts.bamfilenames.begin();i!=opts.bamfilenames.end();i++){
-		opts.bamfiles.push_back(new BamReader(*i));
+	if(opts.stats && opts.bedfilenames.size()>0){
+		opts.stats->beginPhase("load annotation");
 	}
 	
 	for(vector<string>::iterator i=opts.bedfilenames.begin();i!=opts.bedfilenames.end();i++){
@@ -542,15 +3815,44 @@ int main(int argc,char*argv[])
 		opts.annotations.push_back(annot);
 	}
 	
-	int success_status=runGeneRPKM(opts);
+	if(opts.stats && opts.bedfilenames.size()>0){
+		opts.stats->endPhase();
+	}
 	
-	//now clean up
-	for(vector<BamReader*>::iterator i=opts.bamfiles.begin();i!=opts.bamfiles.end();i++)
-	{
-		(*i)->close();
-		delete *i;
+	int success_status;
+	string mode;
+	
+	if(opts.buildBlockIndexFile!=""){
+		mode="build-block-index";
+		GeneTable genes;
+		success_status=loadGenes(opts,genes)?0:1;
+		if(success_status==0){
+			if(opts.stats){
+				opts.stats->beginPhase("write block index");
+			}
+			success_status=saveBlockIndex(opts,genes,opts.buildBlockIndexFile)?0:1;
+			if(opts.stats){
+				opts.stats->endPhase();
+			}
+		}
+	}else if(opts.serveSocket!=""){
+		success_status=runGeneRPKMServer(opts);
+	}else if(opts.matrix){
+		mode=opts.sweep?"matrix,sweep":"matrix,fetch";
+		success_status=runGeneRPKMMatrix(opts);
+	}else if(opts.classesFile!=""){
+		mode="classes";
+		success_status=runGeneRPKMFromClasses(opts);
+	}else{
+		mode=opts.sweep?"sweep":"fetch";
+		success_status=runGeneRPKM(opts);
+	}
+	
+	if(opts.stats){
+		writeStatsJson(opts,mode);
 	}
 	
+	//now clean up
 	for(vector<Annotation*>::iterator i=opts.annotations.begin();i!=opts.annotations.end();i++){
 		delete *i;
 	}
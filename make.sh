@@ -13,5 +13,17 @@ if [[ $SAMTOOLPATH == "" ]]; then
 	exit
 fi
 
-g++ -o geneRPKM -I$SAMTOOLPATH -I$CPPUTILCLASSES -I$CPPBIOCLASSES -L$SAMTOOLPATH -lbam -lz -lm geneRPKM_main.cpp AdvGetOptCpp/AdvGetOpt.cpp $SAMTOOLPATH/libbam.a 
-g++ -o filterMaxHits -I$SAMTOOLPATH -I$CPPUTILCLASSES -I$CPPBIOCLASSES -L$SAMTOOLPATH -lbam -lz -lm filterMaxHits_main.cpp AdvGetOptCpp/AdvGetOpt.cpp $SAMTOOLPATH/libbam.a
\ No newline at end of file
+#optional: a libdeflate build (libdeflate.h and libdeflate.a) for faster bgzf blocks in filterMaxHits
+DEFLATEFLAGS=""
+if [[ $LIBDEFLATEPATH != "" ]]; then
+	DEFLATEFLAGS="-DHAVE_LIBDEFLATE -I$LIBDEFLATEPATH $LIBDEFLATEPATH/libdeflate.a"
+fi
+
+g++ -o geneRPKM -I$SAMTOOLPATH -I$CPPUTILCLASSES -I$CPPBIOCLASSES -L$SAMTOOLPATH -lbam -lz -lm -lpthread geneRPKM_main.cpp AdvGetOptCpp/AdvGetOpt.cpp FingerprintSpill.cpp MultiMapperSpill.cpp $SAMTOOLPATH/libbam.a 
+g++ -o filterMaxHits -I$SAMTOOLPATH -I$CPPUTILCLASSES -I$CPPBIOCLASSES -L$SAMTOOLPATH -lbam -lz -lm -lpthread filterMaxHits_main.cpp AdvGetOptCpp/AdvGetOpt.cpp BgzfPipeline.cpp FingerprintSpill.cpp ReadHitsSpill.cpp $SAMTOOLPATH/libbam.a $DEFLATEFLAGS
+g++ -O2 -o makeSyntheticData bench/makeSyntheticData.cpp AdvGetOptCpp/AdvGetOpt.cpp
+
+if [[ $1 == "bench" ]]; then
+	shift
+	bench/bench.sh "$@"
+fi